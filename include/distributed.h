@@ -0,0 +1,75 @@
+// Real-Time Physics Tutorials
+// Brandon Pelfrey
+// SPH Fluid Simulation
+
+// Distributed simulation over MPI, for particle counts beyond one node.
+// Every process (rank) owns the particles of one slab of the domain along y,
+// the long axis of the falling column, and runs step() on them.
+// Slabs are at least r thick, so all neighbors of a particle are owned by
+// its own rank or by one of the two adjacent ones. step() calls back twice:
+//   after UPDATE   particles that left their slab migrate to the rank that owns their
+//                  new position, then every rank sends copies of its particles within r
+//                  of a slab border to the rank on the other side, which appends them
+//                  as ghosts (see ghostCount)
+//   after DENSITY  the densities of those particles follow, so the forces of the owned
+//                  particles see the same neighborhoods as in a single process
+// With adaptiveTimeStep the ranks agree on the smallest next time step after UPDATE.
+// Every rebalanceInterval steps the borders are moved so that every rank owns about
+// the same number of particles, from a histogram of the y coordinates in bins of r.
+//
+// Only built with MPI (target sph-mpi-bench). Needs PAIR_EVALUATION_FULL,
+// the symmetric passes would write to the ghosts, and SOLVER_DOUBLE_DENSITY, the iterations
+// of the other solvers would need the ghosts after every iteration. The spatial index and the
+// Verlet lists are rebuilt every step, since ghosts and migrants change the slots.
+
+#pragma once
+
+#include <sph.h>
+
+#include <mpi.h>
+
+#include <vector>
+
+// --------------------------------------------------------------------
+
+// Slab borders are recomputed every this many steps (0 keeps the initial ones)
+extern unsigned int rebalanceInterval;
+
+// Counters of this rank since startDistributed()
+struct DistributedStats
+{
+    unsigned int rebalances;
+    unsigned long long migrated;    // particles sent to other ranks
+    unsigned long long ghosts;      // ghosts received, summed over all steps
+    double exchangeUs;              // time of both callbacks, including waiting for other ranks
+};
+const DistributedStats& distributedStats();
+
+/**
+* Splits the particles into slabs over the ranks of comm and starts distributed stepping.
+* Call on every rank after init() or loadSnapshot() with the same particles,
+* each rank keeps the ones of its slab. Collective.
+*/
+void startDistributed( MPI_Comm comm );
+
+/**
+* Drops the ghosts and stops distributed stepping,
+* every rank keeps the particles it owns
+*/
+void stopDistributed();
+
+/**
+* Borders of the slab of this rank, y in [begin, end)
+*/
+float slabBegin();
+float slabEnd();
+
+/**
+* Number of particles over all ranks. Collective.
+*/
+unsigned long long distributedParticleCount();
+
+/**
+* Collects the positions of all particles in stable id order on root. Collective.
+*/
+void gatherPositions( std::vector<vecD>& positions, const int root );
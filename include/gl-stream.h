@@ -0,0 +1,57 @@
+#pragma once
+
+// Streaming of per-frame vertex data through persistently mapped buffer storage.
+// The buffer holds GL_STREAM_REGIONS regions that are written round robin:
+// while the GPU still draws from one region, the CPU writes the next one
+// straight into mapped memory, and a fence per region keeps the CPU from
+// overwriting a region the GPU has not finished reading.
+// The demo copies its frames into the region from the triple buffer of simulation-thread.h,
+// see streamGLVertices in gl-windows.h.
+// Needs GL 4.4 or ARB_buffer_storage and loaded GL functions, but no window system.
+
+#include <cstddef>
+
+#define GL_STREAM_REGIONS 3
+
+/**
+* Persistent coherent buffer of GL_STREAM_REGIONS regions of regionBytes each
+*/
+struct GLVertexStream {
+	unsigned int vbo = 0;
+	unsigned char* mapped = 0;
+	size_t regionBytes = 0;
+	unsigned int region = 0; // region written last
+	void* fences[GL_STREAM_REGIONS] = {}; // GLsync of the draws reading each region
+	double waitMs = 0; // time the last call to nextGLVertexStreamRegion waited for its fence
+};
+
+/**
+* True if the current context supports glBufferStorage
+*/
+bool isGLVertexStreamSupported();
+
+/**
+* Allocates and maps the buffer, returns false if not supported
+*/
+bool createGLVertexStream(size_t regionBytes, GLVertexStream* outStream);
+
+/**
+* Waits for the GPU and frees the buffer
+*/
+void deleteGLVertexStream(GLVertexStream* stream);
+
+/**
+* Advances to the next region and returns it for writing,
+* after waiting until the GPU finished the draws that read it last time
+*/
+void* nextGLVertexStreamRegion(GLVertexStream* stream);
+
+/**
+* Byte offset of the region written last, draw from here
+*/
+size_t currentGLVertexStreamOffset(const GLVertexStream* stream);
+
+/**
+* Call after issuing all draws that read the region written last
+*/
+void fenceGLVertexStreamRegion(GLVertexStream* stream);
@@ -20,13 +20,31 @@ void createGLQuad();
 */
 void createGLTriangles2D(size_t bytes, void* outBuffer, void* data = 0);
 
+/**
+* Stream the vertices of createGLPoints2D through a persistently mapped buffer (gl-stream.h)
+* instead of reallocating them with glBufferData every frame, if the context supports it.
+* Off by default: the solver does not write into the mapped memory, its frames arrive through the
+* triple buffer of simulation-thread.h, so updateGLVertexData() still copies every frame once into
+* the mapped region. That measured no faster than glBufferData on llvmpipe (sph-stream-bench),
+* which keeps buffers in host memory; the driver copy it saves matters on discrete GPUs.
+* Set before createGLPoints2D().
+*/
+extern bool streamGLVertices;
+
 /**
 *
 */
 void createGLPoints2D(size_t bytes, GLVertexHandle* outHandle, void* data = 0, int stride = 0);
 
 /**
-*
+* Returns mapped memory to write the next bytes of vertex data to, which are drawn from the next frame on,
+* or 0 if the vertices of handle are not streamed (streamGLVertices off or no GL 4.4), see gl-stream.h
+*/
+void* mapGLVertexData(GLVertexHandle handle, size_t bytes);
+
+/**
+* Copies data into the region of mapGLVertexData() if the vertices are streamed,
+* otherwise reallocates the buffer with glBufferData
 */
 void updateGLVertexData(GLVertexHandle handle, size_t bytes, void* data);
 
@@ -79,4 +97,9 @@ void getGLWindowSize(unsigned int* s);
 */
 void pushGLView(float* proj = 0);
 
+/**
+* Sets a line of text shown after the frame info in the REPL, e.g. simulation timings
+*/
+void setGLStatusText(const char* text);
+
 void updateGLLightSource(float x, float y, float z);
\ No newline at end of file
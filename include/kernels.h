@@ -0,0 +1,173 @@
+// Real-Time Physics Tutorials
+// Brandon Pelfrey
+// SPH Fluid Simulation
+
+// Smoothing kernels of DENSITY as policy classes. sph.cpp instantiates DENSITY and the
+// passes of SOLVER_PBF and SOLVER_DFSPH that evaluate the kernel once per kernel,
+// setKernel() (sph.h) only picks the instantiation before each pass.
+//
+// A kernel is a shape S(x) over x = |rij| / h with the support h = Support * r, and
+// gives the four weights of the double-density model per pair:
+//   density       W = C S(x)                          q^2 with the linear kernel
+//   near density  W ( 1 - x )                         q^3
+//   force         -dW/dx / ( 2 Support )              q
+//   near force    -d( W ( 1 - x ) )/dx / ( 3 Support )  q^2
+// DENSITY stores the force weights in Neighbor::q and q2, so PRESSURE FORCE and VISCOSITY
+// run unchanged for every kernel, and the gradient of W by the distance is 2 force / r.
+// C scales the integral of W over the support to the one of the linear kernel
+// ( 1 - |rij| / r )^2, which keeps rest_density and the pressure constants of the materials:
+//   C = M_linear / ( M_S Support^D ),  M = integral of S(x) x^(D-1) over [0, 1]
+// Smoother kernels tolerate a support below r, which means fewer neighbors. Each policy
+// brings the smallest Support that all solvers kept stable in the dam break of init(),
+// in 3D the neighbor count falls with its cube, which leaves too few below 0.9 r.
+// The neighbor search still covers r.
+
+#pragma once
+
+#include <sph.h>
+
+#include <cmath>
+
+// --------------------------------------------------------------------
+struct KernelTerms
+{
+    float density;
+    float nearDensity;
+    float force;
+    float nearForce;
+};
+
+// Moment integral of the linear kernel
+constexpr float linearKernelMoment = SPH_DIMENSION == 3 ? 1.0f / 30 : 1.0f / 12;
+
+// Weights from the shape S and its slope -dS/dx at x
+template< class Kernel >
+inline KernelTerms shapeTerms( const float x, const float shape, const float slope )
+{
+    const float s = Kernel::Support;
+    const float c = linearKernelMoment / ( Kernel::Moment * ( SPH_DIMENSION == 3 ? s * s * s : s * s ) );
+    KernelTerms w;
+    w.density = c * shape;
+    w.nearDensity = w.density * ( 1 - x );
+    w.force = c * slope * ( 1 / ( 2 * s ) );
+    w.nearForce = c * ( slope * ( 1 - x ) + shape ) * ( 1 / ( 3 * s ) );
+    return w;
+}
+
+// --------------------------------------------------------------------
+// ( 1 - x )^2 of the original tutorial, Clavet et al. 2005.
+// Its gradient does not vanish at the center, so close pairs repel strongly.
+struct LinearKernel
+{
+    static constexpr float Support = 1;
+
+    static KernelTerms Terms( const float x )
+    {
+        const float q = 1 - x;
+        KernelTerms w;
+        w.density = q * q;
+        w.nearDensity = w.density * q;
+        w.force = q;
+        w.nearForce = q * q;
+        return w;
+    }
+};
+
+// ( 1 - x^2 )^3, Mueller et al. 2003. Cheap and smooth, but its gradient vanishes at the center,
+// so close pairs barely repel and SOLVER_PBF clumps the particles below 0.8 r.
+struct Poly6Kernel
+{
+    static constexpr float Support = 0.9f;
+    static constexpr float Moment = SPH_DIMENSION == 3 ? 16.0f / 315 : 1.0f / 8;
+
+    static KernelTerms Terms( const float x )
+    {
+        const float a = 1 - x * x;
+        return shapeTerms<Poly6Kernel>( x, a * a * a, 6 * x * a * a );
+    }
+};
+
+// ( 1 - x )^3, Mueller et al. 2003. Keeps a gradient at the center like the linear kernel.
+struct SpikyKernel
+{
+    static constexpr float Support = SPH_DIMENSION == 3 ? 0.9f : 0.8f;
+    static constexpr float Moment = SPH_DIMENSION == 3 ? 1.0f / 60 : 1.0f / 20;
+
+    static KernelTerms Terms( const float x )
+    {
+        const float a = 1 - x;
+        return shapeTerms<SpikyKernel>( x, a * a * a, 3 * a * a );
+    }
+};
+
+// Cubic B-spline of Monaghan 1992 on the support [0, 1]
+struct CubicSplineKernel
+{
+    static constexpr float Support = SPH_DIMENSION == 3 ? 0.9f : 0.7f;
+    static constexpr float Moment = SPH_DIMENSION == 3 ? 1.0f / 32 : 7.0f / 80;
+
+    static KernelTerms Terms( const float x )
+    {
+        if( x < 0.5f )
+        {
+            return shapeTerms<CubicSplineKernel>( x, 1 - 6 * x * x + 6 * x * x * x, 12 * x - 18 * x * x );
+        }
+        const float a = 1 - x;
+        return shapeTerms<CubicSplineKernel>( x, 2 * a * a * a, 6 * a * a );
+    }
+};
+
+// Wendland C2 ( 1 - x )^4 ( 1 + 4 x ), Wendland 1995. Smooth with a positive Fourier
+// transform, so particles do not pair up at large neighbor counts.
+struct WendlandC2Kernel
+{
+    static constexpr float Support = SPH_DIMENSION == 3 ? 0.9f : 0.7f;
+    static constexpr float Moment = SPH_DIMENSION == 3 ? 1.0f / 42 : 1.0f / 14;
+
+    static KernelTerms Terms( const float x )
+    {
+        const float a = 1 - x;
+        const float a3 = a * a * a;
+        return shapeTerms<WendlandC2Kernel>( x, a3 * a * ( 1 + 4 * x ), 20 * x * a3 );
+    }
+};
+
+// --------------------------------------------------------------------
+// Samples of Kernel::Terms for tabulatedKernel over x in [0, 1],
+// 16 KB that stay in the L1 cache
+#define KERNEL_TABLE_SIZE 1024
+template< class Kernel >
+struct KernelTable
+{
+    KernelTerms w[KERNEL_TABLE_SIZE + 1];
+
+    KernelTable()
+    {
+        for( int i = 0; i <= KERNEL_TABLE_SIZE; ++i )
+        {
+            w[i] = Kernel::Terms( (float)i / KERNEL_TABLE_SIZE );
+        }
+    }
+
+    // x in [0, 1]. A pair just inside the support may still round to x = 1,
+    // which interpolates to the last sample, Kernel::Terms( 1 ) = 0.
+    KernelTerms Lookup( const float x ) const
+    {
+        const float u = x * KERNEL_TABLE_SIZE;
+        const int i = u < KERNEL_TABLE_SIZE ? (int)u : KERNEL_TABLE_SIZE - 1;
+        const float f = u - (float)i;
+        const KernelTerms& a = w[i];
+        const KernelTerms& b = w[i + 1];
+        KernelTerms t;
+        t.density = a.density + ( b.density - a.density ) * f;
+        t.nearDensity = a.nearDensity + ( b.nearDensity - a.nearDensity ) * f;
+        t.force = a.force + ( b.force - a.force ) * f;
+        t.nearForce = a.nearForce + ( b.nearForce - a.nearForce ) * f;
+        return t;
+    }
+
+    static const KernelTable Instance;
+};
+
+template< class Kernel >
+const KernelTable<Kernel> KernelTable<Kernel>::Instance;
@@ -0,0 +1,142 @@
+// Real-Time Physics Tutorials
+// Brandon Pelfrey
+// SPH Fluid Simulation
+
+// Per-phase timing of step().
+// Every step records the wall time of each phase and the busy time of each
+// OpenMP thread inside it into a ring buffer of the last PROFILE_CAPACITY steps.
+// Recording costs two clock reads per phase and per thread,
+// define SPH_PROFILING as 0 to compile it out entirely.
+
+#pragma once
+
+#ifndef SPH_PROFILING
+#define SPH_PROFILING 1
+#endif
+
+// Number of steps kept in the ring buffer
+#define PROFILE_CAPACITY 256
+
+// --------------------------------------------------------------------
+// Phases of step(), in execution order
+enum ProfilePhase
+{
+    PHASE_REORDER,
+    PHASE_UPDATE,
+    PHASE_SPATIAL_INDEX,
+    PHASE_DENSITY,
+    PHASE_PRESSURE,
+    PHASE_PRESSURE_FORCE,
+    PHASE_VISCOSITY,
+    PHASE_FUSED_FORCES,  // replaces the three phases above when fusePasses is set
+    PHASE_CONSTRAINTS,   // SOLVER_PBF, replaces PRESSURE to FUSED FORCES except VISCOSITY
+    PHASE_DIVERGENCE,    // SOLVER_DFSPH, which runs its constant density solver as PRESSURE
+    PHASE_COUNT
+};
+
+// Timing of one phase, all times in microseconds since the first recorded step
+struct PhaseProfile
+{
+    double begin, end;   // wall time on the thread calling step(), equal if the phase did not run
+    double thread_min;   // shortest busy time of a worker thread
+    double thread_max;   // longest busy time of a worker thread
+    int threads;         // number of worker threads, 0 for sequential phases
+};
+
+// Convergence of the iterative pressure solvers, all zero for SOLVER_DOUBLE_DENSITY
+struct SolverProfile
+{
+    unsigned int iterations;            // of the density (constant density) solver
+    float densityError;                 // mean ( rho - rest_density ) / rest_density of the last iteration, compression only
+    unsigned int divergenceIterations;  // of the divergence solver (SOLVER_DFSPH)
+    float divergenceError;              // mean density change over the step of the last iteration, relative to rest_density
+};
+
+struct StepProfile
+{
+    unsigned int step;
+    double begin, end;
+    PhaseProfile phases[PHASE_COUNT];
+    SolverProfile solver;
+};
+
+/**
+* Upper-case name of a phase as used in the comments of step()
+*/
+const char* profilePhaseName( const int phase );
+
+/**
+* Number of steps available in the ring buffer
+*/
+unsigned int profileStepCount();
+
+/**
+* Profile of a recent step, 0 being the latest. Returns 0 if not available.
+*/
+const StepProfile* profileStep( const unsigned int age );
+
+/**
+* Busy interval of worker thread t during a phase of a recent step.
+* Returns false if the thread did not take part.
+*/
+bool profileThreadSpan( const unsigned int age, const int phase, const int t, double* begin, double* end );
+
+/**
+* Forgets all recorded steps
+*/
+void profileReset();
+
+/**
+* Writes the ring buffer in the Chrome trace event format (chrome://tracing, Perfetto).
+* Phases are on lane 0, worker threads on lanes 1 and up.
+*/
+bool writeChromeTrace( const char* path );
+
+// --------------------------------------------------------------------
+// Recording, used by the simulation
+
+#if SPH_PROFILING
+
+// Opens a new ring buffer entry and closes it on destruction
+class ProfileStepScope
+{
+public:
+    explicit ProfileStepScope( const unsigned int step );
+    ~ProfileStepScope();
+};
+
+// Wall time of a phase on the calling thread
+class ProfilePhaseScope
+{
+    const int mPhase;
+public:
+    explicit ProfilePhaseScope( const int phase );
+    ~ProfilePhaseScope();
+};
+
+// Busy time of one worker thread inside a parallel region
+class ProfileThreadScope
+{
+    const int mPhase;
+    const double mBegin;
+public:
+    explicit ProfileThreadScope( const int phase );
+    ~ProfileThreadScope();
+};
+
+// Iterations and remaining errors of the pressure solver of the current step
+void profileSolver( const SolverProfile& solver );
+
+#define PROFILE_STEP( step ) ProfileStepScope profileStep_( step )
+#define PROFILE_PHASE( phase ) ProfilePhaseScope profilePhase_( phase )
+#define PROFILE_THREAD( phase ) ProfileThreadScope profileThread_( phase )
+#define PROFILE_SOLVER( solver ) profileSolver( solver )
+
+#else
+
+#define PROFILE_STEP( step )
+#define PROFILE_PHASE( phase )
+#define PROFILE_THREAD( phase )
+#define PROFILE_SOLVER( solver )
+
+#endif
@@ -0,0 +1,60 @@
+// Real-Time Physics Tutorials
+// Brandon Pelfrey
+// SPH Fluid Simulation
+
+// Vectorized inner loops of DENSITY and PRESSURE FORCE.
+// The neighbors of one particle are gathered into contiguous arrays by the caller,
+// the kernels process 8 (AVX2) or 4 (NEON) neighbors at a time with masked tails.
+// The instruction set is picked at runtime with setSimdISA( simdBestISA() ).
+// The default SIMD_SCALAR keeps the original scalar loops, which are faster
+// as long as particles only have around ten neighbors, since gathering
+// the neighbors costs more than the vectorized math saves.
+// The kernels do the same IEEE operations per neighbor as the scalar loops,
+// only the order of the final sums differs.
+// With SPH_DIMENSION 3 only SIMD_SCALAR is available.
+
+#pragma once
+
+// --------------------------------------------------------------------
+#define SIMD_SCALAR 0
+#define SIMD_AVX2 1
+#define SIMD_NEON 2
+
+/**
+* Best instruction set supported by this CPU and build
+*/
+int simdBestISA();
+
+/**
+* Instruction set currently used by the simulation, SIMD_SCALAR by default
+*/
+int simdISA();
+
+/**
+* Selects an instruction set, returns false if it is not supported
+*/
+bool setSimdISA( const int isa );
+
+/**
+* Lower-case name of an instruction set
+*/
+const char* simdISAName( const int isa );
+
+/**
+* Density of particle (px, py) from n gathered neighbor positions.
+* Writes q = 1 - |rij| / h and the unit vector rij / |rij| into dx, dy of every neighbor
+* inside the radius of support h, and q = -1 for neighbors outside (whose direction is undefined).
+* Adds the sums of q^2 and q^3 to d and dn.
+*/
+void simdDensity( const float px, const float py, const float* x, const float* y, const unsigned int n,
+                  const float h, float* q, float* dx, float* dy, float* d, float* dn );
+
+/**
+* Pressure displacement of a particle from n gathered neighbors, with the directions
+* of DENSITY (see Neighbor): the sum of dir * ( q * ( press_i + press ) + q2 * ( press_near_i + press_near ) ).
+* Adds the sum to fx, fy.
+*/
+void simdPressureForce( const float press_i, const float press_near_i,
+                        const float* dx, const float* dy, const float* q, const float* q2,
+                        const float* press, const float* press_near, const unsigned int n,
+                        float* fx, float* fy );
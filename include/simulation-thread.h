@@ -0,0 +1,71 @@
+// Real-Time Physics Tutorials
+// Brandon Pelfrey
+// SPH Fluid Simulation
+
+// Runs step() on a thread of its own, so that rendering and frame pacing
+// do not slow down the solver.
+// Snapshots of the particle vertices are published through a lock-free triple buffer:
+// the simulation thread fills its back buffer and swaps it with the middle one,
+// the frontend swaps the middle one with its front buffer if a newer frame arrived.
+// The swaps never wait and the frontend always sees the latest complete frame.
+// With stepsPerFrame > 0 the simulation thread runs at most one frame ahead, though:
+// after publishing a frame it blocks until the frontend has taken it.
+// With 0 it never waits for the frontend.
+// While the thread runs, the particles belong to it. The frontend changes them
+// (or attractor, init() etc.) by posting commands, which run between two steps.
+
+#pragma once
+
+#include <sph.h>
+#include <profile.h>
+
+#include <functional>
+
+// --------------------------------------------------------------------
+struct SimulationFrame
+{
+    const Particles::Position* vertices; // N vertices, as particles.vertices() at the time of publishing
+    unsigned int N;
+    unsigned int steps;                  // steps simulated since the thread was started
+    double stepMs;                       // mean time of the steps since the previous frame
+    double stepsPerSecond;               // steps simulated in the last second of wall time
+    double time;                         // simulated time in base steps, see STEP_SECONDS
+    float timeStep;                      // size of the latest step
+    int solver;                          // SOLVER_* of the latest step
+    int kernel;                          // KERNEL_* of the latest step
+    StepProfile profile;                 // profile of the latest step, if recorded
+    bool profiled;
+};
+
+/**
+* Starts stepping the simulation on a new thread.
+* With stepsPerFrame 0 it steps continuously and publishes a frame after every step.
+* Otherwise it runs stepsPerFrame steps, publishes a frame and waits until the
+* frontend picked it up, so the next frame is simulated while the current one is drawn.
+* With adaptiveTimeStep a frame instead advances the simulated time by stepsPerFrame
+* base steps, in as many steps as the CFL condition asks for (see advance()).
+*/
+void startSimulationThread( const unsigned int stepsPerFrame );
+
+/**
+* Stops and joins the simulation thread, the particles belong to the caller again
+*/
+void stopSimulationThread();
+
+/**
+* Number of steps per published frame, see startSimulationThread()
+*/
+void setSimulationStepsPerFrame( const unsigned int stepsPerFrame );
+unsigned int simulationStepsPerFrame();
+
+/**
+* Runs f on the simulation thread before its next step.
+* Commands run in the order they were posted.
+*/
+void postSimulationCommand( const std::function<void()>& f );
+
+/**
+* Latest complete frame, or 0 before the first one.
+* Stays valid until the next call, which must be made from the same thread.
+*/
+const SimulationFrame* latestSimulationFrame();
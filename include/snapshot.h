@@ -0,0 +1,69 @@
+// Real-Time Physics Tutorials
+// Brandon Pelfrey
+// SPH Fluid Simulation
+
+// Checkpoint and restart of the simulation state.
+// A snapshot holds the step counter, the time stepping state, the material table and, per particle,
+// the attributes step() carries over from one step to the next: position, old position,
+// velocity, accumulated force, material, neighborhood mark and stable id.
+// Everything else (densities, pressures, neighbors, spatial index) is rebuilt by the next step.
+//
+// File layout, native byte order:
+//   page 0     SnapshotHeader
+//   page 1..   one section per attribute in storage order, each starting on a page boundary
+// Loading maps the file and points at the sections through their offsets in the header,
+// so there is nothing to parse, only one copy per attribute into the particle storage.
+// Vectors have SPH_DIMENSION components, so a snapshot of a 2D build fails
+// the section size check of a 3D build and vice versa.
+
+#pragma once
+
+#include <sph.h>
+
+#include <cstdint>
+
+// --------------------------------------------------------------------
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_ALIGNMENT 4096
+
+enum SnapshotSection
+{
+    SNAPSHOT_POS,       // vecD
+    SNAPSHOT_POS_OLD,   // vecD
+    SNAPSHOT_VEL,       // vecD
+    SNAPSHOT_FORCE,     // vecD
+    SNAPSHOT_MATERIAL,  // uint8_t, see Particles::material()
+    SNAPSHOT_MARK,      // float, see Particles::a()
+    SNAPSHOT_STABLE_ID, // uint32_t
+    SNAPSHOT_SECTION_COUNT
+};
+
+struct SnapshotHeader
+{
+    char magic[8];              // "SPHSNAP\0"
+    uint32_t version;           // SNAPSHOT_VERSION
+    uint32_t alignment;         // SNAPSHOT_ALIGNMENT
+    uint32_t N;
+    uint32_t steps;             // stepCount() when saved
+    Material materials[MATERIAL_TABLE_SIZE];
+    float lastTimeStep, nextStep;   // TimeStepState when saved
+    double time;
+    uint32_t velocities;        // 1 if the old positions hold velocities
+    uint32_t sectionCount;      // SNAPSHOT_SECTION_COUNT
+    struct Section
+    {
+        uint64_t offset;        // from the start of the file, multiple of alignment
+        uint64_t bytes;
+    } sections[SNAPSHOT_SECTION_COUNT];
+};
+
+/**
+* Writes the current state. Returns false if the file could not be written.
+*/
+bool saveSnapshot( const char* path );
+
+/**
+* Allocates the particles of a snapshot, call instead of init().
+* Returns false without allocating if the file is missing, truncated or of another version.
+*/
+bool loadSnapshot( const char* path );
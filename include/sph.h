@@ -0,0 +1,712 @@
+// Real-Time Physics Tutorials
+// Brandon Pelfrey
+// SPH Fluid Simulation
+
+// Simulation core shared by the interactive demo and the benchmark.
+// It has no dependencies on windowing or OpenGL.
+
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#ifdef _MSC_VER
+#include <malloc.h> // _aligned_malloc
+#endif
+
+// --------------------------------------------------------------------
+
+// Number of spatial dimensions, 2 or 3. Positions, velocities and forces are vecD,
+// the neighborhood of a particle is the 3x3 (2D) or 3x3x3 (3D) block of grid cells around it.
+// The 3D solver walls in the fluid along z like along x, the SIMD kernels (simd.h) are 2D only.
+#ifndef SPH_DIMENSION
+#define SPH_DIMENSION 2
+#endif
+
+#if SPH_DIMENSION != 2 && SPH_DIMENSION != 3
+#error "SPH_DIMENSION has to be 2 or 3"
+#endif
+
+typedef glm::vec<SPH_DIMENSION, float> vecD;
+typedef glm::vec<SPH_DIMENSION, int> ivecD;
+
+// --------------------------------------------------------------------
+
+// Rows of the material table with presets, see materials
+#define MATERIAL_DEFAULT 0
+#define MATERIAL_SNOW 1
+#define MATERIAL_SLIME 2
+#define MATERIAL_TABLE_SIZE 8   // rows after the presets start as copies of MATERIAL_DEFAULT
+
+// --------------------------------------------------------------------
+
+#define SPATIAL_INDEX_HASHMAP 0 // unordered_map of cell lists, built sequentially
+#define SPATIAL_INDEX_GRID 1    // flat counting-sort grid, built in parallel
+
+#ifndef CURRENT_SPATIAL_INDEX
+#define CURRENT_SPATIAL_INDEX SPATIAL_INDEX_GRID
+#endif
+
+// --------------------------------------------------------------------
+
+#define PARTICLE_LAYOUT_AOS 0 // position array plus one Meta record per particle
+#define PARTICLE_LAYOUT_SOA 1 // one aligned stream per attribute
+
+#ifndef CURRENT_PARTICLE_LAYOUT
+#define CURRENT_PARTICLE_LAYOUT PARTICLE_LAYOUT_AOS
+#endif
+
+// --------------------------------------------------------------------
+
+#define PAIR_EVALUATION_FULL 0      // every particle visits all of its neighbors
+#define PAIR_EVALUATION_SYMMETRIC 1 // every pair is visited once and updates both particles
+
+#ifndef CURRENT_PAIR_EVALUATION
+#define CURRENT_PAIR_EVALUATION PAIR_EVALUATION_FULL
+#endif
+
+#if CURRENT_PAIR_EVALUATION == PAIR_EVALUATION_SYMMETRIC && CURRENT_SPATIAL_INDEX != SPATIAL_INDEX_GRID
+#error "Symmetric pair evaluation colors the cells of the uniform grid"
+#endif
+
+// --------------------------------------------------------------------
+
+// Pressure solvers, selected at runtime with setSolver()
+#define SOLVER_DOUBLE_DENSITY 0 // near and far pressure of Clavet et al., applied as forces by the next UPDATE
+#define SOLVER_PBF 1            // Position Based Fluids, iterates on the positions until they are at rest density
+#define SOLVER_DFSPH 2          // Divergence-free SPH, iterates on the velocities until they keep the rest density
+#define SOLVER_COUNT 3
+
+// Smoothing kernels, selected at runtime with setKernel() (see kernels.h)
+#define KERNEL_LINEAR 0         // ( 1 - |rij| / r )^2 of Clavet et al.
+#define KERNEL_POLY6 1          // ( 1 - x^2 )^3 of Mueller et al.
+#define KERNEL_SPIKY 2          // ( 1 - x )^3 of Mueller et al.
+#define KERNEL_CUBIC_SPLINE 3   // cubic B-spline of Monaghan
+#define KERNEL_WENDLAND_C2 4    // ( 1 - x )^4 ( 1 + 4 x ) of Wendland
+#define KERNEL_COUNT 5
+
+// --------------------------------------------------------------------
+// Data structures are 8 byte aligned for optimal loading on 64 bit systems
+#pragma pack(push, 8)
+
+struct Neighbor;
+
+// Streams of the SoA layout are aligned to cache lines
+inline void* alignedMalloc( size_t bytes )
+{
+#ifdef _MSC_VER
+    return _aligned_malloc( bytes, 64 );
+#else
+    void* p = 0;
+    return posix_memalign( &p, 64, bytes ) == 0 ? p : 0;
+#endif
+}
+
+inline void alignedFree( void* p )
+{
+#ifdef _MSC_VER
+    _aligned_free( p );
+#else
+    free( p );
+#endif
+}
+
+// Moves the first oldBytes of p to a new aligned block of bytes
+inline void* alignedRealloc( void* p, size_t oldBytes, size_t bytes )
+{
+    void* q = alignedMalloc( bytes );
+    if( q && p )
+    {
+        memcpy( q, p, oldBytes < bytes ? oldBytes : bytes );
+    }
+    alignedFree( p );
+    return q;
+}
+
+#if CURRENT_PARTICLE_LAYOUT == PARTICLE_LAYOUT_AOS
+
+// The Particle structure holding all of the relevant information.
+// Positions are kept apart from the rest, everything else is one record per particle.
+struct Particles
+{
+    struct Position {
+        vecD pos;
+        float a = .0f; // used to mark neighborhood
+    };
+    struct Meta {
+
+        unsigned int id; // index, valid for all data arrays
+
+        float r, g, b; // debug color
+
+        //glm::mat2 G; //TODO anisotropy matrix
+
+        vecD pos_old; // for verlet? (the velocity with adaptiveTimeStep)
+        vecD vel;
+        vecD force;
+        float mass; // never used
+        float rho; // density
+        float rho_near; // ?
+        float press;
+        float press_near;
+        unsigned char material; // row of the materials table
+
+        // current neighbors 
+        // found via spatial hashing
+        // cleared when particle moves
+        //TODO try storing another array of all particles here,
+        // sorted by distance to this particle, 
+        // incrementally re-sort similar to sweep'n'prune
+        size_t neighbor_offset; // into the neighbor storage (shared pool or bounded slots)
+        size_t neighbor_count;
+    };
+    Position* positions;
+    Meta* meta;
+    unsigned int N;
+    unsigned int capacity; // allocated particles, see reserve()
+
+    // Storage order changes when particles are reordered for cache locality.
+    // Code outside the simulation that needs to follow a particle over time
+    // refers to it by its stable id instead of its storage index.
+    unsigned int* stable_id;     // stable id of the particle at each storage index
+    unsigned int* storage_index; // storage index of each stable id
+
+    void allocate( const unsigned int count )
+    {
+        N = capacity = count;
+        positions = (Position*)malloc( N * sizeof( Position ) );
+        meta = (Meta*)malloc( N * sizeof( Meta ) );
+        stable_id = (unsigned int*)malloc( N * sizeof( unsigned int ) );
+        storage_index = (unsigned int*)malloc( N * sizeof( unsigned int ) );
+    }
+
+    // Grows the storage to at least count particles, keeping the first N.
+    // storage_index is indexed by stable id and keeps its size.
+    void reserve( const unsigned int count )
+    {
+        if( count <= capacity )
+        {
+            return;
+        }
+        capacity = count;
+        positions = (Position*)realloc( positions, capacity * sizeof( Position ) );
+        meta = (Meta*)realloc( meta, capacity * sizeof( Meta ) );
+        stable_id = (unsigned int*)realloc( stable_id, capacity * sizeof( unsigned int ) );
+    }
+
+    void release()
+    {
+        free( meta );
+        free( positions );
+        free( stable_id );
+        free( storage_index );
+    }
+
+    // Copies all attributes of particle s in src to slot i
+    void copy( const unsigned int i, const Particles& src, const unsigned int s )
+    {
+        positions[i] = src.positions[s];
+        meta[i] = src.meta[s];
+        meta[i].id = i;
+        stable_id[i] = src.stable_id[s];
+    }
+
+    // Vertex data in the format expected by the renderer
+    const Position* vertices() { return positions; }
+
+    // Accessors shared with the SoA layout, used by the simulation kernels
+    unsigned int& id( const unsigned int i ) { return meta[i].id; }
+    vecD pos( const unsigned int i ) const { return positions[i].pos; }
+    vecD pos_old( const unsigned int i ) const { return meta[i].pos_old; }
+    vecD vel( const unsigned int i ) const { return meta[i].vel; }
+    vecD force( const unsigned int i ) const { return meta[i].force; }
+    void set_pos( const unsigned int i, const vecD& v ) { positions[i].pos = v; }
+    void set_pos_old( const unsigned int i, const vecD& v ) { meta[i].pos_old = v; }
+    void set_vel( const unsigned int i, const vecD& v ) { meta[i].vel = v; }
+    void set_force( const unsigned int i, const vecD& v ) { meta[i].force = v; }
+    void set_color( const unsigned int i, const float r, const float g, const float b ) { meta[i].r = r; meta[i].g = g; meta[i].b = b; }
+    float& a( const unsigned int i ) { return positions[i].a; }
+    float& rho( const unsigned int i ) { return meta[i].rho; }
+    float& rho_near( const unsigned int i ) { return meta[i].rho_near; }
+    float& press( const unsigned int i ) { return meta[i].press; }
+    float& press_near( const unsigned int i ) { return meta[i].press_near; }
+    unsigned char& material( const unsigned int i ) { return meta[i].material; }
+    size_t& neighbor_offset( const unsigned int i ) { return meta[i].neighbor_offset; }
+    size_t& neighbor_count( const unsigned int i ) { return meta[i].neighbor_count; }
+};
+
+#elif CURRENT_PARTICLE_LAYOUT == PARTICLE_LAYOUT_SOA
+
+// The Particle structure holding all of the relevant information.
+// A true structure-of-arrays: every attribute is its own aligned stream,
+// so a pass only pulls the attributes it actually touches through the cache.
+struct Particles
+{
+    // Vertex format for rendering, packed from the streams on demand
+    struct Position {
+        vecD pos;
+        float a = .0f; // used to mark neighborhood
+    };
+
+    float* x;
+    float* y;
+    float* x_old; // for verlet (the velocity with adaptiveTimeStep)
+    float* y_old;
+    float* vx;
+    float* vy;
+    float* fx;
+    float* fy;
+#if SPH_DIMENSION == 3
+    float* z;
+    float* z_old;
+    float* vz;
+    float* fz;
+#endif
+    float* rhos; // density
+    float* rhos_near;
+    float* presses;
+    float* presses_near;
+    unsigned char* material_ids; // row of the materials table
+    float* cr; // debug color
+    float* cg;
+    float* cb;
+    float* marks; // used to mark neighborhood
+    unsigned int* ids; // index, valid for all data arrays
+
+    // current neighbors, see the AoS layout
+    size_t* neighbor_offsets; // into the neighbor storage (shared pool or bounded slots)
+    size_t* neighbor_counts;
+
+    Position* vertex_data;
+    unsigned int N;
+    unsigned int capacity; // allocated particles, see reserve()
+
+    // Storage order changes when particles are reordered for cache locality.
+    // Code outside the simulation that needs to follow a particle over time
+    // refers to it by its stable id instead of its storage index.
+    unsigned int* stable_id;     // stable id of the particle at each storage index
+    unsigned int* storage_index; // storage index of each stable id
+
+    void allocate( const unsigned int count )
+    {
+        N = capacity = count;
+        float** streams[] = { &x, &y, &x_old, &y_old, &vx, &vy, &fx, &fy, &rhos, &rhos_near,
+            &presses, &presses_near, &cr, &cg, &cb, &marks,
+#if SPH_DIMENSION == 3
+            &z, &z_old, &vz, &fz
+#endif
+            };
+        for( float** s : streams )
+        {
+            *s = (float*)alignedMalloc( N * sizeof( float ) );
+        }
+        ids = (unsigned int*)alignedMalloc( N * sizeof( unsigned int ) );
+        material_ids = (unsigned char*)alignedMalloc( N );
+        neighbor_offsets = (size_t*)alignedMalloc( N * sizeof( size_t ) );
+        neighbor_counts = (size_t*)alignedMalloc( N * sizeof( size_t ) );
+        vertex_data = (Position*)alignedMalloc( N * sizeof( Position ) );
+        stable_id = (unsigned int*)malloc( N * sizeof( unsigned int ) );
+        storage_index = (unsigned int*)malloc( N * sizeof( unsigned int ) );
+    }
+
+    void release()
+    {
+        float* streams[] = { x, y, x_old, y_old, vx, vy, fx, fy, rhos, rhos_near,
+            presses, presses_near, cr, cg, cb, marks,
+#if SPH_DIMENSION == 3
+            z, z_old, vz, fz
+#endif
+            };
+        for( float* s : streams )
+        {
+            alignedFree( s );
+        }
+        alignedFree( ids );
+        alignedFree( material_ids );
+        alignedFree( neighbor_offsets );
+        alignedFree( neighbor_counts );
+        alignedFree( vertex_data );
+        free( stable_id );
+        free( storage_index );
+    }
+
+    // Grows the storage to at least count particles, keeping the first N.
+    // storage_index is indexed by stable id and keeps its size.
+    void reserve( const unsigned int count )
+    {
+        if( count <= capacity )
+        {
+            return;
+        }
+        capacity = count;
+        float** streams[] = { &x, &y, &x_old, &y_old, &vx, &vy, &fx, &fy, &rhos, &rhos_near,
+            &presses, &presses_near, &cr, &cg, &cb, &marks,
+#if SPH_DIMENSION == 3
+            &z, &z_old, &vz, &fz
+#endif
+            };
+        for( float** s : streams )
+        {
+            *s = (float*)alignedRealloc( *s, N * sizeof( float ), capacity * sizeof( float ) );
+        }
+        ids = (unsigned int*)alignedRealloc( ids, N * sizeof( unsigned int ), capacity * sizeof( unsigned int ) );
+        material_ids = (unsigned char*)alignedRealloc( material_ids, N, capacity );
+        neighbor_offsets = (size_t*)alignedRealloc( neighbor_offsets, N * sizeof( size_t ), capacity * sizeof( size_t ) );
+        neighbor_counts = (size_t*)alignedRealloc( neighbor_counts, N * sizeof( size_t ), capacity * sizeof( size_t ) );
+        vertex_data = (Position*)alignedRealloc( vertex_data, N * sizeof( Position ), capacity * sizeof( Position ) );
+        stable_id = (unsigned int*)realloc( stable_id, capacity * sizeof( unsigned int ) );
+    }
+
+    // Copies all attributes of particle s in src to slot i
+    void copy( const unsigned int i, const Particles& src, const unsigned int s )
+    {
+        x[i] = src.x[s]; y[i] = src.y[s];
+        x_old[i] = src.x_old[s]; y_old[i] = src.y_old[s];
+        vx[i] = src.vx[s]; vy[i] = src.vy[s];
+        fx[i] = src.fx[s]; fy[i] = src.fy[s];
+#if SPH_DIMENSION == 3
+        z[i] = src.z[s]; z_old[i] = src.z_old[s];
+        vz[i] = src.vz[s]; fz[i] = src.fz[s];
+#endif
+        rhos[i] = src.rhos[s]; rhos_near[i] = src.rhos_near[s];
+        presses[i] = src.presses[s]; presses_near[i] = src.presses_near[s];
+        material_ids[i] = src.material_ids[s];
+        cr[i] = src.cr[s]; cg[i] = src.cg[s]; cb[i] = src.cb[s];
+        marks[i] = src.marks[s];
+        ids[i] = i;
+        neighbor_offsets[i] = src.neighbor_offsets[s];
+        neighbor_counts[i] = src.neighbor_counts[s];
+        stable_id[i] = src.stable_id[s];
+    }
+
+    // Vertex data in the format expected by the renderer
+    const Position* vertices()
+    {
+#pragma omp parallel for
+        for( int i = 0; i < (int)N; ++i )
+        {
+            vertex_data[i].pos = pos( i );
+            vertex_data[i].a = marks[i];
+        }
+        return vertex_data;
+    }
+
+    // Accessors shared with the AoS layout, used by the simulation kernels
+    unsigned int& id( const unsigned int i ) { return ids[i]; }
+#if SPH_DIMENSION == 3
+    vecD pos( const unsigned int i ) const { return vecD( x[i], y[i], z[i] ); }
+    vecD pos_old( const unsigned int i ) const { return vecD( x_old[i], y_old[i], z_old[i] ); }
+    vecD vel( const unsigned int i ) const { return vecD( vx[i], vy[i], vz[i] ); }
+    vecD force( const unsigned int i ) const { return vecD( fx[i], fy[i], fz[i] ); }
+    void set_pos( const unsigned int i, const vecD& v ) { x[i] = v.x; y[i] = v.y; z[i] = v.z; }
+    void set_pos_old( const unsigned int i, const vecD& v ) { x_old[i] = v.x; y_old[i] = v.y; z_old[i] = v.z; }
+    void set_vel( const unsigned int i, const vecD& v ) { vx[i] = v.x; vy[i] = v.y; vz[i] = v.z; }
+    void set_force( const unsigned int i, const vecD& v ) { fx[i] = v.x; fy[i] = v.y; fz[i] = v.z; }
+#else
+    vecD pos( const unsigned int i ) const { return vecD( x[i], y[i] ); }
+    vecD pos_old( const unsigned int i ) const { return vecD( x_old[i], y_old[i] ); }
+    vecD vel( const unsigned int i ) const { return vecD( vx[i], vy[i] ); }
+    vecD force( const unsigned int i ) const { return vecD( fx[i], fy[i] ); }
+    void set_pos( const unsigned int i, const vecD& v ) { x[i] = v.x; y[i] = v.y; }
+    void set_pos_old( const unsigned int i, const vecD& v ) { x_old[i] = v.x; y_old[i] = v.y; }
+    void set_vel( const unsigned int i, const vecD& v ) { vx[i] = v.x; vy[i] = v.y; }
+    void set_force( const unsigned int i, const vecD& v ) { fx[i] = v.x; fy[i] = v.y; }
+#endif
+    void set_color( const unsigned int i, const float r, const float g, const float b ) { cr[i] = r; cg[i] = g; cb[i] = b; }
+    float& a( const unsigned int i ) { return marks[i]; }
+    float& rho( const unsigned int i ) { return rhos[i]; }
+    float& rho_near( const unsigned int i ) { return rhos_near[i]; }
+    float& press( const unsigned int i ) { return presses[i]; }
+    float& press_near( const unsigned int i ) { return presses_near[i]; }
+    unsigned char& material( const unsigned int i ) { return material_ids[i]; }
+    size_t& neighbor_offset( const unsigned int i ) { return neighbor_offsets[i]; }
+    size_t& neighbor_count( const unsigned int i ) { return neighbor_counts[i]; }
+};
+
+#endif
+
+// A structure for holding two neighboring particles, their weighted distances and direction.
+// DENSITY fills it once per step for all passes after it, which see the same positions,
+// so they need no square root or division per pair. dir is zero for particles at the same position.
+struct Neighbor
+{
+    unsigned int id; // index into data arrays
+    float q, q2; // weights of the far and near pressure force, q = 1 - ( r_ij / r_max ) and q^2 with KERNEL_LINEAR
+    vecD dir;    // unit vector from the particle owning the list to id
+};
+
+#pragma pack(pop)
+
+// Our collection of particles
+extern Particles particles;
+
+// --------------------------------------------------------------------
+const float G = .02f * .25;           // Gravitational Constant for our simulation
+const float spacing = 2.f;            // Spacing of particles
+const float r = spacing * 10.25f;      // Radius of Support
+const float rsq = r * r;              // ... squared for performance stuff
+const float SIM_W = 50;               // The size of the world
+const float bottom = 0;               // The floor of the world
+
+// Parameters of a material. Every particle refers to a row of the materials table
+// by its index material(), the passes look the parameters up per particle and neighbor.
+struct Material
+{
+    float k;                          // Far pressure weight
+    float k_near;                     // Near pressure weight
+    float rest_density;               // Rest Density
+    float sigma;                      // linear viscosity coefficient
+    float beta;                       // quadratic viscosity coefficient
+};
+
+// The material table, 160 bytes aligned to cache lines that stay in the L1 cache
+// during the pair loops. Rows can be changed at any time, the next step uses them.
+extern Material materials[MATERIAL_TABLE_SIZE];
+
+// Particle storage is sorted along a Z-order curve every this many steps
+// (0 disables reordering)
+extern unsigned int reorderInterval;
+
+// The spatial index is kept from the last step and only particles that changed
+// cells are moved, unless more than incrementalIndexLimit of all particles did.
+// Otherwise (or with incrementalIndex off) it is rebuilt from scratch every step.
+extern bool incrementalIndex;
+extern float incrementalIndexLimit;
+
+// Spatial index counters since init()
+struct SpatialIndexStats
+{
+    unsigned int rebuilds;      // full rebuilds, including fallbacks
+    unsigned int updates;       // incremental updates
+    unsigned long long moved;   // particles moved by incremental updates
+    unsigned int clamped;       // builds that cut the grid to the walls, since particles were far outside
+};
+extern SpatialIndexStats indexStats;
+
+// Simulated time is counted in base steps, the step all constants are tuned for.
+// The demo draws one base step per frame at 60 Hz, which makes it this long in real time.
+const float STEP_SECONDS = 1.0f / 60;
+
+// Adaptive time stepping. Off, every step advances the simulation by fixedTimeStep base steps
+// and UPDATE caps the velocity (of SOLVER_DOUBLE_DENSITY). On, the size of the next step follows
+// the CFL condition on the largest velocity and force of the particles, which UPDATE reduces on the fly:
+//   dt = cflNumber * min( r / max |vel|, sqrt( r / max |force| ) )
+// limited to [minTimeStep, maxTimeStep] and to growing by maxTimeStepGrowth per step.
+// Small steps would get lost in the float resolution of positions far from the origin,
+// so meanwhile Particles::pos_old holds the velocity instead of the old position,
+// as it always does with solvers that integrate velocities like SOLVER_PBF.
+extern bool adaptiveTimeStep;
+extern float fixedTimeStep;
+extern float cflNumber;
+extern float minTimeStep;
+extern float maxTimeStep;
+extern float maxTimeStepGrowth;
+
+// SOLVER_PBF runs pbfIterations Jacobi iterations over the density constraints per step.
+// pbfRelaxation softens the constraints (the epsilon of Macklin and Mueller), and
+// xsphViscosity blends the velocity of every particle towards the kernel-weighted
+// mean of its neighbors instead of the sigma and beta viscosity.
+extern unsigned int pbfIterations;
+extern float pbfRelaxation;
+extern float xsphViscosity;
+
+// SOLVER_DFSPH iterates until the mean compression predicted for the end of the next step
+// is below dfsphDensityTolerance and the mean rate of compression, over one step, is below
+// dfsphDivergenceTolerance (both relative to the rest density of the material of each particle),
+// at most dfsphMaxIterations times.
+// Both solvers start from the pressures of the last step with dfsphWarmStart.
+// It uses the XSPH viscosity of SOLVER_PBF.
+extern float dfsphDensityTolerance;
+extern float dfsphDivergenceTolerance;
+extern unsigned int dfsphMaxIterations;
+extern bool dfsphWarmStart;
+
+// Neighbor candidates within r + verletSkin are gathered from the grid and reused
+// until a particle moved more than verletSkin / 2, instead of searching the grid
+// every step. 0 disables, only used with SPATIAL_INDEX_GRID and PAIR_EVALUATION_FULL.
+extern float verletSkin;
+
+// Verlet list counters since init()
+struct VerletStats
+{
+    unsigned int builds;        // steps that rebuilt the grid and the candidate lists
+    unsigned int reuses;        // steps that reused them
+    double buildUs;             // total time of the builds in microseconds
+    double checkUs;             // total time of the displacement checks in microseconds
+};
+extern VerletStats verletStats;
+
+// There is no maximum number of neighbors in the radius of support, so by default the shared
+// neighbor pool grows with the densest step seen. boundedNeighbors instead gives every particle
+// neighborSlots Neighbor records of its own, and a particle with more neighbors moves its list
+// to an overflow area shared by all particles, of neighborOverflowShare * neighborSlots records
+// per particle. A list that does not fit there any more is cut off at neighborSlots, its
+// particle then misses the force of the remaining pairs. The memory per particle is fixed at
+// ( 1 + neighborOverflowShare ) * neighborSlots * sizeof( Neighbor ).
+// neighborSlots 0 sizes the slots from the neighbor counts of the first step after init(),
+// to neighborSlotsPercentile of the particles.
+extern bool boundedNeighbors;
+extern unsigned int neighborSlots;
+extern float neighborSlotsPercentile;
+extern float neighborOverflowShare;
+
+// Neighbor storage counters since init(), all but repeats for bounded storage
+struct NeighborStats
+{
+    unsigned long long repeats;     // DENSITY passes repeated because the shared pool was too small
+    unsigned int slots;             // records per particle in use, 0 before the first bounded step
+    unsigned int passes;            // DENSITY passes with bounded storage
+    unsigned long long overflows;   // lists longer than slots, moved to the overflow area or cut off
+    unsigned long long truncated;   // lists cut off at slots since the overflow area was full
+    unsigned long long dropped;     // neighbors missing from those lists, and from rho and rho_near
+    size_t overflowCapacity;        // records of the overflow area
+    size_t overflowPeak;            // most records of the overflow area used by one pass
+    size_t idlePeak;                // most slots left empty by one pass, those of the lists in the overflow area
+};
+extern NeighborStats neighborStats;
+
+/**
+* Bytes allocated for the neighbor lists by the shared pool and the bounded storage,
+* only one of which is kept after a DENSITY pass
+*/
+size_t neighborStorageBytes();
+
+// PRESSURE, PRESSURE FORCE and VISCOSITY run as one sweep over the particles
+// with a single traversal of every neighbor list. Only used with PAIR_EVALUATION_FULL
+// and the scalar kernels (see simd.h), ignored otherwise.
+extern bool fusePasses;
+
+// DENSITY interpolates the kernel in a table over the distance ratio |rij| / h
+// instead of evaluating it, from the square root it takes for the direction stored
+// in Neighbor anyway. The table pays off for kernels that cost more than the
+// interpolation. Its samples are evenly spaced over the whole support, so every
+// term is reproduced within 1e-6 for the linear kernel and 3e-5 for Wendland C2.
+// Only used by the scalar kernels (see simd.h), the iterations of SOLVER_PBF always
+// evaluate the kernel.
+extern bool tabulatedKernel;
+
+// The particle loops of step() hand out tiles of particles ordered by their
+// neighbor count to the threads and let idle threads steal tiles.
+// Off gives every thread one static chunk of particles.
+extern bool tileScheduling;
+
+// Tile scheduler counters since init(), one entry per OpenMP thread
+struct SchedulerStats
+{
+    double wallUs;                      // total time of the scheduled loops
+    std::vector<double> busyUs;         // time each thread spent on tiles
+    std::vector<unsigned int> tiles;    // tiles each thread ran
+    std::vector<unsigned int> steals;   // tiles each thread took from another queue
+};
+const SchedulerStats& schedulerStats();
+
+// Distributed runs (see distributed.h): the last ghostCount particles are read-only
+// copies of particles owned by other processes. They are found as neighbors
+// but not integrated, their densities are filled in by afterDensityHook.
+extern unsigned int ghostCount;
+
+// Called by step() if set: after UPDATE, to migrate particles between processes
+// and replace the ghosts, and after DENSITY, to fetch the densities of the ghosts
+extern void (*afterUpdateHook)();
+extern void (*afterDensityHook)();
+
+// Mouse attractor
+extern vecD attractor;
+extern bool attracting;
+
+// --------------------------------------------------------------------
+
+/**
+* Assigns a row of the materials table to count particles from stable id first on.
+* init() places the particles in stable id order from the bottom up, so ranges are layers.
+*/
+void setMaterial( const unsigned int first, const unsigned int count, const int material );
+
+/**
+* Selects one of the SOLVER_* pressure solvers, SOLVER_DOUBLE_DENSITY by default.
+* Returns false if it is not available in this build
+* (SOLVER_PBF and SOLVER_DFSPH need PAIR_EVALUATION_FULL).
+*/
+bool setSolver( const int solver );
+int solver();
+
+/**
+* Lower-case name of a solver
+*/
+const char* solverName( const int solver );
+
+/**
+* Selects one of the KERNEL_* smoothing kernels, KERNEL_LINEAR by default.
+* The vectorized DENSITY of setSimdISA() only implements KERNEL_LINEAR,
+* the others run the scalar loop.
+*/
+bool setKernel( const int kernel );
+int kernel();
+
+/**
+* Lower-case name of a kernel
+*/
+const char* kernelName( const int kernel );
+
+/**
+* Allocates and places N particles in a block
+* (a column of rows of 3 particles r / 2 apart, or 3x3 per layer in 3D)
+*/
+void init( const unsigned int N );
+
+/**
+* Allocates N particles and resets the step counter and all derived state like init(),
+* but leaves positions, velocities and forces for the caller to fill in
+*/
+void allocate( const unsigned int N );
+
+/**
+* Frees all particle and neighbor memory
+*/
+void shutdown();
+
+/**
+* Advances the simulation by one time step
+*/
+void step();
+
+/**
+* Runs steps until the simulation advanced by time base steps,
+* the last one shortened to end exactly there. Returns the number of steps.
+*/
+unsigned int advance( const float time );
+
+// Time stepping state carried over from one step to the next, in base steps
+struct TimeStepState
+{
+    float lastStep;     // size of the last step
+    float nextStep;     // proposed for the next one by adaptiveTimeStep
+    double time;        // simulated since init()
+    bool velocities;    // Particles::pos_old holds velocities, see adaptiveTimeStep
+};
+
+/**
+* Restored by loadSnapshot() in snapshot.h
+*/
+TimeStepState timeStepState();
+void setTimeStepState( const TimeStepState& state );
+
+/**
+* Forces the next step to rebuild the spatial index from scratch,
+* call after adding, removing or moving particles between storage slots outside of step()
+*/
+void particlesChanged();
+
+/**
+* Number of steps since init(), see loadSnapshot() in snapshot.h
+*/
+unsigned int stepCount();
+void setStepCount( const unsigned int steps );
+
+/**
+* Collects ids of particles in the 3x3 (3x3x3 in 3D) cell neighborhood of pos
+*/
+void queryNeighborIds( const vecD& pos, std::vector<unsigned int>& ret );
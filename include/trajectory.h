@@ -0,0 +1,195 @@
+// Real-Time Physics Tutorials
+// Brandon Pelfrey
+// SPH Fluid Simulation
+
+// Recording of particle trajectories for offline analysis and timeline seeking.
+// Positions are stored in stable id order (see Particles::stable_id), so a particle
+// keeps its slot in every frame regardless of reordering.
+//
+// Every keyframeInterval-th frame is a keyframe with the exact float positions.
+// The frames in between hold, per coordinate, the difference of the position quantized
+// to fixed point (multiples of quantum) to its quantized position in the previous frame,
+// zigzag encoded into 1-3 bytes. Since both sides of a difference are quantized
+// from exact positions, the error stays below quantum / 2 and does not accumulate.
+// A difference that does not fit into 3 bytes turns the frame into a keyframe.
+//
+// File layout:
+//   TrajectoryHeader
+//   frames: TrajectoryFrameHeader followed by its payload
+//   seek index: TrajectoryIndexEntry per frame
+//   TrajectoryFooter
+// Seeking to a step finds its frame and decodes from the keyframe at or before it,
+// which is at most keyframeInterval - 1 frames away. If all frames are the same
+// number of steps apart, the frame is computed from the step, otherwise (after
+// a restart while recording or a varying stride) found by a binary search of the index.
+
+#pragma once
+
+#include <sph.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// --------------------------------------------------------------------
+#define TRAJECTORY_VERSION 2
+
+struct TrajectoryHeader
+{
+    char magic[8];              // "SPHTRAJ\0"
+    uint32_t version;           // TRAJECTORY_VERSION
+    uint32_t dimension;         // SPH_DIMENSION of the recording build
+    uint32_t N;
+    float quantum;              // fixed point resolution of delta frames
+    uint32_t keyframeInterval;
+};
+
+struct TrajectoryFrameHeader
+{
+    uint32_t step;
+    uint32_t keyframe;          // 1 for float positions, 0 for differences
+    uint64_t bytes;             // payload following this header
+};
+
+struct TrajectoryIndexEntry
+{
+    uint32_t step;
+    uint32_t keyframe;
+    uint64_t offset;            // of the TrajectoryFrameHeader from the start of the file
+};
+
+struct TrajectoryFooter
+{
+    uint64_t indexOffset;
+    uint32_t frameCount;
+    char magic[8];              // "SPHTRAJ\0", only present if the file was closed
+};
+
+// --------------------------------------------------------------------
+// Writes frames on a background thread.
+// Record() only copies the positions into one of queueFrames buffers,
+// it waits if all of them are still queued for encoding, which bounds the memory.
+class TrajectoryWriter
+{
+public:
+    struct Options
+    {
+        float quantum;                  // units per fixed point step, default 1 / 1024
+        unsigned int keyframeInterval;  // default 32
+        unsigned int queueFrames;       // default 4
+        Options() : quantum( 1.0f / 1024 ), keyframeInterval( 32 ), queueFrames( 4 ) {}
+    };
+
+    struct Stats
+    {
+        unsigned int frames;
+        unsigned int keyframes;
+        uint64_t bytes;                 // written so far, including headers
+        double recordUs;                // time Record() took on the calling thread, including waits
+        double waitUs;                  // of which waiting for a free buffer
+        double encodeUs;                // time of the writer thread
+    };
+
+    TrajectoryWriter();
+    ~TrajectoryWriter();
+
+    /**
+    * Creates the file for particles.N particles and starts the writer thread
+    */
+    bool Open( const char* path, const Options& options = Options() );
+
+    /**
+    * Queues the current positions as frame of stepCount()
+    */
+    void Record();
+
+    /**
+    * Writes the remaining frames and the seek index.
+    * Returns false if any write failed.
+    */
+    bool Close();
+
+    bool IsOpen() const { return mFile != 0; }
+
+    /**
+    * Counters of the frames encoded so far
+    */
+    Stats GetStats() const;
+
+private:
+    struct Frame
+    {
+        uint32_t step;
+        std::vector<vecD> positions;
+    };
+
+    void Run();
+    void Encode( const Frame& frame );
+
+    FILE* mFile;
+    Options mOptions;
+    unsigned int mN;
+    bool mOk;
+
+    std::vector<Frame> mFrames;
+    std::vector<unsigned int> mFree;     // buffers Record() may fill
+    std::vector<unsigned int> mQueued;   // buffers waiting for the writer thread, oldest first
+    bool mClosing;
+    mutable std::mutex mMutex;
+    std::condition_variable mChanged;
+    std::thread mThread;
+
+    // Writer thread only
+    std::vector<int64_t> mLast;          // quantized coordinates of the previous frame
+    std::vector<unsigned char> mPayload;
+    std::vector<TrajectoryIndexEntry> mIndex;
+    uint64_t mOffset;
+
+    Stats mStats;                        // guarded by mMutex
+};
+
+// --------------------------------------------------------------------
+class TrajectoryReader
+{
+public:
+    TrajectoryReader();
+    ~TrajectoryReader();
+
+    /**
+    * Reads the header and the seek index, returns false if the file was not closed properly
+    * or was recorded with another SPH_DIMENSION
+    */
+    bool Open( const char* path );
+    void Close();
+
+    unsigned int N() const { return mHeader.N; }
+    unsigned int FrameCount() const { return (unsigned int)mIndex.size(); }
+    unsigned int FrameStep( const unsigned int frame ) const { return mIndex[frame].step; }
+
+    /**
+    * Index of the last frame recorded at or before step, 0 if step precedes all frames
+    */
+    unsigned int FrameAt( const unsigned int step ) const;
+
+    /**
+    * Decodes the positions of a frame in stable id order.
+    * Reading the frames in order decodes every frame once,
+    * jumping decodes from the closest keyframe.
+    */
+    bool Read( const unsigned int frame, std::vector<vecD>& positions );
+
+private:
+    bool Decode( const unsigned int frame );
+
+    FILE* mFile;
+    TrajectoryHeader mHeader;
+    std::vector<TrajectoryIndexEntry> mIndex;
+    std::vector<int64_t> mQuantized;     // coordinates of mCurrent
+    std::vector<vecD> mPositions;   // of mCurrent
+    std::vector<unsigned char> mPayload;
+    unsigned int mCurrent;               // decoded frame, FrameCount() if none
+    unsigned int mStride;                // steps between all consecutive frames, 0 if they vary
+};
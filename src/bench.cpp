@@ -0,0 +1,940 @@
+// Real-Time Physics Tutorials
+// Brandon Pelfrey
+// SPH Fluid Simulation
+
+// Headless benchmark of the simulation core.
+// Prints the same table as benchmark.txt and optionally writes CSV/JSON.
+//
+// Usage: sph-bench [options]
+//   --particles 1024,2048,4096,8192  particle counts (8192,65536,262144,1048576 in 3D)
+//   --steps 3000                     measured steps per run
+//   --warmup 0                       unmeasured steps before each run
+//   --threads 1,2,4                  OpenMP thread counts (default: OpenMP default)
+//   --material default,snow          materials of equal layers of particles: default, snow, slime
+//   --index incremental|full         spatial index update (default: incremental)
+//   --skin 0                         Verlet list skin radius, 0 searches the grid every step
+//   --neighbors pool|bounded         neighbor lists in the growing shared pool or in fixed slots per particle
+//   --slots 0                        neighbor slots per particle of bounded storage, 0 sizes them from the first step
+//   --overflow 0.5                   overflow records of bounded storage per slot and particle
+//   --simd scalar|auto|avx2|neon     instruction set of the density and pressure force kernels
+//   --passes fused|separate          pressure, pressure force and viscosity in one or three passes
+//   --kernel linear,wendland-c2      smoothing kernels to compare: linear, poly6, spiky, cubic-spline, wendland-c2
+//   --kernel-eval analytic|table     kernel weights of DENSITY evaluated or interpolated in a table
+//   --schedule tiles|static          work-stealing tiles or one static chunk per thread
+//   --solver double-density,pbf      pressure solvers to compare: double-density, pbf, dfsph
+//   --iterations 4                   constraint iterations of the pbf solver
+//   --dt 1,2,4                       fixed time steps, in steps of 1/60 s (default: 1)
+//   --timestep fixed|adaptive        constant or CFL-limited time step
+//   --cfl 0.1                        CFL number of adaptive time steps
+//   --max-dt 4                       largest adaptive time step, in steps of 1/60 s
+//   --snapshot FILE                  start every run from a snapshot instead of --particles
+//   --save-snapshot FILE             save the state at the end of the last run
+//   --record FILE                    record the trajectory of the last run
+//   --record-every 1                 steps between recorded frames
+//   --csv FILE                       write results as CSV
+//   --json FILE                      write results as JSON
+//   --trace FILE                     write the last run as Chrome trace JSON
+//   --validate                       compare the scalar and the best SIMD kernels and check the kernel
+//                                    tables instead of benchmarking
+
+#include <sph.h>
+#include <kernels.h>
+#include <profile.h>
+#include <simd.h>
+#include <snapshot.h>
+#include <trajectory.h>
+
+#include <omp.h>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// --------------------------------------------------------------------
+struct BenchResult
+{
+    int solver;
+    int kernel;
+    float timeStep;                 // fixedTimeStep, 0 with adaptive time steps
+    int threads;
+    unsigned int particles;
+    unsigned int steps;
+    unsigned int warmup;
+    double elapsedMs;
+    double usPerStep;
+    double p50, p90, p99, min, max; // microseconds per step
+    double simulatedSteps;          // simulated time of the measured steps, in steps of STEP_SECONDS
+    double simulatedPerSecond;      // simulated seconds per second of wall time
+    double densityError;            // mean over the measured steps of the mean max( 0, rho / rest_density - 1 ),
+                                    // with the rest density of the material of each particle
+    double densityErrorMax;         // largest over all particles and measured steps
+    double neighbors;               // mean over the measured steps of the mean neighbor count
+    double neighborBytes;           // neighbor storage per particle at the end of the run
+    NeighborStats bounded;          // of the measured steps, slots and overflowCapacity at the end
+    double solverIterations;        // means over the measured steps of the SolverProfile
+    double solverError;             // fields (profile.h), 0 for double-density
+    double divergenceIterations;
+    double divergenceError;
+    double phaseUs[PHASE_COUNT];    // mean microseconds per step
+    double imbalance[PHASE_COUNT];  // mean max/min thread busy time, 0 for sequential phases
+    SpatialIndexStats index;        // of the measured steps
+    VerletStats verlet;             // of the measured steps
+    std::vector<double> utilization; // busy / wall time of the scheduled loops per thread
+    unsigned int steals;            // tiles taken from another thread's queue
+    bool recorded;
+    TrajectoryWriter::Stats recording;
+};
+
+// --------------------------------------------------------------------
+// Parses a comma separated list of unsigned integers
+static std::vector<unsigned int> parseList( const char* s )
+{
+    std::vector<unsigned int> ret;
+    while( *s )
+    {
+        char* end = 0;
+        const unsigned long v = strtoul( s, &end, 10 );
+        if( end == s )
+        {
+            break;
+        }
+        ret.push_back( (unsigned int)v );
+        s = ( *end == ',' ) ? end + 1 : end;
+    }
+    return ret;
+}
+
+// --------------------------------------------------------------------
+// Parses a comma separated list of numbers
+static std::vector<float> parseFloatList( const char* s )
+{
+    std::vector<float> ret;
+    while( *s )
+    {
+        char* end = 0;
+        const float v = strtof( s, &end );
+        if( end == s )
+        {
+            break;
+        }
+        ret.push_back( v );
+        s = ( *end == ',' ) ? end + 1 : end;
+    }
+    return ret;
+}
+
+// --------------------------------------------------------------------
+// Parses a comma separated list of solver, kernel or material names into ids below count,
+// returns false on unknown names
+static bool parseNames( const std::string& s, const int count, const char* (*nameOf)( const int ), std::vector<int>& ids )
+{
+    ids.clear();
+    size_t begin = 0;
+    while( begin <= s.size() )
+    {
+        const size_t end = std::min( s.find( ',', begin ), s.size() );
+        const std::string name = s.substr( begin, end - begin );
+        int id = count - 1;
+        for( ; id >= 0 && name != nameOf( id ); --id );
+        if( id < 0 )
+        {
+            return false;
+        }
+        ids.push_back( id );
+        begin = end + 1;
+    }
+    return true;
+}
+
+// --------------------------------------------------------------------
+// Names of the preset rows of the materials table
+#define MATERIAL_PRESET_COUNT 3
+static const char* materialName( const int material )
+{
+    static const char* names[MATERIAL_PRESET_COUNT] = { "default", "snow", "slime" };
+    return names[material];
+}
+
+// --------------------------------------------------------------------
+// Nearest-rank percentile of sorted samples
+static double percentile( const std::vector<double>& sorted, const double p )
+{
+    if( sorted.empty() )
+    {
+        return 0;
+    }
+    size_t i = (size_t)( p / 100.0 * sorted.size() );
+    return sorted[std::min( i, sorted.size() - 1 )];
+}
+
+// --------------------------------------------------------------------
+// Lower-case phase name usable as a CSV column or JSON key
+static std::string phaseKey( const int phase )
+{
+    std::string key = profilePhaseName( phase );
+    for( char& c : key )
+    {
+        c = ( c == ' ' ) ? '_' : (char)tolower( c );
+    }
+    return key;
+}
+
+// --------------------------------------------------------------------
+// Starts from the snapshot or from the block of init() with one layer per material
+static void start( const unsigned int count, const std::vector<int>& materialIds, const std::string& snapshot )
+{
+    // (main() made sure the snapshot loads)
+    if( snapshot.empty() || !loadSnapshot( snapshot.c_str() ) )
+    {
+        init( count );
+
+        // One layer of the block per material, from the bottom up
+        // (a snapshot brings the materials of its particles)
+        const unsigned int layers = (unsigned int)materialIds.size();
+        for( unsigned int m = 0; m < layers; ++m )
+        {
+            const unsigned int first = particles.N * m / layers;
+            setMaterial( first, particles.N * ( m + 1 ) / layers - first, materialIds[m] );
+        }
+    }
+}
+
+// --------------------------------------------------------------------
+static BenchResult run( const unsigned int count, const unsigned int steps, const unsigned int warmup, const int threads,
+                        const std::vector<int>& materialIds, const std::string& snapshot,
+                        const std::string& saveSnapshotPath, const std::string& recordPath, const unsigned int recordEvery )
+{
+    BenchResult res;
+    res.solver = solver();
+    res.kernel = kernel();
+    res.timeStep = adaptiveTimeStep ? 0 : fixedTimeStep;
+    res.threads = threads;
+    res.steps = steps;
+    res.warmup = warmup;
+
+    start( count, materialIds, snapshot );
+    res.particles = particles.N;
+
+    TrajectoryWriter trajectory;
+    if( !recordPath.empty() && !trajectory.Open( recordPath.c_str() ) )
+    {
+        std::cerr << "Could not write " << recordPath << std::endl;
+    }
+
+    for( unsigned int i = 0; i < warmup; ++i )
+    {
+        step();
+    }
+
+    std::vector<double> samples;
+    samples.reserve( steps );
+
+    double phaseSum[PHASE_COUNT] = {};
+    double imbalanceSum[PHASE_COUNT] = {};
+    unsigned int imbalanceCount[PHASE_COUNT] = {};
+    double solverSum[4] = {};
+    profileReset();
+    const SpatialIndexStats indexBefore = indexStats;
+    const VerletStats verletBefore = verletStats;
+    const NeighborStats boundedBefore = neighborStats;
+    const SchedulerStats schedulerBefore = schedulerStats();
+    const double timeBefore = timeStepState().time;
+    double densityErrorSum = 0;
+    res.densityErrorMax = 0;
+    double neighborSum = 0;
+    double uncountedUs = 0;
+
+    const auto beg = std::chrono::high_resolution_clock::now();
+    auto last = beg;
+    for( unsigned int i = 0; i < steps; ++i )
+    {
+        step();
+        // (measured, recording should not slow down the steps)
+        if( trajectory.IsOpen() && ( i + 1 ) % recordEvery == 0 )
+        {
+            trajectory.Record();
+        }
+        const auto now = std::chrono::high_resolution_clock::now();
+        samples.push_back( std::chrono::duration<double, std::micro>( now - last ).count() );
+
+        // Compression as DENSITY saw it, after UPDATE moved the particles of the last step (not measured)
+        float errorSum = 0;
+        float errorMax = 0;
+        size_t neighbors = 0;
+        for( unsigned int p = 0; p < particles.N; ++p )
+        {
+            const float e = std::max( particles.rho( p ) / materials[particles.material( p )].rest_density - 1, 0.0f );
+            errorSum += e;
+            errorMax = std::max( errorMax, e );
+            neighbors += particles.neighbor_count( p );
+        }
+        densityErrorSum += particles.N ? errorSum / particles.N : 0;
+        neighborSum += particles.N ? (double)neighbors / particles.N : 0;
+        res.densityErrorMax = std::max( res.densityErrorMax, (double)errorMax );
+        last = std::chrono::high_resolution_clock::now();
+        uncountedUs += std::chrono::duration<double, std::micro>( last - now ).count();
+
+        if( const StepProfile* prof = profileStep( 0 ) )
+        {
+            for( int p = 0; p < PHASE_COUNT; ++p )
+            {
+                const PhaseProfile& ph = prof->phases[p];
+                phaseSum[p] += ph.end - ph.begin;
+                if( ph.threads && ph.thread_min > 0 )
+                {
+                    imbalanceSum[p] += ph.thread_max / ph.thread_min;
+                    imbalanceCount[p]++;
+                }
+            }
+            solverSum[0] += prof->solver.iterations;
+            solverSum[1] += prof->solver.densityError;
+            solverSum[2] += prof->solver.divergenceIterations;
+            solverSum[3] += prof->solver.divergenceError;
+        }
+    }
+    const auto end = std::chrono::high_resolution_clock::now();
+    res.simulatedSteps = timeStepState().time - timeBefore;
+    res.densityError = densityErrorSum / steps;
+    res.neighbors = neighborSum / steps;
+    res.solverIterations = solverSum[0] / steps;
+    res.solverError = solverSum[1] / steps;
+    res.divergenceIterations = solverSum[2] / steps;
+    res.divergenceError = solverSum[3] / steps;
+
+    res.index.rebuilds = indexStats.rebuilds - indexBefore.rebuilds;
+    res.index.updates = indexStats.updates - indexBefore.updates;
+    res.index.moved = indexStats.moved - indexBefore.moved;
+    res.index.clamped = indexStats.clamped - indexBefore.clamped;
+    res.verlet.builds = verletStats.builds - verletBefore.builds;
+    res.verlet.reuses = verletStats.reuses - verletBefore.reuses;
+    res.verlet.buildUs = verletStats.buildUs - verletBefore.buildUs;
+    res.verlet.checkUs = verletStats.checkUs - verletBefore.checkUs;
+    res.bounded = neighborStats;
+    res.bounded.repeats = neighborStats.repeats - boundedBefore.repeats;
+    res.bounded.passes = neighborStats.passes - boundedBefore.passes;
+    res.bounded.overflows = neighborStats.overflows - boundedBefore.overflows;
+    res.bounded.truncated = neighborStats.truncated - boundedBefore.truncated;
+    res.bounded.dropped = neighborStats.dropped - boundedBefore.dropped;
+    res.neighborBytes = particles.N ? (double)neighborStorageBytes() / particles.N : 0;
+
+    const SchedulerStats& sched = schedulerStats();
+    const double wallUs = sched.wallUs - schedulerBefore.wallUs;
+    res.steals = 0;
+    for( size_t t = 0; t < sched.busyUs.size() && t < (size_t)threads; ++t )
+    {
+        const double busyBefore = t < schedulerBefore.busyUs.size() ? schedulerBefore.busyUs[t] : 0;
+        const unsigned int stealsBefore = t < schedulerBefore.steals.size() ? schedulerBefore.steals[t] : 0;
+        res.utilization.push_back( wallUs > 0 ? ( sched.busyUs[t] - busyBefore ) / wallUs : 0 );
+        res.steals += sched.steals[t] - stealsBefore;
+    }
+
+    res.recorded = trajectory.IsOpen();
+    if( res.recorded && !trajectory.Close() )
+    {
+        std::cerr << "Could not write " << recordPath << std::endl;
+    }
+    res.recording = trajectory.GetStats();
+
+    if( !saveSnapshotPath.empty() && !saveSnapshot( saveSnapshotPath.c_str() ) )
+    {
+        std::cerr << "Could not write " << saveSnapshotPath << std::endl;
+    }
+    shutdown();
+
+    const double elapsedUs = std::chrono::duration<double, std::micro>( end - beg ).count() - uncountedUs;
+    res.elapsedMs = elapsedUs / 1000;
+    res.usPerStep = elapsedUs / steps;
+    res.simulatedPerSecond = res.usPerStep > 0 ? res.simulatedSteps / steps * STEP_SECONDS / res.usPerStep * 1e6 : 0;
+
+    std::sort( samples.begin(), samples.end() );
+    res.p50 = percentile( samples, 50 );
+    res.p90 = percentile( samples, 90 );
+    res.p99 = percentile( samples, 99 );
+    res.min = samples.empty() ? 0 : samples.front();
+    res.max = samples.empty() ? 0 : samples.back();
+
+    for( int p = 0; p < PHASE_COUNT; ++p )
+    {
+        res.phaseUs[p] = phaseSum[p] / steps;
+        res.imbalance[p] = imbalanceCount[p] ? imbalanceSum[p] / imbalanceCount[p] : 0;
+    }
+    return res;
+}
+
+// --------------------------------------------------------------------
+// Largest differences of the SIMD kernels to the scalar ones that validateSimd() accepts.
+// Both evaluate the same pairs and only sum in another order.
+#define SIMD_DENSITY_TOLERANCE 1e-6     // relative, to rho and rho_near of at least 1
+#define SIMD_FORCE_TOLERANCE 1e-6       // absolute, the gravity per step is 5e-3
+
+// Runs steps scalar steps on one thread, which always reach the same state, and then one
+// more step from it with the scalar kernels and one with the best SIMD kernels of this CPU.
+// Compares rho and rho_near of their DENSITY and the force after PRESSURE FORCE per particle.
+// Returns false if a difference exceeds its tolerance or is not finite.
+static bool validateSimd( const unsigned int count, const unsigned int steps, const std::vector<int>& materialIds,
+                          const std::string& snapshot )
+{
+    const int isas[2] = { SIMD_SCALAR, simdBestISA() };
+    if( isas[1] == SIMD_SCALAR )
+    {
+        std::cout << "SIMD validation: no SIMD kernels on this CPU or in this build" << std::endl;
+        return true;
+    }
+
+    const int isa = simdISA();
+    const int threads = omp_get_max_threads();
+    std::vector<float> rho[2], rhoNear[2];
+    std::vector<vecD> pos[2], force[2];
+    for( int run = 0; run < 2; ++run )
+    {
+        setSimdISA( SIMD_SCALAR );
+        omp_set_num_threads( 1 );
+        srand( 1 );
+        start( count, materialIds, snapshot );
+        for( unsigned int s = 0; s < steps; ++s )
+        {
+            step();
+        }
+
+        setSimdISA( isas[run] );
+        omp_set_num_threads( threads );
+        step();
+        for( unsigned int id = 0; id < particles.N; ++id )
+        {
+            const unsigned int i = particles.storage_index[id];
+            rho[run].push_back( particles.rho( i ) );
+            rhoNear[run].push_back( particles.rho_near( i ) );
+            pos[run].push_back( particles.pos( i ) );
+            force[run].push_back( particles.force( i ) );
+        }
+        shutdown();
+    }
+    setSimdISA( isa );
+
+    // (the positions are those DENSITY saw, so they must match exactly)
+    bool same = rho[0].size() == rho[1].size();
+    double rhoMax = 0, forceMax = 0;
+    for( size_t id = 0; same && id < rho[0].size(); ++id )
+    {
+        same = pos[0][id] == pos[1][id];
+        const double dr = std::fabs( (double)rho[1][id] - rho[0][id] ) / glm::max( std::fabs( rho[0][id] ), 1.0f );
+        const double dn = std::fabs( (double)rhoNear[1][id] - rhoNear[0][id] ) / glm::max( std::fabs( rhoNear[0][id] ), 1.0f );
+        const double df = glm::length( force[1][id] - force[0][id] );
+        rhoMax = std::isfinite( dr ) && std::isfinite( dn ) ? glm::max( rhoMax, glm::max( dr, dn ) ) : HUGE_VAL;
+        forceMax = std::isfinite( df ) ? glm::max( forceMax, df ) : HUGE_VAL;
+    }
+    const bool ok = same && rhoMax <= SIMD_DENSITY_TOLERANCE && forceMax <= SIMD_FORCE_TOLERANCE;
+    std::printf( "SIMD validation (%s against scalar, one step after %u): rho max %g relative difference (tolerance %g),"
+                 " force max %g difference (tolerance %g)%s%s\n",
+                 simdISAName( isas[1] ), steps, rhoMax, SIMD_DENSITY_TOLERANCE, forceMax, SIMD_FORCE_TOLERANCE,
+                 same ? "" : ", not the same state", ok ? "" : ", FAILED" );
+    return ok;
+}
+
+// --------------------------------------------------------------------
+// Looks up the edge of the support in the kernel table of DENSITY, which a pair just inside
+// it reaches after rounding. Returns false unless all terms are zero there.
+template< class Kernel >
+static bool validateKernelTable( const int kernel )
+{
+    // (the largest squared distance of a neighbor, whose ratio rounds to 1 for the supports of kernels.h)
+    const float h = Kernel::Support * r;
+    const float edge = std::sqrt( std::nextafter( h * h, 0.0f ) ) / h;
+    bool ok = true;
+    const float xs[2] = { 1.0f, edge };
+    for( const float x : xs )
+    {
+        const KernelTerms w = KernelTable<Kernel>::Instance.Lookup( x );
+        ok = ok && w.density == 0 && w.nearDensity == 0 && w.force == 0 && w.nearForce == 0;
+    }
+    if( !ok )
+    {
+        std::printf( "Kernel table of %s: terms at the edge of the support are not zero, FAILED\n", kernelName( kernel ) );
+    }
+    return ok;
+}
+
+// --------------------------------------------------------------------
+static void writeCSV( const std::string& path, const std::string& material, const std::vector<BenchResult>& results )
+{
+    std::ofstream f( path.c_str() );
+    f << "material,solver,kernel,dt,threads,particles,steps,warmup,elapsed_ms,us_per_step,p50_us,p90_us,p99_us,min_us,max_us,"
+         "simulated_steps,simulated_per_second,density_error,density_error_max,neighbors,neighbor_bytes,neighbor_repeats,"
+         "neighbor_slots,neighbor_idle_slots,neighbor_overflows,neighbor_truncated,neighbor_dropped,"
+         "solver_iterations,solver_error,divergence_iterations,divergence_error";
+    for( int p = 0; p < PHASE_COUNT; ++p )
+    {
+        f << ',' << phaseKey( p ) << "_us," << phaseKey( p ) << "_imbalance";
+    }
+    f << '\n';
+    for( const BenchResult& r : results )
+    {
+        f << material << ',' << solverName( r.solver ) << ',' << kernelName( r.kernel ) << ',' << r.timeStep << ',' << r.threads << ',' << r.particles << ',' << r.steps << ',' << r.warmup << ','
+          << r.elapsedMs << ',' << r.usPerStep << ',' << r.p50 << ',' << r.p90 << ',' << r.p99 << ','
+          << r.min << ',' << r.max << ',' << r.simulatedSteps << ',' << r.simulatedPerSecond << ','
+          << r.densityError << ',' << r.densityErrorMax << ',' << r.neighbors << ',' << r.neighborBytes << ',' << r.bounded.repeats << ','
+          << r.bounded.slots << ',' << r.bounded.idlePeak << ',' << r.bounded.overflows << ',' << r.bounded.truncated << ',' << r.bounded.dropped << ','
+          << r.solverIterations << ',' << r.solverError << ',' << r.divergenceIterations << ',' << r.divergenceError;
+        for( int p = 0; p < PHASE_COUNT; ++p )
+        {
+            f << ',' << r.phaseUs[p] << ',' << r.imbalance[p];
+        }
+        f << '\n';
+    }
+}
+
+// --------------------------------------------------------------------
+static void writeJSON( const std::string& path, const std::string& material, const std::vector<BenchResult>& results )
+{
+    std::ofstream f( path.c_str() );
+    f << "{\n  \"material\": \"" << material << "\",\n  \"runs\": [\n";
+    for( size_t i = 0; i < results.size(); ++i )
+    {
+        const BenchResult& r = results[i];
+        f << "    { \"solver\": \"" << solverName( r.solver ) << "\""
+          << ", \"kernel\": \"" << kernelName( r.kernel ) << "\""
+          << ", \"dt\": " << r.timeStep
+          << ", \"threads\": " << r.threads
+          << ", \"particles\": " << r.particles
+          << ", \"steps\": " << r.steps
+          << ", \"warmup\": " << r.warmup
+          << ", \"elapsed_ms\": " << r.elapsedMs
+          << ", \"us_per_step\": " << r.usPerStep
+          << ", \"p50_us\": " << r.p50
+          << ", \"p90_us\": " << r.p90
+          << ", \"p99_us\": " << r.p99
+          << ", \"min_us\": " << r.min
+          << ", \"max_us\": " << r.max
+          << ", \"simulated_steps\": " << r.simulatedSteps
+          << ", \"simulated_per_second\": " << r.simulatedPerSecond
+          << ", \"density_error\": " << r.densityError
+          << ", \"density_error_max\": " << r.densityErrorMax
+          << ", \"neighbors\": " << r.neighbors
+          << ", \"neighbor_bytes\": " << r.neighborBytes
+          << ", \"neighbor_repeats\": " << r.bounded.repeats
+          << ", \"neighbor_slots\": " << r.bounded.slots
+          << ", \"neighbor_idle_slots\": " << r.bounded.idlePeak
+          << ", \"neighbor_overflows\": " << r.bounded.overflows
+          << ", \"neighbor_truncated\": " << r.bounded.truncated
+          << ", \"neighbor_dropped\": " << r.bounded.dropped
+          << ", \"solver_iterations\": " << r.solverIterations
+          << ", \"solver_error\": " << r.solverError
+          << ", \"divergence_iterations\": " << r.divergenceIterations
+          << ", \"divergence_error\": " << r.divergenceError
+          << ", \"phases\": {";
+        for( int p = 0; p < PHASE_COUNT; ++p )
+        {
+            f << ( p ? ", " : " " ) << "\"" << phaseKey( p ) << "\": { \"us\": " << r.phaseUs[p]
+              << ", \"imbalance\": " << r.imbalance[p] << " }";
+        }
+        f << " } }" << ( i + 1 < results.size() ? "," : "" ) << "\n";
+    }
+    f << "  ]\n}\n";
+}
+
+// --------------------------------------------------------------------
+static void usage( const char* exe )
+{
+    std::cerr
+        << "Usage: " << exe << " [options]\n"
+        << "  --particles LIST   comma separated particle counts (default 1024,2048,4096,8192, in 3D 8192 to 1048576)\n"
+        << "  --steps N          measured steps per run (default 3000)\n"
+        << "  --warmup N         unmeasured steps before each run (default 0)\n"
+        << "  --threads LIST     comma separated OpenMP thread counts (default: OpenMP default)\n"
+        << "  --material LIST    comma separated materials of equal layers of particles, default, snow or slime\n"
+        << "                     (default: default)\n"
+        << "  --index MODE       incremental or full spatial index update (default: incremental)\n"
+        << "  --skin R           Verlet list skin radius, 0 searches the grid every step (default: 0)\n"
+        << "  --neighbors MODE   pool (grows with the densest step) or bounded (fixed slots per particle\n"
+        << "                     and a shared overflow area) neighbor storage (default: pool)\n"
+        << "  --slots K          neighbor slots per particle of bounded storage, 0 sizes them to the\n"
+        << "                     99th percentile of the neighbor counts of the first step (default: 0)\n"
+        << "  --overflow F       overflow records of bounded storage per slot and particle (default: 0.5)\n"
+        << "  --simd ISA         scalar, auto (best supported), avx2 or neon (default: scalar)\n"
+        << "  --passes MODE      fused or separate pressure, pressure force and viscosity (default: fused)\n"
+        << "  --kernel LIST      comma separated smoothing kernels, linear, poly6, spiky, cubic-spline\n"
+        << "                     or wendland-c2 (default: linear)\n"
+        << "  --kernel-eval MODE analytic or table kernel weights in DENSITY (default: analytic)\n"
+        << "  --schedule MODE    tiles (work stealing) or static particle loops (default: tiles)\n"
+        << "  --solver LIST      comma separated pressure solvers, double-density, pbf or dfsph (default: double-density)\n"
+        << "  --iterations N     constraint iterations per step of the pbf solver (default: 4)\n"
+        << "  --dt LIST          comma separated fixed time steps, in steps of 1/60 s (default: 1)\n"
+        << "  --timestep MODE    fixed or adaptive (CFL-limited) time step (default: fixed)\n"
+        << "  --cfl C            CFL number of adaptive time steps (default: 0.1)\n"
+        << "  --max-dt DT        largest adaptive time step, in steps of 1/60 s (default: 4)\n"
+        << "  --snapshot FILE    start every run from a snapshot instead of --particles\n"
+        << "  --save-snapshot FILE  save the state at the end of the last run\n"
+        << "  --record FILE      record the trajectory of the last run (include/trajectory.h)\n"
+        << "  --record-every N   steps between recorded frames (default 1)\n"
+        << "  --csv FILE         write results as CSV\n"
+        << "  --json FILE        write results as JSON\n"
+        << "  --trace FILE       write the last run as Chrome trace JSON (chrome://tracing)\n"
+        << "  --validate         run --steps steps of every configuration, then one step with the scalar and\n"
+        << "                     one with the best SIMD kernels and compare their densities and forces per\n"
+        << "                     particle instead of benchmarking (exit code 1 beyond the tolerances), and\n"
+        << "                     check that the kernel tables are zero at the edge of the support\n";
+}
+
+// --------------------------------------------------------------------
+int main( int argc, char** argv )
+{
+#if SPH_DIMENSION == 3
+    // Volumetric scenes need far more particles for the same resolution
+    std::vector<unsigned int> counts = { 8192, 65536, 262144, 1048576 };
+#else
+    std::vector<unsigned int> counts = { 1024, 2048, 4096, 8192 };
+#endif
+    std::vector<unsigned int> threadCounts;
+    unsigned int steps = 3000;
+    unsigned int warmup = 0;
+    std::string material = "default";
+    std::string index = "incremental";
+    std::string neighbors = "pool";
+    std::string simd = "scalar";
+    std::string passes = "fused";
+    std::string kernelEval = "analytic";
+    std::string schedule = "tiles";
+    std::string timestep = "fixed";
+    std::string solvers = solverName( SOLVER_DOUBLE_DENSITY );
+    std::string kernels = kernelName( KERNEL_LINEAR );
+    std::vector<float> timeSteps( 1, 1.0f );
+    std::string csvPath, jsonPath, tracePath;
+    std::string snapshotPath, saveSnapshotPath;
+    std::string recordPath;
+    unsigned int recordEvery = 1;
+    bool validate = false;
+
+    for( int a = 1; a < argc; ++a )
+    {
+        const std::string arg = argv[a];
+        const bool hasValue = a + 1 < argc;
+        if( arg == "--particles" && hasValue ) counts = parseList( argv[++a] );
+        else if( arg == "--steps" && hasValue ) steps = (unsigned int)strtoul( argv[++a], 0, 10 );
+        else if( arg == "--warmup" && hasValue ) warmup = (unsigned int)strtoul( argv[++a], 0, 10 );
+        else if( arg == "--threads" && hasValue ) threadCounts = parseList( argv[++a] );
+        else if( arg == "--material" && hasValue ) material = argv[++a];
+        else if( arg == "--index" && hasValue ) index = argv[++a];
+        else if( arg == "--simd" && hasValue ) simd = argv[++a];
+        else if( arg == "--passes" && hasValue ) passes = argv[++a];
+        else if( arg == "--kernel" && hasValue ) kernels = argv[++a];
+        else if( arg == "--kernel-eval" && hasValue ) kernelEval = argv[++a];
+        else if( arg == "--schedule" && hasValue ) schedule = argv[++a];
+        else if( arg == "--skin" && hasValue ) verletSkin = (float)atof( argv[++a] );
+        else if( arg == "--neighbors" && hasValue ) neighbors = argv[++a];
+        else if( arg == "--slots" && hasValue ) neighborSlots = (unsigned int)strtoul( argv[++a], 0, 10 );
+        else if( arg == "--overflow" && hasValue ) neighborOverflowShare = (float)atof( argv[++a] );
+        else if( arg == "--solver" && hasValue ) solvers = argv[++a];
+        else if( arg == "--iterations" && hasValue ) pbfIterations = (unsigned int)strtoul( argv[++a], 0, 10 );
+        else if( arg == "--dt" && hasValue ) timeSteps = parseFloatList( argv[++a] );
+        else if( arg == "--timestep" && hasValue ) timestep = argv[++a];
+        else if( arg == "--cfl" && hasValue ) cflNumber = (float)atof( argv[++a] );
+        else if( arg == "--max-dt" && hasValue ) maxTimeStep = (float)atof( argv[++a] );
+        else if( arg == "--snapshot" && hasValue ) snapshotPath = argv[++a];
+        else if( arg == "--save-snapshot" && hasValue ) saveSnapshotPath = argv[++a];
+        else if( arg == "--record" && hasValue ) recordPath = argv[++a];
+        else if( arg == "--record-every" && hasValue ) recordEvery = (unsigned int)strtoul( argv[++a], 0, 10 );
+        else if( arg == "--csv" && hasValue ) csvPath = argv[++a];
+        else if( arg == "--json" && hasValue ) jsonPath = argv[++a];
+        else if( arg == "--trace" && hasValue ) tracePath = argv[++a];
+        else if( arg == "--validate" ) validate = true;
+        else
+        {
+            usage( argv[0] );
+            return arg == "--help" || arg == "-h" ? 0 : 1;
+        }
+    }
+
+    std::vector<int> materialIds;
+    const bool materialsOk = parseNames( material, MATERIAL_PRESET_COUNT, materialName, materialIds );
+    std::vector<int> solverIds;
+    const bool solversOk = parseNames( solvers, SOLVER_COUNT, solverName, solverIds );
+    std::vector<int> kernelIds;
+    const bool kernelsOk = parseNames( kernels, KERNEL_COUNT, kernelName, kernelIds );
+    bool timeStepsOk = !timeSteps.empty();
+    for( const float dt : timeSteps )
+    {
+        timeStepsOk = timeStepsOk && dt > 0;
+    }
+    if( !materialsOk || !solversOk || !kernelsOk || !timeStepsOk || counts.empty() || steps == 0 || recordEvery == 0 || ( index != "incremental" && index != "full" )
+        || ( neighbors != "pool" && neighbors != "bounded" ) || !( neighborOverflowShare >= 0 )
+        || ( passes != "fused" && passes != "separate" ) || ( kernelEval != "analytic" && kernelEval != "table" )
+        || ( schedule != "tiles" && schedule != "static" )
+        || ( timestep != "fixed" && timestep != "adaptive" ) || !( cflNumber > 0 ) || !( maxTimeStep >= minTimeStep ) )
+    {
+        usage( argv[0] );
+        return 1;
+    }
+    incrementalIndex = ( index == "incremental" );
+    boundedNeighbors = ( neighbors == "bounded" );
+    fusePasses = ( passes == "fused" );
+    tabulatedKernel = ( kernelEval == "table" );
+    tileScheduling = ( schedule == "tiles" );
+    adaptiveTimeStep = ( timestep == "adaptive" );
+    if( adaptiveTimeStep )
+    {
+        // (the controller picks the step sizes)
+        timeSteps.assign( 1, 1.0f );
+    }
+    for( const int id : solverIds )
+    {
+        if( !setSolver( id ) )
+        {
+            std::cerr << solverName( id ) << " is not available in this build" << std::endl;
+            return 1;
+        }
+    }
+
+    int isa = simdBestISA();
+    if( simd != "auto" )
+    {
+        for( isa = SIMD_NEON; isa > SIMD_SCALAR && simd != simdISAName( isa ); --isa );
+        if( simd != simdISAName( isa ) )
+        {
+            usage( argv[0] );
+            return 1;
+        }
+    }
+    if( !setSimdISA( isa ) )
+    {
+        std::cerr << simd << " is not supported on this CPU" << std::endl;
+        return 1;
+    }
+
+    if( !snapshotPath.empty() )
+    {
+        if( !loadSnapshot( snapshotPath.c_str() ) )
+        {
+            std::cerr << snapshotPath << " is not a snapshot of this version" << std::endl;
+            return 1;
+        }
+        counts.assign( 1, particles.N );
+        shutdown();
+    }
+
+    if( threadCounts.empty() )
+    {
+        threadCounts.push_back( (unsigned int)omp_get_max_threads() );
+    }
+
+    std::vector<BenchResult> results;
+    bool failed = false;
+    if( validate )
+    {
+        failed |= !validateKernelTable<LinearKernel>( KERNEL_LINEAR );
+        failed |= !validateKernelTable<Poly6Kernel>( KERNEL_POLY6 );
+        failed |= !validateKernelTable<SpikyKernel>( KERNEL_SPIKY );
+        failed |= !validateKernelTable<CubicSplineKernel>( KERNEL_CUBIC_SPLINE );
+        failed |= !validateKernelTable<WendlandC2Kernel>( KERNEL_WENDLAND_C2 );
+    }
+
+    std::cout << "--------------------------------" << std::endl;
+    std::cout << "Number of steps: " << steps << std::endl;
+    std::cout << "Dimensions: " << SPH_DIMENSION << std::endl;
+    std::cout << "SIMD: " << simdISAName( simdISA() ) << std::endl;
+    std::cout << "Kernel evaluation: " << kernelEval << std::endl;
+
+    // Every combination of solver, kernel, time step and thread count runs all particle counts
+    struct Config
+    {
+        int solver;
+        int kernel;
+        float timeStep;
+        unsigned int threads;
+    };
+    std::vector<Config> configs;
+    for( const int id : solverIds )
+    {
+        for( const int kernelId : kernelIds )
+        {
+            for( const float dt : timeSteps )
+            {
+                for( const unsigned int threads : threadCounts )
+                {
+                    const Config config = { id, kernelId, dt, threads };
+                    configs.push_back( config );
+                }
+            }
+        }
+    }
+
+    for( size_t c = 0; c < configs.size(); ++c )
+    {
+        const unsigned int threads = configs[c].threads;
+        setSolver( configs[c].solver );
+        setKernel( configs[c].kernel );
+        fixedTimeStep = configs[c].timeStep;
+        omp_set_num_threads( (int)threads );
+        std::cout << "Solver: " << solverName( solver() );
+        if( solver() == SOLVER_PBF )
+        {
+            std::cout << " (" << pbfIterations << " iterations)";
+        }
+        std::cout << ", kernel: " << kernelName( kernel() ) << ", time step: ";
+        if( adaptiveTimeStep )
+        {
+            std::cout << "adaptive, CFL " << cflNumber;
+        }
+        else
+        {
+            std::cout << fixedTimeStep;
+        }
+        std::cout << std::endl;
+        std::cout << "Number of threads: " << threads << std::endl;
+        for( const unsigned int count : counts )
+        {
+            std::cout << "Number of particles: " << count << std::endl;
+
+            if( validate )
+            {
+                failed |= !validateSimd( count, steps, materialIds, snapshotPath );
+                std::cout << std::endl;
+                continue;
+            }
+
+            const bool last = c + 1 == configs.size() && count == counts.back();
+            const BenchResult r = run( count, steps, warmup, (int)threads, materialIds, snapshotPath,
+                                       last ? saveSnapshotPath : std::string(), last ? recordPath : std::string(), recordEvery );
+            results.push_back( r );
+
+            std::cout << "Elapsed time: " << r.elapsedMs << " milliseconds" << std::endl;
+            std::cout << "Microseconds per step: " << r.usPerStep << std::endl;
+            std::cout << "Percentiles (us): p50 " << r.p50 << ", p90 " << r.p90 << ", p99 " << r.p99
+                      << ", min " << r.min << ", max " << r.max << std::endl;
+            std::printf( "Simulated time: %.0f steps of 1/60 s (mean time step %.3f, %.1f steps per simulated second),"
+                         " %.2f simulated seconds per second\n",
+                         r.simulatedSteps, r.simulatedSteps / r.steps, r.steps / ( r.simulatedSteps * STEP_SECONDS ),
+                         r.simulatedPerSecond );
+            std::printf( "Density error: mean %.2f%%, max %.1f%% above rest density, %.1f neighbors per particle\n",
+                         r.densityError * 100, r.densityErrorMax * 100, r.neighbors );
+            std::printf( "Neighbor storage: %.0f bytes per particle", r.neighborBytes );
+            if( r.bounded.repeats )
+            {
+                std::printf( ", DENSITY repeated %llu times", r.bounded.repeats );
+            }
+            if( r.bounded.passes )
+            {
+                // Lists per particle and pass that did not fit the slots
+                const double lists = (double)r.bounded.passes * r.particles;
+                std::printf( " (%u slots, %.1f%% of them empty and overflow %.0f%% full at most), %.3f%% of the lists overflowed,"
+                             " %.3f%% cut off (%llu lists, %llu neighbors dropped)",
+                             r.bounded.slots, 100.0 * r.bounded.idlePeak / ( (double)r.particles * r.bounded.slots ),
+                             r.bounded.overflowCapacity ? 100.0 * r.bounded.overflowPeak / r.bounded.overflowCapacity : 0.0,
+                             100.0 * r.bounded.overflows / lists, 100.0 * r.bounded.truncated / lists,
+                             r.bounded.truncated, r.bounded.dropped );
+            }
+            std::printf( "\n" );
+            if( r.solverIterations > 0 )
+            {
+                std::printf( "Pressure solver: %.1f iterations per step, last one at %.2f%% compression", r.solverIterations, r.solverError * 100 );
+                if( r.divergenceIterations > 0 )
+                {
+                    std::printf( ", divergence %.1f iterations, last one at %.2f%%", r.divergenceIterations, r.divergenceError * 100 );
+                }
+                std::printf( "\n" );
+            }
+            std::cout << "Spatial index: " << r.index.rebuilds << " rebuilds, " << r.index.updates << " incremental updates";
+            if( r.index.updates )
+            {
+                std::cout << " moving " << (double)r.index.moved / r.index.updates << " particles each";
+            }
+            if( r.index.clamped )
+            {
+                std::cout << ", " << r.index.clamped << " cut to the walls";
+            }
+            std::cout << std::endl;
+            if( r.verlet.builds )
+            {
+                // Every reuse saves one build but all steps pay for the check
+                const double buildUs = r.verlet.buildUs / r.verlet.builds;
+                std::cout << "Verlet lists: " << r.verlet.builds << " builds, " << r.verlet.reuses << " reuses, "
+                          << buildUs << " us per build, "
+                          << ( r.verlet.reuses * buildUs - r.verlet.checkUs ) / r.steps << " us per step saved" << std::endl;
+            }
+            if( !r.utilization.empty() )
+            {
+                std::cout << "Scheduler (" << schedule << "): " << r.steals << " steals, utilization";
+                for( const double u : r.utilization )
+                {
+                    std::printf( " %.0f%%", u * 100 );
+                }
+                std::cout << std::endl;
+            }
+            if( r.recorded && r.recording.frames )
+            {
+                // Compared to float positions without any headers
+                const TrajectoryWriter::Stats& rec = r.recording;
+                const double raw = (double)rec.frames * r.particles * sizeof( vecD );
+                std::printf( "Trajectory: %u frames (%u keyframes), %.1f bytes per particle and frame, %.1fx smaller than floats,"
+                             " record %.1f us (waiting %.1f us), encode %.1f us per frame\n",
+                             rec.frames, rec.keyframes, (double)rec.bytes / rec.frames / r.particles, raw / rec.bytes,
+                             rec.recordUs / rec.frames, rec.waitUs / rec.frames, rec.encodeUs / rec.frames );
+            }
+            // (empty when built with SPH_PROFILING 0)
+            for( int p = 0; p < PHASE_COUNT && profileStepCount(); ++p )
+            {
+                if( r.phaseUs[p] == 0 )
+                {
+                    // did not run in this configuration
+                    continue;
+                }
+                std::printf( "  %-16s %10.2f us", profilePhaseName( p ), r.phaseUs[p] );
+                if( r.imbalance[p] > 0 )
+                {
+                    std::printf( "   max/min thread %.2f", r.imbalance[p] );
+                }
+                std::printf( "\n" );
+            }
+            std::cout << std::endl;
+        }
+    }
+
+    // The neighbor pool is split by tiles, not by threads, so more threads must not need more storage
+    // (the runs of one configuration differ a little, since threads sum the densities in another order)
+    for( size_t i = 0; i < results.size(); ++i )
+    {
+        for( size_t j = 0; j < i; ++j )
+        {
+            const BenchResult& a = results[j];
+            const BenchResult& b = results[i];
+            if( a.solver != b.solver || a.kernel != b.kernel || a.timeStep != b.timeStep || a.particles != b.particles
+                || a.threads == b.threads )
+            {
+                continue;
+            }
+            const double lo = std::min( a.neighborBytes, b.neighborBytes );
+            const double hi = std::max( a.neighborBytes, b.neighborBytes );
+            if( hi > lo * 1.25 + 16 )
+            {
+                std::printf( "Neighbor storage grows with the thread count: %.0f bytes per particle with %d threads,"
+                             " %.0f with %d (%u particles)\n", a.neighborBytes, a.threads, b.neighborBytes, b.threads, b.particles );
+                failed = true;
+            }
+        }
+    }
+
+    // (the layers of a mixed scene joined by '+', commas would split the CSV column)
+    std::replace( material.begin(), material.end(), ',', '+' );
+    if( !csvPath.empty() )
+    {
+        writeCSV( csvPath, material, results );
+    }
+    if( !jsonPath.empty() )
+    {
+        writeJSON( jsonPath, material, results );
+    }
+    if( !tracePath.empty() && !writeChromeTrace( tracePath.c_str() ) )
+    {
+        std::cerr << "Could not write " << tracePath << std::endl;
+        return 1;
+    }
+
+    return failed ? 1 : 0;
+}
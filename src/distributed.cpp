@@ -0,0 +1,491 @@
+// Real-Time Physics Tutorials
+// Brandon Pelfrey
+// SPH Fluid Simulation
+
+#include <distributed.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cfloat>
+#include <cstdint>
+
+#if CURRENT_PAIR_EVALUATION != PAIR_EVALUATION_FULL
+#error "The distributed solver needs PAIR_EVALUATION_FULL"
+#endif
+
+using namespace std::chrono;
+
+unsigned int rebalanceInterval = 50;
+
+// Histogram bins of rebalance(), coarser than r for very tall domains
+static const unsigned int MAX_BINS = 1 << 16;
+
+static MPI_Comm comm_ = MPI_COMM_NULL;
+static int rank_ = 0;
+static int ranks_ = 1;
+
+// Rank k owns y in [cuts_[k-1], cuts_[k]), the first and the last slab are open
+static std::vector<float> cuts_;
+static DistributedStats stats_;
+
+// Slots sent as ghosts to the rank below and above in this step, their densities follow
+static std::vector<unsigned int> haloSent_[2];
+// Ghosts received from the rank above, they come first, the rest is from the rank below
+static unsigned int ghostsFromAbove_ = 0;
+
+// Everything step() carries over to the next step, see snapshot.h
+struct Migrant
+{
+    vecD pos, pos_old, vel, force;
+    float a;
+    uint32_t stable_id;
+    unsigned char material;
+};
+
+// What the passes after UPDATE read from a neighbor
+struct Ghost
+{
+    vecD pos, vel;
+    uint32_t stable_id;
+    unsigned char material;
+};
+
+struct GhostDensity
+{
+    float rho, rho_near;
+};
+
+// --------------------------------------------------------------------
+static inline int ownerOf( const float y )
+{
+    return (int)( std::upper_bound( cuts_.begin(), cuts_.end(), y ) - cuts_.begin() );
+}
+
+float slabBegin()
+{
+    return rank_ > 0 ? cuts_[rank_ - 1] : -FLT_MAX;
+}
+
+float slabEnd()
+{
+    return rank_ < ranks_ - 1 ? cuts_[rank_] : FLT_MAX;
+}
+
+// --------------------------------------------------------------------
+// Sends records to one rank and receives from another, either may be MPI_PROC_NULL.
+// Without a known count the receiver first learns it from the sender.
+template< typename T >
+static void shift( const std::vector<T>& send, const int to, std::vector<T>& recv, const int from, const bool countKnown )
+{
+    if( !countKnown )
+    {
+        int sendCount = (int)send.size();
+        int recvCount = 0;
+        MPI_Sendrecv( &sendCount, 1, MPI_INT, to, 0, &recvCount, 1, MPI_INT, from, 0, comm_, MPI_STATUS_IGNORE );
+        recv.resize( recvCount );
+    }
+    MPI_Sendrecv( send.data(), (int)( send.size() * sizeof( T ) ), MPI_BYTE, to, 1,
+        recv.data(), (int)( recv.size() * sizeof( T ) ), MPI_BYTE, from, 1, comm_, MPI_STATUS_IGNORE );
+}
+
+// --------------------------------------------------------------------
+// Moves particle s of this rank to slot i, both owned
+static inline void moveSlot( const unsigned int i, const unsigned int s )
+{
+    if( i != s )
+    {
+        particles.copy( i, particles, s );
+    }
+}
+
+// Appends count particles behind the first N, growing the storage by half at least
+static void growBy( const unsigned int count )
+{
+    const unsigned int needed = particles.N + count;
+    if( needed > particles.capacity )
+    {
+        particles.reserve( std::max( needed, particles.capacity + particles.capacity / 2 ) );
+    }
+    particles.N = needed;
+}
+
+// Owned particles changed slots
+static void slotsChanged()
+{
+    const unsigned int owned = particles.N - ghostCount;
+#pragma omp parallel for
+    for( int i = 0; i < (int)owned; ++i )
+    {
+        particles.storage_index[particles.stable_id[i]] = i;
+    }
+    particlesChanged();
+}
+
+// --------------------------------------------------------------------
+// Places the borders at the quantiles of the particle count along y.
+// Borders fall on bin edges and every inner slab spans at least one bin,
+// so no slab is thinner than r and the ghosts only come from adjacent ranks.
+static void rebalance()
+{
+    const unsigned int N = particles.N;
+    float extent[2] = { -FLT_MAX, -FLT_MAX }; // -min, max
+#pragma omp parallel
+    {
+        float lo = FLT_MAX, hi = -FLT_MAX;
+#pragma omp for nowait
+        for( int i = 0; i < (int)N; ++i )
+        {
+            const float y = particles.pos( i ).y;
+            lo = std::min( lo, y );
+            hi = std::max( hi, y );
+        }
+#pragma omp critical
+        {
+            extent[0] = std::max( extent[0], -lo );
+            extent[1] = std::max( extent[1], hi );
+        }
+    }
+    MPI_Allreduce( MPI_IN_PLACE, extent, 2, MPI_FLOAT, MPI_MAX, comm_ );
+    const float lo = -extent[0];
+    const float hi = extent[1];
+    if( lo > hi )
+    {
+        return; // no particles at all
+    }
+
+    const float width = std::max( r, ( hi - lo ) / ( MAX_BINS - 1 ) );
+    const unsigned int bins = (unsigned int)( ( hi - lo ) / width ) + 1;
+    std::vector<uint64_t> histogram( bins, 0 );
+    for( unsigned int i = 0; i < N; ++i )
+    {
+        const unsigned int bin = (unsigned int)( ( particles.pos( i ).y - lo ) / width );
+        histogram[std::min( bin, bins - 1 )]++;
+    }
+    MPI_Allreduce( MPI_IN_PLACE, histogram.data(), (int)bins, MPI_UINT64_T, MPI_SUM, comm_ );
+
+    uint64_t total = 0;
+    for( const uint64_t h : histogram ) total += h;
+
+    // Border k is the edge before the first bin at which k / ranks of the particles are below
+    cuts_.resize( ranks_ - 1 );
+    uint64_t below = 0;
+    unsigned int bin = 0;
+    unsigned int edge = 0;
+    for( int k = 1; k < ranks_; ++k )
+    {
+        const uint64_t target = total * k / ranks_;
+        while( bin < bins && below + histogram[bin] <= target )
+        {
+            below += histogram[bin++];
+        }
+        edge = std::max( bin, edge + 1 );
+        cuts_[k - 1] = lo + edge * width;
+    }
+    stats_.rebalances++;
+}
+
+// --------------------------------------------------------------------
+// Sends every owned particle outside of the slab to the rank of its slab
+static void migrate()
+{
+    const unsigned int N = particles.N;
+    std::vector<int> owner( N );
+#pragma omp parallel for
+    for( int i = 0; i < (int)N; ++i )
+    {
+        owner[i] = ownerOf( particles.pos( i ).y );
+    }
+
+    // Grouped by destination for the all-to-all
+    std::vector<int> sendCounts( ranks_, 0 );
+    for( unsigned int i = 0; i < N; ++i )
+    {
+        sendCounts[owner[i]]++;
+    }
+    sendCounts[rank_] = 0;
+    std::vector<int> sendOffsets( ranks_, 0 );
+    for( int k = 1; k < ranks_; ++k )
+    {
+        sendOffsets[k] = sendOffsets[k - 1] + sendCounts[k - 1];
+    }
+    std::vector<Migrant> send( sendOffsets[ranks_ - 1] + sendCounts[ranks_ - 1] );
+
+    // The particles that stay are compacted in their order
+    unsigned int kept = 0;
+    std::vector<int> cursor( sendOffsets );
+    for( unsigned int i = 0; i < N; ++i )
+    {
+        if( owner[i] == rank_ )
+        {
+            moveSlot( kept++, i );
+            continue;
+        }
+        Migrant& m = send[cursor[owner[i]]++];
+        m.pos = particles.pos( i );
+        m.pos_old = particles.pos_old( i );
+        m.vel = particles.vel( i );
+        m.force = particles.force( i );
+        m.material = particles.material( i );
+        m.a = particles.a( i );
+        m.stable_id = particles.stable_id[i];
+    }
+    stats_.migrated += send.size();
+
+    std::vector<int> recvCounts( ranks_ );
+    MPI_Alltoall( sendCounts.data(), 1, MPI_INT, recvCounts.data(), 1, MPI_INT, comm_ );
+    std::vector<int> recvOffsets( ranks_, 0 );
+    for( int k = 1; k < ranks_; ++k )
+    {
+        recvOffsets[k] = recvOffsets[k - 1] + recvCounts[k - 1];
+    }
+    std::vector<Migrant> recv( recvOffsets[ranks_ - 1] + recvCounts[ranks_ - 1] );
+
+    // (counts and offsets in bytes)
+    for( int k = 0; k < ranks_; ++k )
+    {
+        sendCounts[k] *= sizeof( Migrant );
+        sendOffsets[k] *= sizeof( Migrant );
+        recvCounts[k] *= sizeof( Migrant );
+        recvOffsets[k] *= sizeof( Migrant );
+    }
+    MPI_Alltoallv( send.data(), sendCounts.data(), sendOffsets.data(), MPI_BYTE,
+        recv.data(), recvCounts.data(), recvOffsets.data(), MPI_BYTE, comm_ );
+
+    particles.N = kept;
+    growBy( (unsigned int)recv.size() );
+#pragma omp parallel for
+    for( int m = 0; m < (int)recv.size(); ++m )
+    {
+        const unsigned int i = kept + m;
+        particles.id( i ) = i;
+        particles.set_pos( i, recv[m].pos );
+        particles.set_pos_old( i, recv[m].pos_old );
+        particles.set_vel( i, recv[m].vel );
+        particles.set_force( i, recv[m].force );
+        particles.material( i ) = recv[m].material;
+        particles.a( i ) = recv[m].a;
+        particles.stable_id[i] = recv[m].stable_id;
+        particles.neighbor_offset( i ) = 0;
+        particles.neighbor_count( i ) = 0;
+    }
+}
+
+// --------------------------------------------------------------------
+// Appends copies of the particles within r of the borders of the adjacent slabs
+static void exchangeGhosts()
+{
+    const unsigned int owned = particles.N;
+    const float begin = slabBegin();
+    const float end = slabEnd();
+    const int below = rank_ > 0 ? rank_ - 1 : MPI_PROC_NULL;
+    const int above = rank_ < ranks_ - 1 ? rank_ + 1 : MPI_PROC_NULL;
+
+    std::vector<Ghost> send[2];
+    for( int side = 0; side < 2; ++side )
+    {
+        haloSent_[side].clear();
+    }
+    for( unsigned int i = 0; i < owned; ++i )
+    {
+        const float y = particles.pos( i ).y;
+        const int sides[2] = { below != MPI_PROC_NULL && y < begin + r, above != MPI_PROC_NULL && y >= end - r };
+        for( int side = 0; side < 2; ++side )
+        {
+            if( !sides[side] )
+            {
+                continue;
+            }
+            Ghost g;
+            g.pos = particles.pos( i );
+            g.vel = particles.vel( i );
+            g.material = particles.material( i );
+            g.stable_id = particles.stable_id[i];
+            send[side].push_back( g );
+            haloSent_[side].push_back( i );
+        }
+    }
+
+    // Downwards first, so the ghosts from above come first
+    std::vector<Ghost> fromAbove, fromBelow;
+    shift( send[0], below, fromAbove, above, false );
+    shift( send[1], above, fromBelow, below, false );
+    ghostsFromAbove_ = (unsigned int)fromAbove.size();
+
+    growBy( (unsigned int)( fromAbove.size() + fromBelow.size() ) );
+    ghostCount = particles.N - owned;
+    stats_.ghosts += ghostCount;
+#pragma omp parallel for
+    for( int n = 0; n < (int)ghostCount; ++n )
+    {
+        const Ghost& g = n < (int)ghostsFromAbove_ ? fromAbove[n] : fromBelow[n - ghostsFromAbove_];
+        const unsigned int i = owned + n;
+        particles.id( i ) = i;
+        particles.set_pos( i, g.pos );
+        particles.set_pos_old( i, g.pos );
+        particles.set_vel( i, g.vel );
+        particles.set_force( i, vecD( 0 ) );
+        particles.material( i ) = g.material;
+        particles.a( i ) = 0;
+        particles.stable_id[i] = g.stable_id;
+        particles.neighbor_offset( i ) = 0;
+        particles.neighbor_count( i ) = 0;
+    }
+}
+
+// --------------------------------------------------------------------
+static void afterUpdate()
+{
+    const high_resolution_clock::time_point start = high_resolution_clock::now();
+
+    // The ghosts of the last step are stale now
+    particles.N -= ghostCount;
+    ghostCount = 0;
+
+    if( adaptiveTimeStep )
+    {
+        // All ranks take the step of the fastest particle anywhere
+        TimeStepState state = timeStepState();
+        MPI_Allreduce( MPI_IN_PLACE, &state.nextStep, 1, MPI_FLOAT, MPI_MIN, comm_ );
+        setTimeStepState( state );
+    }
+
+    if( rebalanceInterval && stepCount() % rebalanceInterval == 0 )
+    {
+        rebalance();
+    }
+    migrate();
+    exchangeGhosts();
+    slotsChanged();
+
+    stats_.exchangeUs += duration<double, std::micro>( high_resolution_clock::now() - start ).count();
+}
+
+// --------------------------------------------------------------------
+static void afterDensity()
+{
+    const high_resolution_clock::time_point start = high_resolution_clock::now();
+
+    const unsigned int owned = particles.N - ghostCount;
+    const int below = rank_ > 0 ? rank_ - 1 : MPI_PROC_NULL;
+    const int above = rank_ < ranks_ - 1 ? rank_ + 1 : MPI_PROC_NULL;
+
+    // In the order the ghosts were sent
+    std::vector<GhostDensity> send[2];
+    for( int side = 0; side < 2; ++side )
+    {
+        send[side].resize( haloSent_[side].size() );
+        for( size_t n = 0; n < haloSent_[side].size(); ++n )
+        {
+            send[side][n].rho = particles.rho( haloSent_[side][n] );
+            send[side][n].rho_near = particles.rho_near( haloSent_[side][n] );
+        }
+    }
+    std::vector<GhostDensity> fromAbove( ghostsFromAbove_ ), fromBelow( ghostCount - ghostsFromAbove_ );
+    shift( send[0], below, fromAbove, above, true );
+    shift( send[1], above, fromBelow, below, true );
+
+    for( unsigned int n = 0; n < ghostCount; ++n )
+    {
+        const GhostDensity& d = n < ghostsFromAbove_ ? fromAbove[n] : fromBelow[n - ghostsFromAbove_];
+        particles.rho( owned + n ) = d.rho;
+        particles.rho_near( owned + n ) = d.rho_near;
+    }
+
+    stats_.exchangeUs += duration<double, std::micro>( high_resolution_clock::now() - start ).count();
+}
+
+// --------------------------------------------------------------------
+void startDistributed( MPI_Comm comm )
+{
+    comm_ = comm;
+    MPI_Comm_rank( comm_, &rank_ );
+    MPI_Comm_size( comm_, &ranks_ );
+    stats_ = DistributedStats();
+    ghostCount = 0;
+    haloSent_[0].clear();
+    haloSent_[1].clear();
+    ghostsFromAbove_ = 0;
+
+    // Every rank holds all particles, which scales the histogram but not its quantiles
+    cuts_.assign( ranks_ - 1, FLT_MAX );
+    rebalance();
+
+    unsigned int kept = 0;
+    for( unsigned int i = 0; i < particles.N; ++i )
+    {
+        if( ownerOf( particles.pos( i ).y ) == rank_ )
+        {
+            moveSlot( kept++, i );
+        }
+    }
+    particles.N = kept;
+    slotsChanged();
+
+    afterUpdateHook = afterUpdate;
+    afterDensityHook = afterDensity;
+}
+
+// --------------------------------------------------------------------
+void stopDistributed()
+{
+    particles.N -= ghostCount;
+    ghostCount = 0;
+    particlesChanged();
+    afterUpdateHook = 0;
+    afterDensityHook = 0;
+    comm_ = MPI_COMM_NULL;
+}
+
+// --------------------------------------------------------------------
+const DistributedStats& distributedStats()
+{
+    return stats_;
+}
+
+// --------------------------------------------------------------------
+unsigned long long distributedParticleCount()
+{
+    unsigned long long owned = particles.N - ghostCount;
+    MPI_Allreduce( MPI_IN_PLACE, &owned, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, comm_ );
+    return owned;
+}
+
+// --------------------------------------------------------------------
+void gatherPositions( std::vector<vecD>& positions, const int root )
+{
+    struct Record
+    {
+        vecD pos;
+        uint32_t stable_id;
+    };
+    const unsigned int owned = particles.N - ghostCount;
+    std::vector<Record> send( owned );
+    for( unsigned int i = 0; i < owned; ++i )
+    {
+        send[i].pos = particles.pos( i );
+        send[i].stable_id = particles.stable_id[i];
+    }
+
+    int bytes = (int)( owned * sizeof( Record ) );
+    std::vector<int> counts( rank_ == root ? ranks_ : 0 );
+    MPI_Gather( &bytes, 1, MPI_INT, counts.data(), 1, MPI_INT, root, comm_ );
+    std::vector<int> offsets( counts.size(), 0 );
+    for( size_t k = 1; k < counts.size(); ++k )
+    {
+        offsets[k] = offsets[k - 1] + counts[k - 1];
+    }
+    std::vector<Record> recv( counts.empty() ? 0 : ( offsets.back() + counts.back() ) / sizeof( Record ) );
+    MPI_Gatherv( send.data(), bytes, MPI_BYTE, recv.data(), counts.data(), offsets.data(), MPI_BYTE, root, comm_ );
+
+    if( rank_ == root )
+    {
+        positions.assign( recv.size(), vecD( 0 ) );
+        for( const Record& rec : recv )
+        {
+            if( rec.stable_id < positions.size() )
+            {
+                positions[rec.stable_id] = rec.pos;
+            }
+        }
+    }
+}
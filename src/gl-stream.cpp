@@ -0,0 +1,104 @@
+#include <gl-stream.h>
+
+#include <glad/glad.h>
+
+#include <chrono>
+
+using namespace std::chrono;
+
+/**
+*
+*/
+bool isGLVertexStreamSupported() {
+	return (GLAD_GL_VERSION_4_4 || GLAD_GL_ARB_buffer_storage) && glBufferStorage && glFenceSync;
+}
+
+/**
+* Immutable storage, mapped once for the lifetime of the buffer.
+* Coherent, so writes become visible to the GPU without explicit flushes.
+*/
+bool createGLVertexStream(size_t regionBytes, GLVertexStream* outStream) {
+	if (!isGLVertexStreamSupported() || regionBytes == 0) {
+		return false;
+	}
+
+	const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	const GLsizeiptr bytes = (GLsizeiptr)(regionBytes * GL_STREAM_REGIONS);
+
+	GLuint vbo = 0;
+	glGenBuffers(1, &vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	glBufferStorage(GL_ARRAY_BUFFER, bytes, 0, flags);
+	void* mapped = glMapBufferRange(GL_ARRAY_BUFFER, 0, bytes, flags);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	if (!mapped) {
+		glDeleteBuffers(1, &vbo);
+		return false;
+	}
+
+	*outStream = GLVertexStream();
+	outStream->vbo = vbo;
+	outStream->mapped = (unsigned char*)mapped;
+	outStream->regionBytes = regionBytes;
+	outStream->region = GL_STREAM_REGIONS - 1; // so the first write goes to region 0
+	return true;
+}
+
+/**
+*
+*/
+void deleteGLVertexStream(GLVertexStream* stream) {
+	for (int i = 0; i < GL_STREAM_REGIONS; i++) {
+		if (stream->fences[i]) {
+			glClientWaitSync((GLsync)stream->fences[i], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+			glDeleteSync((GLsync)stream->fences[i]);
+		}
+	}
+	if (stream->vbo) {
+		glBindBuffer(GL_ARRAY_BUFFER, stream->vbo);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glDeleteBuffers(1, &stream->vbo);
+	}
+	*stream = GLVertexStream();
+}
+
+/**
+* With three regions the GPU may lag two frames behind before the CPU waits,
+* which only happens when drawing is slower than simulating and writing.
+*/
+void* nextGLVertexStreamRegion(GLVertexStream* stream) {
+	stream->region = (stream->region + 1) % GL_STREAM_REGIONS;
+
+	const high_resolution_clock::time_point start = high_resolution_clock::now();
+	GLsync fence = (GLsync)stream->fences[stream->region];
+	if (fence) {
+		// Flush once, so the fence is guaranteed to signal eventually
+		GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+		while (glClientWaitSync(fence, flags, 1000000) == GL_TIMEOUT_EXPIRED) {
+			flags = 0;
+		}
+		glDeleteSync(fence);
+		stream->fences[stream->region] = 0;
+	}
+	stream->waitMs = duration<double, std::milli>(high_resolution_clock::now() - start).count();
+
+	return stream->mapped + stream->region * stream->regionBytes;
+}
+
+/**
+*
+*/
+size_t currentGLVertexStreamOffset(const GLVertexStream* stream) {
+	return stream->region * stream->regionBytes;
+}
+
+/**
+*
+*/
+void fenceGLVertexStreamRegion(GLVertexStream* stream) {
+	if (stream->fences[stream->region]) {
+		glDeleteSync((GLsync)stream->fences[stream->region]);
+	}
+	stream->fences[stream->region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
@@ -1,4 +1,5 @@
 #include <gl-windows.h>
+#include <gl-stream.h>
 
 #include <assert.h>
 #include <windows.h>
@@ -15,8 +16,10 @@
 #include <iomanip> // std::setw
 #include <string>
 #include <thread>
+#include <mutex>
 #include <chrono>
 #include <fstream>
+#include <cstring> // memcpy
 
 const char* glerr2str(GLenum errorCode) {
 	switch(errorCode) {
@@ -99,6 +102,8 @@ static float pointSize_ = 40.f;
 
 float lightSource_[3] = { 0 };
 
+bool streamGLVertices = false;
+
 /**
 * ViewState is an internal management structure to enable multiple views in the GL window.
 * Views can be switched with PAGE[UP/DOWN] keys. This will also change the current shader in the console.
@@ -148,6 +153,15 @@ void main() {\n\
 	// Holds current drawing primitive
 	GLenum currentPrimitive_ = GL_TRIANGLES;
 
+	// Holds persistently mapped vertex buffer of createGLPoints2D, with streamGLVertices if supported by the context
+	GLVertexStream stream_;
+
+	// Holds first vertex to draw, i.e. start of the stream region written last
+	GLint firstVertex_ = 0;
+
+	// Holds size of one streamed vertex
+	GLsizei vertexBytes_ = 0;
+
 	// Holds mat4 for vertex transform
 	float* projection_ = 0;
 
@@ -174,6 +188,10 @@ static high_resolution_clock::time_point launchTime_;
 static high_resolution_clock::time_point lastSwapTime_;
 static uint64_t frameCount_ = 0;
 
+// Application text appended to the REPL info line, written by the render thread
+static std::string statusText_;
+static std::mutex statusMutex_;
+
 
 
 /**
@@ -748,7 +766,12 @@ static void runREPL() {
 				<< "Shadertime: " << std::fixed << std::setprecision(3) << shaderTime_.count() << "ms, "
 				<< "Frametime: " << std::fixed << std::setprecision(3) << frameTime_.count() << "ms, "
 				<< (v->currentPrimitive_ == GL_TRIANGLES ? v->currentVertexCount_/3 : v->currentVertexCount_)
-				<< (v->currentPrimitive_ == GL_TRIANGLES ? " Tris]" : "Points]") << std::flush;
+				<< (v->currentPrimitive_ == GL_TRIANGLES ? " Tris]" : "Points]");
+			{
+				std::lock_guard<std::mutex> lock(statusMutex_);
+				if (!statusText_.empty()) std::cout << " " << statusText_;
+			}
+			std::cout << std::flush;
 		}
 
 		// poll standard input before reading so that it is non-blocking
@@ -976,6 +999,16 @@ void createGLTriangles2D(size_t bytes, void* outBuffer, void* data) {
 	*((GLuint*)outBuffer) = vao;
 }
 
+/**
+* Region size of a vertex stream for at least bytes. A multiple of the vertex size, so that
+* every region starts at a whole vertex (see firstVertex_), and of 256 bytes.
+*/
+static size_t vertexStreamRegionBytes(size_t bytes, size_t vertexBytes) {
+	size_t align = vertexBytes;
+	while (align % 256) align += vertexBytes;
+	return (bytes + align - 1) / align * align;
+}
+
 /**
 *
 */
@@ -998,10 +1031,22 @@ void createGLPoints2D(size_t bytes, GLVertexHandle* outHandle, void* data, int s
 	glGenVertexArrays(1, &vao);
 	glBindVertexArray(vao);
 
+	// Vertices are rewritten every frame, so stream them through mapped memory if possible
 	GLuint vbo = 0;
-	glGenBuffers(1, &vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	glBufferData(GL_ARRAY_BUFFER, bytes, data, GL_STATIC_DRAW);
+	const GLsizei vertexBytes = stride ? stride : 3 * sizeof(float);
+	if (streamGLVertices && createGLVertexStream(vertexStreamRegionBytes(bytes, vertexBytes), &v->stream_)) {
+		vbo = v->stream_.vbo;
+		v->vertexBytes_ = vertexBytes;
+		void* region = nextGLVertexStreamRegion(&v->stream_);
+		if (data) memcpy(region, data, bytes);
+		else memset(region, 0, bytes);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	}
+	else {
+		glGenBuffers(1, &vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBufferData(GL_ARRAY_BUFFER, bytes, data, GL_STATIC_DRAW);
+	}
 
 	// Assume every vertex is 3 floats and no extra data
 	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, 0);
@@ -1031,7 +1076,45 @@ void createGLPointSprites2D(size_t bytes, GLVertexHandle* outHandle, void* data,
 /**
 *
 */
+void* mapGLVertexData(GLVertexHandle handle, size_t bytes) {
+	ViewState* v = 0;
+	for (int i = 0; i < viewStates_.size(); i++) {
+		if (viewStates_[i].vao_ == handle.vao && viewStates_[i].stream_.vbo) v = &viewStates_[i];
+	}
+	if (!v) {
+		return 0;
+	}
+
+	// Storage is immutable, so more vertices need a new buffer
+	if (bytes > v->stream_.regionBytes) {
+		GLVertexStream grown;
+		if (!createGLVertexStream(vertexStreamRegionBytes(bytes + bytes / 2, v->vertexBytes_), &grown)) {
+			std::cout << "Could not grow vertex stream to " << bytes << " bytes" << std::endl;
+			return 0;
+		}
+		deleteGLVertexStream(&v->stream_);
+		v->stream_ = grown;
+		glBindVertexArray(v->vao_);
+		glBindBuffer(GL_ARRAY_BUFFER, v->stream_.vbo);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, v->vertexBytes_, 0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindVertexArray(0);
+	}
+
+	void* region = nextGLVertexStreamRegion(&v->stream_);
+	v->firstVertex_ = (GLint)(currentGLVertexStreamOffset(&v->stream_) / v->vertexBytes_);
+	v->currentVertexCount_ = (GLsizei)(bytes / v->vertexBytes_);
+	return region;
+}
+
+/**
+* Copies into the mapped stream if there is one (see streamGLVertices), otherwise reallocates the buffer
+*/
 void updateGLVertexData(GLVertexHandle handle, size_t bytes, void* data) {
+	if (void* region = mapGLVertexData(handle, bytes)) {
+		memcpy(region, data, bytes);
+		return;
+	}
 	glBindBuffer(GL_ARRAY_BUFFER, handle.vbo);
 	glBufferData(GL_ARRAY_BUFFER, bytes, data, GL_DYNAMIC_DRAW);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
@@ -1266,7 +1349,12 @@ static void runGLShader_internal(unsigned int viewIdx, float* uniformSlot1, floa
 		// to framebuffer colors that are scaled with the transparency (1-alpha)
 		GL(BlendFunc, GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-		GL(DrawArrays, v->currentPrimitive_, 0, v->currentVertexCount_);
+		GL(DrawArrays, v->currentPrimitive_, v->firstVertex_, v->currentVertexCount_);
+	}
+
+	// The region may be written again once these draws are done
+	if (v->stream_.vbo) {
+		fenceGLVertexStreamRegion(&v->stream_);
 	}
 }
 
@@ -1483,6 +1571,10 @@ void closeGLWindowAndREPL() {
 
 	glDeleteVertexArrays(1, &v->vao_);
 
+	for (int i = 0; i < viewStates_.size(); i++) {
+		if (viewStates_[i].stream_.vbo) deleteGLVertexStream(&viewStates_[i].stream_);
+	}
+
     //TODO how can we tell if we actually leave garbage behind,
     // if we dont clean up all GL objects?
 
@@ -1499,6 +1591,11 @@ void getGLWindowSize(unsigned int* s) {
 	s[1] = height_;
 }
 
+void setGLStatusText(const char* text) {
+	std::lock_guard<std::mutex> lock(statusMutex_);
+	statusText_ = text ? text : "";
+}
+
 void updateGLLightSource(float x, float y, float z) {
     lightSource_[0] = x; lightSource_[1] = y; lightSource_[2] = z;
 }
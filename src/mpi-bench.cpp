@@ -0,0 +1,162 @@
+// Real-Time Physics Tutorials
+// Brandon Pelfrey
+// SPH Fluid Simulation
+
+// Benchmark of the distributed solver (distributed.h), e.g. on one machine with
+//   mpirun -np 4 sph-mpi-bench --particles 200000
+// Every rank runs the OpenMP threads of OMP_NUM_THREADS.
+//
+// Usage: sph-mpi-bench [options]
+//   --particles 100000     particles over all ranks
+//   --steps 500            measured steps
+//   --rebalance-every 50   steps between slab rebalancing, 0 keeps the initial slabs
+//   --timestep fixed       fixed or adaptive (CFL-limited) time step
+//   --validate             repeat the run in one process on rank 0 and compare the positions
+
+#include <sph.h>
+#include <distributed.h>
+
+#include <omp.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std::chrono;
+
+// --------------------------------------------------------------------
+static void usage( const char* exe )
+{
+    std::cerr
+        << "Usage: mpirun -np RANKS " << exe << " [options]\n"
+        << "  --particles N        particles over all ranks (default 100000)\n"
+        << "  --steps N            measured steps (default 500)\n"
+        << "  --rebalance-every N  steps between slab rebalancing, 0 keeps the initial slabs (default 50)\n"
+        << "  --timestep MODE      fixed or adaptive (CFL-limited) time step (default fixed)\n"
+        << "  --validate           repeat the run in one process on rank 0 and compare the positions\n";
+}
+
+// --------------------------------------------------------------------
+int main( int argc, char** argv )
+{
+    MPI_Init( &argc, &argv );
+    int rank = 0, ranks = 1;
+    MPI_Comm_rank( MPI_COMM_WORLD, &rank );
+    MPI_Comm_size( MPI_COMM_WORLD, &ranks );
+
+    unsigned int count = 100000;
+    unsigned int steps = 500;
+    bool validate = false;
+    for( int a = 1; a < argc; ++a )
+    {
+        const std::string arg = argv[a];
+        const bool hasValue = a + 1 < argc;
+        if( arg == "--particles" && hasValue ) count = (unsigned int)strtoul( argv[++a], 0, 10 );
+        else if( arg == "--steps" && hasValue ) steps = (unsigned int)strtoul( argv[++a], 0, 10 );
+        else if( arg == "--rebalance-every" && hasValue ) rebalanceInterval = (unsigned int)strtoul( argv[++a], 0, 10 );
+        else if( arg == "--timestep" && hasValue && ( argv[a + 1] == std::string( "fixed" ) || argv[a + 1] == std::string( "adaptive" ) ) )
+        {
+            adaptiveTimeStep = argv[++a] == std::string( "adaptive" );
+        }
+        else if( arg == "--validate" ) validate = true;
+        else
+        {
+            if( rank == 0 )
+            {
+                usage( argv[0] );
+            }
+            MPI_Finalize();
+            return arg == "--help" || arg == "-h" ? 0 : 1;
+        }
+    }
+
+    srand( 1 );
+    init( count );
+    startDistributed( MPI_COMM_WORLD );
+
+    // Per step, the slowest rank sets the pace
+    std::vector<double> stepUs( steps );
+    MPI_Barrier( MPI_COMM_WORLD );
+    const high_resolution_clock::time_point beg = high_resolution_clock::now();
+    for( unsigned int s = 0; s < steps; ++s )
+    {
+        const high_resolution_clock::time_point start = high_resolution_clock::now();
+        step();
+        stepUs[s] = duration<double, std::micro>( high_resolution_clock::now() - start ).count();
+    }
+    MPI_Barrier( MPI_COMM_WORLD );
+    const double elapsedMs = duration<double, std::milli>( high_resolution_clock::now() - beg ).count();
+    MPI_Allreduce( MPI_IN_PLACE, stepUs.data(), (int)steps, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD );
+
+    const DistributedStats& stats = distributedStats();
+    const unsigned long long total = distributedParticleCount();
+    double owned[2] = { -(double)( particles.N - ghostCount ), (double)( particles.N - ghostCount ) }; // -min, max
+    MPI_Allreduce( MPI_IN_PLACE, owned, 2, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD );
+    double exchange[2] = { stats.exchangeUs, stats.exchangeUs };
+    MPI_Allreduce( MPI_IN_PLACE, &exchange[0], 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD );
+    MPI_Allreduce( MPI_IN_PLACE, &exchange[1], 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD );
+    unsigned long long moved[2] = { stats.migrated, stats.ghosts };
+    MPI_Allreduce( MPI_IN_PLACE, moved, 2, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPI_COMM_WORLD );
+
+    if( rank == 0 )
+    {
+        std::sort( stepUs.begin(), stepUs.end() );
+        double sum = 0;
+        for( const double us : stepUs ) sum += us;
+        std::cout << "--------------------------------" << std::endl;
+        std::cout << "Ranks: " << ranks << " x " << omp_get_max_threads() << " threads" << std::endl;
+        std::cout << "Number of particles: " << count << std::endl;
+        std::printf( "Steps: %u in %.0f ms, %.2f us per step (p50 %.2f, p99 %.2f)\n",
+            steps, elapsedMs, sum / steps, stepUs[steps / 2], stepUs[std::min( steps - 1, steps * 99 / 100 )] );
+        std::printf( "Simulated time: %.1f steps of 1/60 s\n", timeStepState().time );
+        std::printf( "Exchange: %.2f us per step (mean over ranks), %.2f us (slowest rank)\n",
+            exchange[0] / ranks / steps, exchange[1] / steps );
+        std::printf( "Particles per rank: %.0f - %.0f, %u rebalances, %.1f migrated and %.1f ghosts per step\n",
+            -owned[0], owned[1], stats.rebalances, (double)moved[0] / steps, (double)moved[1] / steps );
+        if( total != count )
+        {
+            std::printf( "Lost particles: %llu of %u\n", (unsigned long long)count - total, count );
+        }
+    }
+
+    int failed = total != count;
+    if( validate )
+    {
+        std::vector<vecD> distributed;
+        gatherPositions( distributed, 0 );
+        stopDistributed();
+        if( rank == 0 )
+        {
+            // (the distributed run rebuilds the spatial index every step,
+            // which orders the cells like a full rebuild does)
+            shutdown();
+            incrementalIndex = false;
+            srand( 1 );
+            init( count );
+            for( unsigned int s = 0; s < steps; ++s )
+            {
+                step();
+            }
+
+            // The neighbor lists are summed in another order,
+            // so the runs drift apart by rounding over time
+            double maxError = 0, sumError = 0;
+            for( unsigned int id = 0; id < count; ++id )
+            {
+                const float e = glm::length( particles.pos( particles.storage_index[id] ) - distributed[id] );
+                maxError = std::max( maxError, (double)e );
+                sumError += e;
+            }
+            std::printf( "Validation against one process: max %g, mean %g position difference\n", maxError, sumError / count );
+        }
+    }
+
+    shutdown();
+    MPI_Finalize();
+    return failed;
+}
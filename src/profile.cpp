@@ -0,0 +1,295 @@
+// Real-Time Physics Tutorials
+// Brandon Pelfrey
+// SPH Fluid Simulation
+
+#include <profile.h>
+
+#include <omp.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+
+using namespace std::chrono;
+
+// --------------------------------------------------------------------
+// Busy time of one thread in one phase.
+// A phase may open several parallel regions (e.g. when the neighbor pool is regrown),
+// so the busy time is accumulated and the interval spans all of them.
+struct ThreadSpan
+{
+    double begin, end, busy;
+};
+
+static StepProfile steps_[PROFILE_CAPACITY];
+static unsigned int head_ = 0;  // entry of the current or latest step
+static unsigned int count_ = 0;
+static bool recording_ = false;
+
+// [entry][phase][thread]
+static ThreadSpan* threadSpans_ = 0;
+static int threadCapacity_ = 0;
+
+static const steady_clock::time_point epoch_ = steady_clock::now();
+
+static const char* phaseNames_[PHASE_COUNT] = {
+    "REORDER",
+    "UPDATE",
+    "SPATIAL INDEX",
+    "DENSITY",
+    "PRESSURE",
+    "PRESSURE FORCE",
+    "VISCOSITY",
+    "FUSED FORCES",
+    "CONSTRAINTS",
+    "DIVERGENCE"
+};
+
+// --------------------------------------------------------------------
+static inline double now()
+{
+    return duration<double, std::micro>( steady_clock::now() - epoch_ ).count();
+}
+
+// --------------------------------------------------------------------
+static inline ThreadSpan* spansOf( const unsigned int entry, const int phase )
+{
+    return threadSpans_ + ( (size_t)entry * PHASE_COUNT + phase ) * threadCapacity_;
+}
+
+// --------------------------------------------------------------------
+static void clearSpans( const unsigned int entry )
+{
+    ThreadSpan* s = spansOf( entry, 0 );
+    for( int i = 0; i < PHASE_COUNT * threadCapacity_; ++i )
+    {
+        s[i].begin = s[i].end = -1;
+        s[i].busy = 0;
+    }
+}
+
+// --------------------------------------------------------------------
+// Called outside of parallel regions only
+static void reserveThreads( const int threads )
+{
+    if( threads <= threadCapacity_ )
+    {
+        return;
+    }
+    threadCapacity_ = threads;
+    threadSpans_ = (ThreadSpan*)realloc( threadSpans_, (size_t)PROFILE_CAPACITY * PHASE_COUNT * threadCapacity_ * sizeof( ThreadSpan ) );
+    for( unsigned int e = 0; e < PROFILE_CAPACITY; ++e )
+    {
+        clearSpans( e );
+    }
+}
+
+// --------------------------------------------------------------------
+const char* profilePhaseName( const int phase )
+{
+    return phase >= 0 && phase < PHASE_COUNT ? phaseNames_[phase] : "?";
+}
+
+// --------------------------------------------------------------------
+unsigned int profileStepCount()
+{
+    return count_;
+}
+
+// --------------------------------------------------------------------
+const StepProfile* profileStep( const unsigned int age )
+{
+    if( age >= count_ )
+    {
+        return 0;
+    }
+    return &steps_[( head_ + PROFILE_CAPACITY - age ) % PROFILE_CAPACITY];
+}
+
+// --------------------------------------------------------------------
+bool profileThreadSpan( const unsigned int age, const int phase, const int t, double* begin, double* end )
+{
+    if( age >= count_ || phase < 0 || phase >= PHASE_COUNT || t < 0 || t >= threadCapacity_ )
+    {
+        return false;
+    }
+    const ThreadSpan& s = spansOf( ( head_ + PROFILE_CAPACITY - age ) % PROFILE_CAPACITY, phase )[t];
+    if( s.begin < 0 )
+    {
+        return false;
+    }
+    *begin = s.begin;
+    *end = s.end;
+    return true;
+}
+
+// --------------------------------------------------------------------
+void profileReset()
+{
+    head_ = 0;
+    count_ = 0;
+}
+
+// --------------------------------------------------------------------
+bool writeChromeTrace( const char* path )
+{
+    std::ofstream f( path );
+    if( !f )
+    {
+        return false;
+    }
+    f << std::fixed << std::setprecision( 3 );
+    f << "{\"traceEvents\":[\n";
+    f << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"step\"}}";
+    for( int t = 0; t < threadCapacity_; ++t )
+    {
+        f << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << t + 1
+          << ",\"args\":{\"name\":\"omp " << t << "\"}}";
+    }
+
+    // Oldest step first
+    for( unsigned int age = count_; age-- > 0; )
+    {
+        const StepProfile& s = *profileStep( age );
+        f << ",\n{\"name\":\"STEP\",\"ph\":\"X\",\"pid\":1,\"tid\":0,\"ts\":" << s.begin
+          << ",\"dur\":" << s.end - s.begin << ",\"args\":{\"step\":" << s.step;
+        if( s.solver.iterations || s.solver.divergenceIterations )
+        {
+            f << ",\"iterations\":" << s.solver.iterations << ",\"density_error\":" << s.solver.densityError
+              << ",\"divergence_iterations\":" << s.solver.divergenceIterations
+              << ",\"divergence_error\":" << s.solver.divergenceError;
+        }
+        f << "}}";
+        for( int p = 0; p < PHASE_COUNT; ++p )
+        {
+            const PhaseProfile& ph = s.phases[p];
+            if( ph.end <= ph.begin )
+            {
+                continue;
+            }
+            f << ",\n{\"name\":\"" << phaseNames_[p] << "\",\"ph\":\"X\",\"pid\":1,\"tid\":0,\"ts\":" << ph.begin
+              << ",\"dur\":" << ph.end - ph.begin;
+            if( ph.threads )
+            {
+                f << ",\"args\":{\"threads\":" << ph.threads << ",\"thread_min_us\":" << ph.thread_min
+                  << ",\"thread_max_us\":" << ph.thread_max << "}";
+            }
+            f << "}";
+            for( int t = 0; t < threadCapacity_; ++t )
+            {
+                double b, e;
+                if( profileThreadSpan( age, p, t, &b, &e ) )
+                {
+                    f << ",\n{\"name\":\"" << phaseNames_[p] << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << t + 1
+                      << ",\"ts\":" << b << ",\"dur\":" << e - b << "}";
+                }
+            }
+        }
+    }
+    f << "\n]}\n";
+    return (bool)f;
+}
+
+#if SPH_PROFILING
+
+// --------------------------------------------------------------------
+ProfileStepScope::ProfileStepScope( const unsigned int step )
+{
+    reserveThreads( omp_get_max_threads() );
+
+    head_ = count_ ? ( head_ + 1 ) % PROFILE_CAPACITY : 0;
+    if( count_ < PROFILE_CAPACITY )
+    {
+        count_++;
+    }
+    clearSpans( head_ );
+
+    StepProfile& s = steps_[head_];
+    s.step = step;
+    s.begin = s.end = now();
+    for( int p = 0; p < PHASE_COUNT; ++p )
+    {
+        PhaseProfile& ph = s.phases[p];
+        ph.begin = ph.end = s.begin;
+        ph.thread_min = ph.thread_max = 0;
+        ph.threads = 0;
+    }
+    s.solver = SolverProfile();
+    recording_ = true;
+}
+
+// --------------------------------------------------------------------
+ProfileStepScope::~ProfileStepScope()
+{
+    steps_[head_].end = now();
+    recording_ = false;
+}
+
+// --------------------------------------------------------------------
+ProfilePhaseScope::ProfilePhaseScope( const int phase ) : mPhase( phase )
+{
+    if( recording_ )
+    {
+        steps_[head_].phases[mPhase].begin = now();
+    }
+}
+
+// --------------------------------------------------------------------
+ProfilePhaseScope::~ProfilePhaseScope()
+{
+    if( !recording_ )
+    {
+        return;
+    }
+    PhaseProfile& ph = steps_[head_].phases[mPhase];
+    ph.end = now();
+
+    // Imbalance of the parallel regions that ran inside this phase
+    const ThreadSpan* spans = spansOf( head_, mPhase );
+    ph.threads = 0;
+    for( int t = 0; t < threadCapacity_; ++t )
+    {
+        if( spans[t].begin < 0 )
+        {
+            continue;
+        }
+        if( !ph.threads || spans[t].busy < ph.thread_min ) ph.thread_min = spans[t].busy;
+        if( !ph.threads || spans[t].busy > ph.thread_max ) ph.thread_max = spans[t].busy;
+        ph.threads++;
+    }
+}
+
+// --------------------------------------------------------------------
+ProfileThreadScope::ProfileThreadScope( const int phase ) : mPhase( phase ), mBegin( now() )
+{
+}
+
+// --------------------------------------------------------------------
+ProfileThreadScope::~ProfileThreadScope()
+{
+    const int t = omp_get_thread_num();
+    if( !recording_ || t >= threadCapacity_ )
+    {
+        return;
+    }
+    const double end = now();
+    ThreadSpan& s = spansOf( head_, mPhase )[t];
+    if( s.begin < 0 )
+    {
+        s.begin = mBegin;
+    }
+    s.end = end;
+    s.busy += end - mBegin;
+}
+
+// --------------------------------------------------------------------
+void profileSolver( const SolverProfile& solver )
+{
+    if( recording_ )
+    {
+        steps_[head_].solver = solver;
+    }
+}
+
+#endif
@@ -0,0 +1,394 @@
+// Real-Time Physics Tutorials
+// Brandon Pelfrey
+// SPH Fluid Simulation
+
+#include <simd.h>
+#include <sph.h>
+
+#include <cmath>
+
+#if defined( __x86_64__ ) || defined( _M_X64 ) || defined( __i386__ ) || defined( _M_IX86 )
+#define SIMD_HAS_AVX2 1
+#include <immintrin.h>
+#if defined( _MSC_VER ) && !defined( __clang__ )
+#include <intrin.h>
+// MSVC emits AVX instructions for intrinsics without a per-function target
+#define SIMD_TARGET_AVX2
+#else
+#define SIMD_TARGET_AVX2 __attribute__(( target( "avx2" ) ))
+#endif
+#endif
+
+#if defined( __aarch64__ ) || defined( _M_ARM64 )
+// NEON is part of every AArch64 CPU, so it needs no runtime check
+#define SIMD_HAS_NEON 1
+#include <arm_neon.h>
+#endif
+
+// --------------------------------------------------------------------
+// Scalar versions, only used if a kernel is called with SIMD_SCALAR selected
+
+static void densityScalar( const float px, const float py, const float* x, const float* y, const unsigned int n,
+                           const float h, float* q, float* dx, float* dy, float* d, float* dn )
+{
+    for( unsigned int j = 0; j < n; ++j )
+    {
+        const float rx = x[j] - px;
+        const float ry = y[j] - py;
+        const float r2 = rx * rx + ry * ry;
+        if( r2 < h * h )
+        {
+            const float l = std::sqrt( r2 );
+            const float qj = 1 - ( l / h );
+            const float q2 = qj * qj;
+            *d += q2;
+            *dn += q2 * qj;
+            q[j] = qj;
+            dx[j] = rx * ( 1 / l );
+            dy[j] = ry * ( 1 / l );
+        }
+        else
+        {
+            q[j] = -1;
+        }
+    }
+}
+
+static void pressureForceScalar( const float press_i, const float press_near_i,
+                                 const float* dx, const float* dy, const float* q, const float* q2,
+                                 const float* press, const float* press_near, const unsigned int n,
+                                 float* fx, float* fy )
+{
+    for( unsigned int j = 0; j < n; ++j )
+    {
+        const float dm = q[j] * ( press_i + press[j] ) + q2[j] * ( press_near_i + press_near[j] );
+        *fx += dx[j] * dm;
+        *fy += dy[j] * dm;
+    }
+}
+
+#if SIMD_HAS_AVX2
+
+// --------------------------------------------------------------------
+// Loading 8 ints from tailMask_ + 8 - m gives a mask of the first m lanes
+static const int tailMask_[16] = { -1, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+SIMD_TARGET_AVX2 static inline float hsum( const __m256 v )
+{
+    __m128 s = _mm_add_ps( _mm256_castps256_ps128( v ), _mm256_extractf128_ps( v, 1 ) );
+    s = _mm_add_ps( s, _mm_movehl_ps( s, s ) );
+    s = _mm_add_ss( s, _mm_shuffle_ps( s, s, 1 ) );
+    return _mm_cvtss_f32( s );
+}
+
+// --------------------------------------------------------------------
+SIMD_TARGET_AVX2 static void densityAVX2( const float px, const float py, const float* x, const float* y, const unsigned int n,
+                                          const float h, float* q, float* dx, float* dy, float* d, float* dn )
+{
+    const __m256 vpx = _mm256_set1_ps( px );
+    const __m256 vpy = _mm256_set1_ps( py );
+    const __m256 vh = _mm256_set1_ps( h );
+    const __m256 vhh = _mm256_set1_ps( h * h );
+    const __m256 one = _mm256_set1_ps( 1.0f );
+    const __m256 outside = _mm256_set1_ps( -1.0f );
+    __m256 vd = _mm256_setzero_ps();
+    __m256 vdn = _mm256_setzero_ps();
+
+    unsigned int j = 0;
+    for( ; j + 8 <= n; j += 8 )
+    {
+        const __m256 rx = _mm256_sub_ps( _mm256_loadu_ps( x + j ), vpx );
+        const __m256 ry = _mm256_sub_ps( _mm256_loadu_ps( y + j ), vpy );
+        const __m256 r2 = _mm256_add_ps( _mm256_mul_ps( rx, rx ), _mm256_mul_ps( ry, ry ) );
+        const __m256 inside = _mm256_cmp_ps( r2, vhh, _CMP_LT_OQ );
+        const __m256 l = _mm256_sqrt_ps( r2 );
+        const __m256 qj = _mm256_sub_ps( one, _mm256_div_ps( l, vh ) );
+        const __m256 q2 = _mm256_mul_ps( qj, qj );
+        const __m256 inv = _mm256_div_ps( one, l );
+        vd = _mm256_add_ps( vd, _mm256_and_ps( q2, inside ) );
+        vdn = _mm256_add_ps( vdn, _mm256_and_ps( _mm256_mul_ps( q2, qj ), inside ) );
+        _mm256_storeu_ps( q + j, _mm256_blendv_ps( outside, qj, inside ) );
+        _mm256_storeu_ps( dx + j, _mm256_mul_ps( rx, inv ) );
+        _mm256_storeu_ps( dy + j, _mm256_mul_ps( ry, inv ) );
+    }
+    if( j < n )
+    {
+        const __m256i mask = _mm256_loadu_si256( (const __m256i*)( tailMask_ + 8 - ( n - j ) ) );
+        const __m256 rx = _mm256_sub_ps( _mm256_maskload_ps( x + j, mask ), vpx );
+        const __m256 ry = _mm256_sub_ps( _mm256_maskload_ps( y + j, mask ), vpy );
+        const __m256 r2 = _mm256_add_ps( _mm256_mul_ps( rx, rx ), _mm256_mul_ps( ry, ry ) );
+        const __m256 inside = _mm256_and_ps( _mm256_cmp_ps( r2, vhh, _CMP_LT_OQ ), _mm256_castsi256_ps( mask ) );
+        const __m256 l = _mm256_sqrt_ps( r2 );
+        const __m256 qj = _mm256_sub_ps( one, _mm256_div_ps( l, vh ) );
+        const __m256 q2 = _mm256_mul_ps( qj, qj );
+        const __m256 inv = _mm256_div_ps( one, l );
+        vd = _mm256_add_ps( vd, _mm256_and_ps( q2, inside ) );
+        vdn = _mm256_add_ps( vdn, _mm256_and_ps( _mm256_mul_ps( q2, qj ), inside ) );
+        _mm256_maskstore_ps( q + j, mask, _mm256_blendv_ps( outside, qj, inside ) );
+        _mm256_maskstore_ps( dx + j, mask, _mm256_mul_ps( rx, inv ) );
+        _mm256_maskstore_ps( dy + j, mask, _mm256_mul_ps( ry, inv ) );
+    }
+
+    *d += hsum( vd );
+    *dn += hsum( vdn );
+}
+
+// --------------------------------------------------------------------
+SIMD_TARGET_AVX2 static void pressureForceAVX2( const float press_i, const float press_near_i,
+                                                const float* dx, const float* dy, const float* q, const float* q2,
+                                                const float* press, const float* press_near, const unsigned int n,
+                                                float* fx, float* fy )
+{
+    const __m256 vp = _mm256_set1_ps( press_i );
+    const __m256 vpn = _mm256_set1_ps( press_near_i );
+    __m256 sx = _mm256_setzero_ps();
+    __m256 sy = _mm256_setzero_ps();
+
+    unsigned int j = 0;
+    for( ; j + 8 <= n; j += 8 )
+    {
+        const __m256 dm = _mm256_add_ps(
+            _mm256_mul_ps( _mm256_loadu_ps( q + j ), _mm256_add_ps( vp, _mm256_loadu_ps( press + j ) ) ),
+            _mm256_mul_ps( _mm256_loadu_ps( q2 + j ), _mm256_add_ps( vpn, _mm256_loadu_ps( press_near + j ) ) ) );
+        sx = _mm256_add_ps( sx, _mm256_mul_ps( _mm256_loadu_ps( dx + j ), dm ) );
+        sy = _mm256_add_ps( sy, _mm256_mul_ps( _mm256_loadu_ps( dy + j ), dm ) );
+    }
+    if( j < n )
+    {
+        // Masked lanes load zero directions, so they add nothing
+        const __m256i mask = _mm256_loadu_si256( (const __m256i*)( tailMask_ + 8 - ( n - j ) ) );
+        const __m256 dm = _mm256_add_ps(
+            _mm256_mul_ps( _mm256_maskload_ps( q + j, mask ), _mm256_add_ps( vp, _mm256_maskload_ps( press + j, mask ) ) ),
+            _mm256_mul_ps( _mm256_maskload_ps( q2 + j, mask ), _mm256_add_ps( vpn, _mm256_maskload_ps( press_near + j, mask ) ) ) );
+        sx = _mm256_add_ps( sx, _mm256_mul_ps( _mm256_maskload_ps( dx + j, mask ), dm ) );
+        sy = _mm256_add_ps( sy, _mm256_mul_ps( _mm256_maskload_ps( dy + j, mask ), dm ) );
+    }
+
+    *fx += hsum( sx );
+    *fy += hsum( sy );
+}
+
+// --------------------------------------------------------------------
+static bool cpuHasAVX2()
+{
+#if defined( _MSC_VER ) && !defined( __clang__ )
+    int info[4];
+    __cpuid( info, 0 );
+    if( info[0] < 7 )
+    {
+        return false;
+    }
+    __cpuid( info, 1 );
+    const bool osxsave = ( info[2] & ( 1 << 27 ) ) != 0;
+    if( !osxsave || ( _xgetbv( 0 ) & 6 ) != 6 )
+    {
+        return false;
+    }
+    __cpuidex( info, 7, 0 );
+    return ( info[1] & ( 1 << 5 ) ) != 0;
+#else
+    return __builtin_cpu_supports( "avx2" ) != 0;
+#endif
+}
+
+#endif // SIMD_HAS_AVX2
+
+#if SIMD_HAS_NEON
+
+// --------------------------------------------------------------------
+// NEON has no masked loads, the tail is copied into a zero padded block instead
+static inline float32x4_t loadTail( const float* p, const unsigned int m )
+{
+    float block[4] = { 0, 0, 0, 0 };
+    for( unsigned int k = 0; k < m; ++k )
+    {
+        block[k] = p[k];
+    }
+    return vld1q_f32( block );
+}
+
+static inline uint32x4_t tailMask( const unsigned int m )
+{
+    static const unsigned int lanes[4] = { 0, 1, 2, 3 };
+    return vcltq_u32( vld1q_u32( lanes ), vdupq_n_u32( m ) );
+}
+
+static inline float32x4_t maskf( const float32x4_t v, const uint32x4_t m )
+{
+    return vreinterpretq_f32_u32( vandq_u32( vreinterpretq_u32_f32( v ), m ) );
+}
+
+// --------------------------------------------------------------------
+static void densityNEON( const float px, const float py, const float* x, const float* y, const unsigned int n,
+                         const float h, float* q, float* dx, float* dy, float* d, float* dn )
+{
+    const float32x4_t vpx = vdupq_n_f32( px );
+    const float32x4_t vpy = vdupq_n_f32( py );
+    const float32x4_t vh = vdupq_n_f32( h );
+    const float32x4_t vhh = vdupq_n_f32( h * h );
+    const float32x4_t one = vdupq_n_f32( 1.0f );
+    const float32x4_t outside = vdupq_n_f32( -1.0f );
+    float32x4_t vd = vdupq_n_f32( 0.0f );
+    float32x4_t vdn = vdupq_n_f32( 0.0f );
+
+    for( unsigned int j = 0; j < n; j += 4 )
+    {
+        const unsigned int m = n - j < 4 ? n - j : 4;
+        const float32x4_t rx = vsubq_f32( m == 4 ? vld1q_f32( x + j ) : loadTail( x + j, m ), vpx );
+        const float32x4_t ry = vsubq_f32( m == 4 ? vld1q_f32( y + j ) : loadTail( y + j, m ), vpy );
+        const float32x4_t r2 = vaddq_f32( vmulq_f32( rx, rx ), vmulq_f32( ry, ry ) );
+        const uint32x4_t inside = vandq_u32( vcltq_f32( r2, vhh ), tailMask( m ) );
+        const float32x4_t l = vsqrtq_f32( r2 );
+        const float32x4_t qj = vsubq_f32( one, vdivq_f32( l, vh ) );
+        const float32x4_t q2 = vmulq_f32( qj, qj );
+        const float32x4_t inv = vdivq_f32( one, l );
+        vd = vaddq_f32( vd, maskf( q2, inside ) );
+        vdn = vaddq_f32( vdn, maskf( vmulq_f32( q2, qj ), inside ) );
+
+        float block[3][4];
+        vst1q_f32( block[0], vbslq_f32( inside, qj, outside ) );
+        vst1q_f32( block[1], vmulq_f32( rx, inv ) );
+        vst1q_f32( block[2], vmulq_f32( ry, inv ) );
+        for( unsigned int k = 0; k < m; ++k )
+        {
+            q[j + k] = block[0][k];
+            dx[j + k] = block[1][k];
+            dy[j + k] = block[2][k];
+        }
+    }
+
+    *d += vaddvq_f32( vd );
+    *dn += vaddvq_f32( vdn );
+}
+
+// --------------------------------------------------------------------
+static void pressureForceNEON( const float press_i, const float press_near_i,
+                               const float* dx, const float* dy, const float* q, const float* q2,
+                               const float* press, const float* press_near, const unsigned int n,
+                               float* fx, float* fy )
+{
+    const float32x4_t vp = vdupq_n_f32( press_i );
+    const float32x4_t vpn = vdupq_n_f32( press_near_i );
+    float32x4_t sx = vdupq_n_f32( 0.0f );
+    float32x4_t sy = vdupq_n_f32( 0.0f );
+
+    // (the zero padded tail adds nothing)
+    for( unsigned int j = 0; j < n; j += 4 )
+    {
+        const unsigned int m = n - j < 4 ? n - j : 4;
+        const bool full = m == 4;
+        const float32x4_t dxj = full ? vld1q_f32( dx + j ) : loadTail( dx + j, m );
+        const float32x4_t dyj = full ? vld1q_f32( dy + j ) : loadTail( dy + j, m );
+        const float32x4_t qj = full ? vld1q_f32( q + j ) : loadTail( q + j, m );
+        const float32x4_t q2j = full ? vld1q_f32( q2 + j ) : loadTail( q2 + j, m );
+        const float32x4_t pj = full ? vld1q_f32( press + j ) : loadTail( press + j, m );
+        const float32x4_t pnj = full ? vld1q_f32( press_near + j ) : loadTail( press_near + j, m );
+        const float32x4_t dm = vaddq_f32( vmulq_f32( qj, vaddq_f32( vp, pj ) ), vmulq_f32( q2j, vaddq_f32( vpn, pnj ) ) );
+        sx = vaddq_f32( sx, vmulq_f32( dxj, dm ) );
+        sy = vaddq_f32( sy, vmulq_f32( dyj, dm ) );
+    }
+
+    *fx += vaddvq_f32( sx );
+    *fy += vaddvq_f32( sy );
+}
+
+#endif // SIMD_HAS_NEON
+
+// --------------------------------------------------------------------
+// Dispatch
+
+typedef void ( *DensityFn )( const float, const float, const float*, const float*, const unsigned int,
+                             const float, float*, float*, float*, float*, float* );
+typedef void ( *PressureForceFn )( const float, const float,
+                                   const float*, const float*, const float*, const float*,
+                                   const float*, const float*, const unsigned int, float*, float* );
+
+static int isa_ = SIMD_SCALAR;
+static DensityFn density_ = densityScalar;
+static PressureForceFn pressureForce_ = pressureForceScalar;
+
+// --------------------------------------------------------------------
+int simdBestISA()
+{
+#if SPH_DIMENSION == 3
+    // (the kernels take x and y only)
+    return SIMD_SCALAR;
+#endif
+#if SIMD_HAS_AVX2
+    static const bool avx2 = cpuHasAVX2();
+    if( avx2 )
+    {
+        return SIMD_AVX2;
+    }
+#endif
+#if SIMD_HAS_NEON
+    return SIMD_NEON;
+#endif
+    return SIMD_SCALAR;
+}
+
+// --------------------------------------------------------------------
+int simdISA()
+{
+    return isa_;
+}
+
+// --------------------------------------------------------------------
+bool setSimdISA( const int isa )
+{
+    switch( isa )
+    {
+    case SIMD_SCALAR:
+        density_ = densityScalar;
+        pressureForce_ = pressureForceScalar;
+        break;
+#if SIMD_HAS_AVX2 && SPH_DIMENSION == 2
+    case SIMD_AVX2:
+        if( simdBestISA() != SIMD_AVX2 )
+        {
+            return false;
+        }
+        density_ = densityAVX2;
+        pressureForce_ = pressureForceAVX2;
+        break;
+#endif
+#if SIMD_HAS_NEON && SPH_DIMENSION == 2
+    case SIMD_NEON:
+        density_ = densityNEON;
+        pressureForce_ = pressureForceNEON;
+        break;
+#endif
+    default:
+        return false;
+    }
+    isa_ = isa;
+    return true;
+}
+
+// --------------------------------------------------------------------
+const char* simdISAName( const int isa )
+{
+    switch( isa )
+    {
+    case SIMD_SCALAR: return "scalar";
+    case SIMD_AVX2: return "avx2";
+    case SIMD_NEON: return "neon";
+    }
+    return "?";
+}
+
+// --------------------------------------------------------------------
+void simdDensity( const float px, const float py, const float* x, const float* y, const unsigned int n,
+                  const float h, float* q, float* dx, float* dy, float* d, float* dn )
+{
+    density_( px, py, x, y, n, h, q, dx, dy, d, dn );
+}
+
+// --------------------------------------------------------------------
+void simdPressureForce( const float press_i, const float press_near_i,
+                        const float* dx, const float* dy, const float* q, const float* q2,
+                        const float* press, const float* press_near, const unsigned int n,
+                        float* fx, float* fy )
+{
+    pressureForce_( press_i, press_near_i, dx, dy, q, q2, press, press_near, n, fx, fy );
+}
@@ -0,0 +1,226 @@
+// Real-Time Physics Tutorials
+// Brandon Pelfrey
+// SPH Fluid Simulation
+
+#include <simulation-thread.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono;
+
+// --------------------------------------------------------------------
+// Buffer indices 0..2, the middle one carries this bit while it holds a frame
+// the frontend has not picked up yet
+static const unsigned int FRESH = 4;
+
+struct FrameBuffer
+{
+    SimulationFrame frame;
+    std::vector<Particles::Position> vertices;
+};
+
+static FrameBuffer buffers_[3];
+static unsigned int back_ = 0;                      // simulation thread only
+static std::atomic<unsigned int> middle_( 1 );
+static unsigned int front_ = 2;                     // frontend only
+static bool published_ = false;                     // frontend only, front_ holds a frame
+
+static std::thread thread_;
+static std::atomic<bool> running_( false );
+static std::atomic<unsigned int> stepsPerFrame_( 1 );
+
+// Wakes the simulation thread when it waits for the frontend to pick up a frame
+static std::mutex wakeMutex_;
+static std::condition_variable wake_;
+
+static std::mutex commandMutex_;
+static std::vector< std::function<void()> > commands_;
+
+// --------------------------------------------------------------------
+static void runCommands()
+{
+    std::vector< std::function<void()> > commands;
+    {
+        std::lock_guard<std::mutex> lock( commandMutex_ );
+        commands.swap( commands_ );
+    }
+    for( size_t i = 0; i < commands.size(); ++i )
+    {
+        commands[i]();
+    }
+}
+
+// --------------------------------------------------------------------
+static void publish( const unsigned int steps, const double stepMs, const double stepsPerSecond )
+{
+    FrameBuffer& b = buffers_[back_];
+    const Particles::Position* vertices = particles.vertices();
+    b.vertices.resize( particles.N );
+    if( particles.N )
+    {
+        memcpy( &b.vertices[0], vertices, particles.N * sizeof( Particles::Position ) );
+    }
+
+    SimulationFrame& f = b.frame;
+    f.vertices = particles.N ? &b.vertices[0] : 0;
+    f.N = particles.N;
+    f.steps = steps;
+    f.stepMs = stepMs;
+    f.stepsPerSecond = stepsPerSecond;
+    const TimeStepState time = timeStepState();
+    f.time = time.time;
+    f.timeStep = time.lastStep;
+    f.solver = solver();
+    f.kernel = kernel();
+    const StepProfile* prof = profileStep( 0 );
+    f.profiled = prof != 0;
+    if( prof )
+    {
+        f.profile = *prof;
+    }
+
+    back_ = middle_.exchange( back_ | FRESH ) & ~FRESH;
+}
+
+// --------------------------------------------------------------------
+static void simulate()
+{
+    unsigned int steps = 0;
+    unsigned int batchSteps = 0;
+    double batchMs = 0;
+
+    // Throughput over windows of one second
+    high_resolution_clock::time_point windowStart = high_resolution_clock::now();
+    unsigned int windowSteps = 0;
+    double stepsPerSecond = 0;
+
+    while( running_ )
+    {
+        runCommands();
+
+        // Adaptive steps vary in size, so a frame takes as many of them
+        // as fit into stepsPerFrame base steps of simulated time
+        const unsigned int stepsPerFrame = stepsPerFrame_;
+        const bool substeps = adaptiveTimeStep && stepsPerFrame;
+        const high_resolution_clock::time_point start = high_resolution_clock::now();
+        unsigned int taken = 1;
+        if( substeps )
+        {
+            taken = advance( (float)stepsPerFrame );
+        }
+        else
+        {
+            step();
+        }
+        const high_resolution_clock::time_point end = high_resolution_clock::now();
+        steps += taken;
+        batchSteps += taken;
+        batchMs += duration<double, std::milli>( end - start ).count();
+
+        windowSteps += taken;
+        const double window = duration<double>( end - windowStart ).count();
+        if( window >= 1.0 )
+        {
+            stepsPerSecond = windowSteps / window;
+            windowStart = end;
+            windowSteps = 0;
+        }
+
+        if( !substeps && batchSteps < stepsPerFrame )
+        {
+            continue;
+        }
+        publish( steps, batchMs / glm::max( batchSteps, 1u ), stepsPerSecond );
+        batchSteps = 0;
+        batchMs = 0;
+
+        if( stepsPerFrame )
+        {
+            // Simulate at most one frame ahead of the frontend
+            std::unique_lock<std::mutex> lock( wakeMutex_ );
+            wake_.wait( lock, []()
+            {
+                return !running_ || !stepsPerFrame_ || !( middle_.load() & FRESH );
+            } );
+        }
+    }
+}
+
+// --------------------------------------------------------------------
+static void wakeSimulation()
+{
+    {
+        std::lock_guard<std::mutex> lock( wakeMutex_ );
+    }
+    wake_.notify_one();
+}
+
+// --------------------------------------------------------------------
+void startSimulationThread( const unsigned int stepsPerFrame )
+{
+    if( running_ )
+    {
+        return;
+    }
+    stepsPerFrame_ = stepsPerFrame;
+    back_ = 0;
+    middle_ = 1;
+    front_ = 2;
+    published_ = false;
+    running_ = true;
+    thread_ = std::thread( simulate );
+}
+
+// --------------------------------------------------------------------
+void stopSimulationThread()
+{
+    if( !running_ )
+    {
+        return;
+    }
+    running_ = false;
+    wakeSimulation();
+    thread_.join();
+
+    // Commands that did not get to run any more, the caller owns the particles now
+    runCommands();
+}
+
+// --------------------------------------------------------------------
+void setSimulationStepsPerFrame( const unsigned int stepsPerFrame )
+{
+    stepsPerFrame_ = stepsPerFrame;
+    wakeSimulation();
+}
+
+// --------------------------------------------------------------------
+unsigned int simulationStepsPerFrame()
+{
+    return stepsPerFrame_;
+}
+
+// --------------------------------------------------------------------
+void postSimulationCommand( const std::function<void()>& f )
+{
+    std::lock_guard<std::mutex> lock( commandMutex_ );
+    commands_.push_back( f );
+}
+
+// --------------------------------------------------------------------
+const SimulationFrame* latestSimulationFrame()
+{
+    if( middle_.load() & FRESH )
+    {
+        front_ = middle_.exchange( front_ );
+        front_ &= ~FRESH;
+        published_ = true;
+        wakeSimulation();
+    }
+    return published_ ? &buffers_[front_].frame : 0;
+}
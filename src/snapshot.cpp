@@ -0,0 +1,287 @@
+// Real-Time Physics Tutorials
+// Brandon Pelfrey
+// SPH Fluid Simulation
+
+#include <snapshot.h>
+#include <sph.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+static const char SNAPSHOT_MAGIC[8] = { 'S', 'P', 'H', 'S', 'N', 'A', 'P', 0 };
+
+// Particles gathered per write when saving
+static const unsigned int SNAPSHOT_CHUNK = 65536;
+
+// --------------------------------------------------------------------
+static size_t sectionElementBytes( const int section )
+{
+    switch( section )
+    {
+    case SNAPSHOT_POS:
+    case SNAPSHOT_POS_OLD:
+    case SNAPSHOT_VEL:
+    case SNAPSHOT_FORCE:
+        return sizeof( vecD );
+    case SNAPSHOT_STABLE_ID:
+        return sizeof( uint32_t );
+    case SNAPSHOT_MATERIAL:
+        return sizeof( uint8_t );
+    default:
+        return sizeof( float );
+    }
+}
+
+// --------------------------------------------------------------------
+static uint64_t alignUp( const uint64_t offset )
+{
+    return ( offset + SNAPSHOT_ALIGNMENT - 1 ) / SNAPSHOT_ALIGNMENT * SNAPSHOT_ALIGNMENT;
+}
+
+// --------------------------------------------------------------------
+// Copies one attribute of particles [begin, end) to dst
+static void gather( const int section, const unsigned int begin, const unsigned int end, unsigned char* dst )
+{
+    vecD* v = (vecD*)dst;
+    float* f = (float*)dst;
+    uint32_t* u = (uint32_t*)dst;
+    uint8_t* b = dst;
+    for( unsigned int i = begin; i < end; ++i )
+    {
+        switch( section )
+        {
+        case SNAPSHOT_POS: *v++ = particles.pos( i ); break;
+        case SNAPSHOT_POS_OLD: *v++ = particles.pos_old( i ); break;
+        case SNAPSHOT_VEL: *v++ = particles.vel( i ); break;
+        case SNAPSHOT_FORCE: *v++ = particles.force( i ); break;
+        case SNAPSHOT_MATERIAL: *b++ = particles.material( i ); break;
+        case SNAPSHOT_MARK: *f++ = particles.a( i ); break;
+        case SNAPSHOT_STABLE_ID: *u++ = particles.stable_id[i]; break;
+        }
+    }
+}
+
+// --------------------------------------------------------------------
+static bool writePadding( FILE* f, const uint64_t from, const uint64_t to )
+{
+    static const unsigned char zeros[SNAPSHOT_ALIGNMENT] = {};
+    return from == to || fwrite( zeros, 1, (size_t)( to - from ), f ) == to - from;
+}
+
+// --------------------------------------------------------------------
+bool saveSnapshot( const char* path )
+{
+    const unsigned int N = particles.N;
+
+    SnapshotHeader h;
+    memset( &h, 0, sizeof( h ) );
+    memcpy( h.magic, SNAPSHOT_MAGIC, sizeof( h.magic ) );
+    h.version = SNAPSHOT_VERSION;
+    h.alignment = SNAPSHOT_ALIGNMENT;
+    h.N = N;
+    h.steps = stepCount();
+    memcpy( h.materials, materials, sizeof( h.materials ) );
+    const TimeStepState state = timeStepState();
+    h.lastTimeStep = state.lastStep;
+    h.nextStep = state.nextStep;
+    h.time = state.time;
+    h.velocities = state.velocities;
+    h.sectionCount = SNAPSHOT_SECTION_COUNT;
+    uint64_t offset = alignUp( sizeof( SnapshotHeader ) );
+    for( int s = 0; s < SNAPSHOT_SECTION_COUNT; ++s )
+    {
+        h.sections[s].offset = offset;
+        h.sections[s].bytes = (uint64_t)N * sectionElementBytes( s );
+        offset = alignUp( offset + h.sections[s].bytes );
+    }
+
+    FILE* f = fopen( path, "wb" );
+    if( !f )
+    {
+        return false;
+    }
+    bool ok = fwrite( &h, sizeof( h ), 1, f ) == 1
+        && writePadding( f, sizeof( h ), h.sections[0].offset );
+
+    std::vector<unsigned char> chunk( SNAPSHOT_CHUNK * sizeof( vecD ) );
+    for( int s = 0; s < SNAPSHOT_SECTION_COUNT && ok; ++s )
+    {
+        const size_t elementBytes = sectionElementBytes( s );
+        for( unsigned int begin = 0; begin < N && ok; begin += SNAPSHOT_CHUNK )
+        {
+            const unsigned int end = begin + SNAPSHOT_CHUNK < N ? begin + SNAPSHOT_CHUNK : N;
+            gather( s, begin, end, &chunk[0] );
+            ok = fwrite( &chunk[0], elementBytes, end - begin, f ) == end - begin;
+        }
+        const uint64_t sectionEnd = h.sections[s].offset + h.sections[s].bytes;
+        ok = ok && writePadding( f, sectionEnd, alignUp( sectionEnd ) );
+    }
+
+    ok = fclose( f ) == 0 && ok;
+    if( !ok )
+    {
+        remove( path );
+    }
+    return ok;
+}
+
+// --------------------------------------------------------------------
+// Read-only mapping of a whole file
+struct MappedFile
+{
+    const unsigned char* data;
+    uint64_t bytes;
+#ifdef _WIN32
+    HANDLE file, mapping;
+#endif
+
+    MappedFile() : data( 0 ), bytes( 0 ) {}
+
+    bool Map( const char* path )
+    {
+#ifdef _WIN32
+        file = CreateFileA( path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0 );
+        if( file == INVALID_HANDLE_VALUE )
+        {
+            return false;
+        }
+        LARGE_INTEGER size;
+        mapping = GetFileSizeEx( file, &size ) && size.QuadPart > 0
+            ? CreateFileMappingA( file, 0, PAGE_READONLY, 0, 0, 0 ) : 0;
+        data = mapping ? (const unsigned char*)MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 ) : 0;
+        if( !data )
+        {
+            if( mapping ) CloseHandle( mapping );
+            CloseHandle( file );
+            return false;
+        }
+        bytes = (uint64_t)size.QuadPart;
+#else
+        const int fd = open( path, O_RDONLY );
+        if( fd < 0 )
+        {
+            return false;
+        }
+        struct stat st;
+        void* p = fstat( fd, &st ) == 0 && st.st_size > 0
+            ? mmap( 0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 ) : MAP_FAILED;
+        close( fd );
+        if( p == MAP_FAILED )
+        {
+            return false;
+        }
+        // Every page is read exactly once, front to back
+        madvise( p, (size_t)st.st_size, MADV_SEQUENTIAL );
+        data = (const unsigned char*)p;
+        bytes = (uint64_t)st.st_size;
+#endif
+        return true;
+    }
+
+    ~MappedFile()
+    {
+        if( !data )
+        {
+            return;
+        }
+#ifdef _WIN32
+        UnmapViewOfFile( data );
+        CloseHandle( mapping );
+        CloseHandle( file );
+#else
+        munmap( (void*)data, (size_t)bytes );
+#endif
+    }
+};
+
+// --------------------------------------------------------------------
+static bool validHeader( const SnapshotHeader& h, const uint64_t fileBytes )
+{
+    if( memcmp( h.magic, SNAPSHOT_MAGIC, sizeof( h.magic ) ) != 0 || h.version != SNAPSHOT_VERSION
+        || h.sectionCount != SNAPSHOT_SECTION_COUNT || h.alignment != SNAPSHOT_ALIGNMENT )
+    {
+        return false;
+    }
+    for( int s = 0; s < SNAPSHOT_SECTION_COUNT; ++s )
+    {
+        const SnapshotHeader::Section& sec = h.sections[s];
+        if( sec.offset % SNAPSHOT_ALIGNMENT || sec.bytes != (uint64_t)h.N * sectionElementBytes( s )
+            || sec.offset > fileBytes || sec.bytes > fileBytes - sec.offset )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// --------------------------------------------------------------------
+bool loadSnapshot( const char* path )
+{
+    MappedFile file;
+    if( !file.Map( path ) || file.bytes < sizeof( SnapshotHeader ) )
+    {
+        return false;
+    }
+    const SnapshotHeader& h = *(const SnapshotHeader*)file.data;
+    if( !validHeader( h, file.bytes ) )
+    {
+        return false;
+    }
+    const unsigned int N = h.N;
+
+    // Pointer fix-up, the sections are used in place
+    const vecD* pos = (const vecD*)( file.data + h.sections[SNAPSHOT_POS].offset );
+    const vecD* pos_old = (const vecD*)( file.data + h.sections[SNAPSHOT_POS_OLD].offset );
+    const vecD* vel = (const vecD*)( file.data + h.sections[SNAPSHOT_VEL].offset );
+    const vecD* force = (const vecD*)( file.data + h.sections[SNAPSHOT_FORCE].offset );
+    const uint8_t* material = (const uint8_t*)( file.data + h.sections[SNAPSHOT_MATERIAL].offset );
+    const float* mark = (const float*)( file.data + h.sections[SNAPSHOT_MARK].offset );
+    const uint32_t* stable = (const uint32_t*)( file.data + h.sections[SNAPSHOT_STABLE_ID].offset );
+
+    // Stable ids must be a permutation, storage_index is derived from them,
+    // and materials rows of the table
+    std::vector<bool> seen( N, false );
+    for( unsigned int i = 0; i < N; ++i )
+    {
+        if( stable[i] >= N || seen[stable[i]] || material[i] >= MATERIAL_TABLE_SIZE )
+        {
+            return false;
+        }
+        seen[stable[i]] = true;
+    }
+
+    allocate( N );
+#pragma omp parallel for
+    for( int i = 0; i < (int)N; ++i )
+    {
+        particles.set_pos( i, pos[i] );
+        particles.set_pos_old( i, pos_old[i] );
+        particles.set_vel( i, vel[i] );
+        particles.set_force( i, force[i] );
+        particles.material( i ) = material[i];
+        particles.a( i ) = mark[i];
+        particles.stable_id[i] = stable[i];
+        particles.storage_index[stable[i]] = i;
+    }
+
+    memcpy( materials, h.materials, sizeof( materials ) );
+    setStepCount( h.steps );
+    TimeStepState state;
+    state.lastStep = h.lastTimeStep;
+    state.nextStep = h.nextStep;
+    state.time = h.time;
+    state.velocities = h.velocities != 0;
+    setTimeStepState( state );
+    return true;
+}
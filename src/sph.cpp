@@ -0,0 +1,3598 @@
+// Real-Time Physics Tutorials
+// Brandon Pelfrey
+// SPH Fluid Simulation
+
+// Forked by Marius Kircher.
+// The devlog is at the top of main.cpp.
+
+#include <sph.h>
+#include <profile.h>
+#include <simd.h>
+#include <kernels.h>
+
+#include <glm/glm.hpp>
+#include <omp.h>
+
+#include <chrono>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <climits>
+#include <cstring>
+#include <type_traits>
+#include <unordered_map>
+
+// --------------------------------------------------------------------
+
+using namespace std::chrono;
+static duration<double, std::milli> stepTime_;
+static unsigned int stepCount_ = 0;
+
+unsigned int reorderInterval = 64;
+
+bool adaptiveTimeStep = false;
+float fixedTimeStep = 1.0f;
+float cflNumber = 0.1f;
+float minTimeStep = 0.05f;
+float maxTimeStep = 4.0f;
+float maxTimeStepGrowth = 1.1f;
+
+// Time stepping state, see setTimeStepState()
+static float timeStep_ = 1;         // proposed by the controller for the next step
+static float lastTimeStep_ = 1;     // taken by the last step, pos - pos_old spans it
+static double time_ = 0;
+// Shortens the steps of advance() to end on the requested time
+static float timeStepLimit_ = FLT_MAX;
+// Particles::pos_old holds velocities, follows adaptiveTimeStep and the solver at the start of every step
+static bool velocityState_ = false;
+
+unsigned int pbfIterations = 4;
+float pbfRelaxation = 1e-2f;
+float xsphViscosity = 0.02f;
+
+float dfsphDensityTolerance = 0.01f;
+float dfsphDivergenceTolerance = 0.01f;
+unsigned int dfsphMaxIterations = 100;
+bool dfsphWarmStart = true;
+
+static int solver_ = SOLVER_DOUBLE_DENSITY;
+static int kernel_ = KERNEL_LINEAR;
+// press() and press_near() hold the pressures of the last step of SOLVER_DFSPH
+static bool dfsphPressures_ = false;
+
+bool incrementalIndex = true;
+float incrementalIndexLimit = 0.25f;
+SpatialIndexStats indexStats;
+
+float verletSkin = 0.0f;
+bool fusePasses = true;
+bool tabulatedKernel = false;
+bool tileScheduling = true;
+VerletStats verletStats;
+
+bool boundedNeighbors = false;
+unsigned int neighborSlots = 0;
+float neighborSlotsPercentile = 0.99f;
+float neighborOverflowShare = 0.5f;
+NeighborStats neighborStats;
+
+unsigned int ghostCount = 0;
+void (*afterUpdateHook)() = 0;
+void (*afterDensityHook)() = 0;
+
+// Whether the DENSITY pass of this step reads the Verlet lists
+static bool verletActive_ = false;
+// Cell size the grid is currently built with
+static float gridCellSize_ = r;
+
+// Set whenever particle ids stop matching the spatial index
+// (new particles or reordered storage), forces a full rebuild
+static bool indexStale_ = true;
+
+// Scratch memory for the reorder pass, allocated on first use.
+// The scratch storage is swapped with the particles, so it has to
+// match the particle count and is freed in shutdown().
+static unsigned long long* reorderKeys_ = 0;
+static unsigned int* reorderNewIndex_ = 0;
+static Particles reorderScratch_;
+static unsigned int reorderCapacity_ = 0;
+
+// --------------------------------------------------------------------
+// Particles integrated by this process, the ghosts follow them
+static inline unsigned int ownedCount()
+{
+    return particles.N - ghostCount;
+}
+
+// --------------------------------------------------------------------
+// Between [0,1]
+float rand01()
+{
+    return (float)rand() * (1.f / RAND_MAX);
+}
+
+// --------------------------------------------------------------------
+// Between [a,b]
+float randab(float a, float b)
+{
+    return a + (b-a)*rand01();
+}
+
+// --------------------------------------------------------------------
+// Our collection of particles
+Particles particles;
+
+// --------------------------------------------------------------------
+// Compressed-sparse-row storage for the neighbor lists of all particles.
+// All Neighbor records live in one shared pool, each particle only stores
+// the offset of its first neighbor and the neighbor count.
+// Before every pass the pool is split into one segment per work unit (a tile,
+// a static chunk of a thread or a grid cell), sized from the neighbor counts
+// of its particles in the last pass, so units can append without synchronization
+// and the pool follows the counts down as well as up, whichever thread runs a unit.
+// A unit that runs past its segment moves the list it is writing to a chunk of
+// the spare area after the segments and continues there. Only if the spare area
+// runs out the pass has to be repeated, with a larger one.
+// Template arg is the record type, Neighbor for the neighbor lists.
+template< typename Record >
+class NeighborPool
+{
+    Record* mData;
+    size_t mCapacity;
+
+    size_t* mSegmentBegin; // per unit
+    size_t* mSegmentEnd;   // per unit, exclusive
+    unsigned int mSegments;
+    unsigned int mSegmentCapacity;
+
+    size_t mSpareEnd;
+    std::atomic<size_t> mSpareCursor;   // next free record of the spare area
+    std::atomic<size_t> mShortfall;     // records that found no room in the last pass
+
+public:
+    NeighborPool()
+        : mData( 0 ), mCapacity( 0 )
+        , mSegmentBegin( 0 ), mSegmentEnd( 0 ), mSegments( 0 ), mSegmentCapacity( 0 )
+        , mSpareEnd( 0 ), mSpareCursor( 0 ), mShortfall( 0 )
+    {}
+
+    ~NeighborPool()
+    {
+        Release();
+    }
+
+    void Release()
+    {
+        free( mData );
+        free( mSegmentBegin );
+        free( mSegmentEnd );
+        mData = 0;
+        mCapacity = 0;
+        mSegmentBegin = mSegmentEnd = 0;
+        mSegments = mSegmentCapacity = 0;
+        mSpareEnd = 0;
+    }
+
+    // Lays out one segment per unit with room for wanted[u] records and a little headroom,
+    // followed by the spare area. Call outside parallel regions before every pass.
+    void Plan( const unsigned int units, const size_t* wanted )
+    {
+        if( units > mSegmentCapacity )
+        {
+            mSegmentCapacity = units;
+            mSegmentBegin = (size_t*)realloc( mSegmentBegin, mSegmentCapacity * sizeof( size_t ) );
+            mSegmentEnd = (size_t*)realloc( mSegmentEnd, mSegmentCapacity * sizeof( size_t ) );
+        }
+        mSegments = units;
+        size_t total = 0;
+        for( unsigned int u = 0; u < units; ++u )
+        {
+            mSegmentBegin[u] = total;
+            total += wanted[u] + wanted[u] / 16;
+            mSegmentEnd[u] = total;
+        }
+
+        mSpareEnd = total + total / 16 + 256;
+        if( mSpareEnd > mCapacity )
+        {
+            // (with some slack, so that slowly growing counts do not reallocate every pass)
+            free( mData );
+            mCapacity = mSpareEnd + mSpareEnd / 16;
+            mData = (Record*)malloc( mCapacity * sizeof( Record ) );
+        }
+        mSpareCursor.store( total, std::memory_order_relaxed );
+        mShortfall.store( 0, std::memory_order_relaxed );
+    }
+
+    Record* Data() const { return mData; }
+    size_t SegmentBegin( const unsigned int u ) const { return mSegmentBegin[u]; }
+    size_t SegmentEnd( const unsigned int u ) const { return mSegmentEnd[u]; }
+    size_t Capacity() const { return mCapacity; }
+
+    // Called when the list [begin, cursor) of a unit reached end, the end of the room of the unit.
+    // Moves the list to a chunk of the spare area and sets begin, cursor and end to it.
+    // If the spare area is full, nothing changes and the records past end are dropped.
+    void Extend( size_t& begin, size_t& cursor, size_t& end )
+    {
+        const size_t length = cursor - begin;
+        const size_t size = 2 * length + 16;
+        const size_t at = mSpareCursor.fetch_add( size, std::memory_order_relaxed );
+        if( at + size > mSpareEnd )
+        {
+            return;
+        }
+        memcpy( mData + at, mData + begin, length * sizeof( Record ) );
+        begin = at;
+        cursor = at + length;
+        end = at + size;
+    }
+
+    // Called by a unit after writing up to (but excluding) cursor, which may lie beyond
+    // end if records were dropped
+    void Commit( const size_t cursor, const size_t end )
+    {
+        if( cursor > end )
+        {
+            mShortfall.fetch_add( cursor - end, std::memory_order_relaxed );
+        }
+    }
+
+    // Returns true if records were dropped in the last pass, which then has to be
+    // planned again from its own (complete) counts and repeated
+    bool Fit() const
+    {
+        return mShortfall.load( std::memory_order_relaxed ) != 0;
+    }
+};
+
+// Neighbor lists of all particles
+NeighborPool<Neighbor> neighborPool;
+
+// --------------------------------------------------------------------
+// Fixed-capacity storage of the neighbor lists for boundedNeighbors.
+// Particle i owns the records [i * Slots, ( i + 1 ) * Slots), the shared overflow
+// area follows those of all particles. A thread collects the neighbors beyond the
+// slots of a particle in a spill buffer of its own, and when the particle is done
+// claims room for the whole list in the overflow area, so lists stay contiguous
+// and the passes after DENSITY read both kinds alike. Nothing grows after the
+// first pass unless particles are added.
+class BoundedNeighborPool
+{
+    struct Spill
+    {
+        Neighbor* data;
+        size_t capacity;
+    };
+
+    Neighbor* mData;
+    size_t mCapacity;
+    unsigned int mSlots;
+    size_t mOverflowBegin;
+    size_t mOverflowEnd;
+    std::atomic<size_t> mOverflowCursor;
+
+    Spill* mSpill; // per thread
+    unsigned int mThreads;
+
+public:
+    BoundedNeighborPool()
+        : mData( 0 ), mCapacity( 0 ), mSlots( 0 ), mOverflowBegin( 0 ), mOverflowEnd( 0 )
+        , mOverflowCursor( 0 ), mSpill( 0 ), mThreads( 0 )
+    {}
+
+    ~BoundedNeighborPool()
+    {
+        Release();
+    }
+
+    void Release()
+    {
+        free( mData );
+        for( unsigned int t = 0; t < mThreads; ++t )
+        {
+            free( mSpill[t].data );
+        }
+        free( mSpill );
+        mData = 0;
+        mCapacity = 0;
+        mSpill = 0;
+        mThreads = 0;
+    }
+
+    // Lays out slots records for each of N particles and an overflow area of overflow
+    // records, and makes sure there is a spill buffer for every thread.
+    // Call outside parallel regions before every pass.
+    void Begin( const unsigned int N, const unsigned int slots, const size_t overflow, const unsigned int threads )
+    {
+        mSlots = slots;
+        mOverflowBegin = (size_t)N * slots;
+        mOverflowEnd = mOverflowBegin + overflow;
+        if( mOverflowEnd > mCapacity )
+        {
+            free( mData );
+            mCapacity = mOverflowEnd;
+            mData = (Neighbor*)malloc( mCapacity * sizeof( Neighbor ) );
+        }
+        mOverflowCursor.store( mOverflowBegin, std::memory_order_relaxed );
+
+        if( threads > mThreads )
+        {
+            mSpill = (Spill*)realloc( mSpill, threads * sizeof( Spill ) );
+            memset( mSpill + mThreads, 0, ( threads - mThreads ) * sizeof( Spill ) );
+            mThreads = threads;
+        }
+    }
+
+    Neighbor* Data() const { return mData; }
+    size_t Capacity() const { return mCapacity; }
+    size_t OverflowUsed() const { return mOverflowCursor.load( std::memory_order_relaxed ) - mOverflowBegin; }
+
+    // Stores neighbor number n of particle i, called by thread t
+    void Push( const unsigned int t, const unsigned int i, const size_t n, const Neighbor& nb )
+    {
+        if( n < mSlots )
+        {
+            mData[(size_t)i * mSlots + n] = nb;
+            return;
+        }
+        Spill& s = mSpill[t];
+        if( n - mSlots == s.capacity )
+        {
+            // (only grows up to the longest list)
+            s.capacity = glm::max( s.capacity * 2, (size_t)64 );
+            s.data = (Neighbor*)realloc( s.data, s.capacity * sizeof( Neighbor ) );
+        }
+        s.data[n - mSlots] = nb;
+    }
+
+    // Sets the neighbor offset of particle i after count Push() calls by thread t.
+    // Returns the number of neighbors kept, below count if the list was cut off.
+    // The neighbors of a cut off list beyond the slots stay in Dropped( t ) until
+    // the next Push() of t. The slots of a list moved to the overflow area stay empty.
+    size_t Finish( const unsigned int t, const unsigned int i, const size_t count )
+    {
+        const size_t own = (size_t)i * mSlots;
+        particles.neighbor_offset( i ) = own;
+        if( count <= mSlots )
+        {
+            return count;
+        }
+
+        size_t at = mOverflowCursor.load( std::memory_order_relaxed );
+        do
+        {
+            if( at + count > mOverflowEnd )
+            {
+                return mSlots;
+            }
+        }
+        while( !mOverflowCursor.compare_exchange_weak( at, at + count, std::memory_order_relaxed ) );
+
+        memcpy( mData + at, mData + own, mSlots * sizeof( Neighbor ) );
+        memcpy( mData + at + mSlots, mSpill[t].data, ( count - mSlots ) * sizeof( Neighbor ) );
+        particles.neighbor_offset( i ) = at;
+        return count;
+    }
+
+    const Neighbor* Dropped( const unsigned int t ) const { return mSpill[t].data; }
+};
+
+static BoundedNeighborPool boundedPool_;
+
+// Records of the neighbor lists of the last DENSITY pass, in neighborPool or in boundedPool_
+static Neighbor* neighborData_ = 0;
+
+// Neighbor list of particle i
+inline Neighbor* neighborsOf( const unsigned int i )
+{
+    return neighborData_ + particles.neighbor_offset( i );
+}
+
+// Prepares boundedPool_ for a DENSITY pass over the first N particles.
+// Returns false if the lists go to neighborPool instead, which is also the case in
+// the first pass of neighborSlots 0, whose counts size the slots.
+static bool beginBoundedNeighbors( const unsigned int N )
+{
+    if( !boundedNeighbors )
+    {
+        return false;
+    }
+    if( !neighborStats.slots )
+    {
+        if( !neighborSlots )
+        {
+            return false;
+        }
+        neighborStats.slots = neighborSlots;
+    }
+    const unsigned int slots = neighborStats.slots;
+    neighborStats.overflowCapacity = (size_t)( (double)N * slots * neighborOverflowShare );
+    boundedPool_.Begin( N, slots, neighborStats.overflowCapacity, (unsigned int)omp_get_max_threads() );
+    return true;
+}
+
+// Counters of a bounded pass, summed over the threads
+struct BoundedPassStats
+{
+    unsigned long long overflows;
+    unsigned long long truncated;
+    unsigned long long dropped;
+    size_t idle;
+
+    // Counts a list of count neighbors of which Finish() kept kept
+    void Add( const size_t count, const size_t kept, const unsigned int slots )
+    {
+        overflows += count > slots;
+        truncated += count > kept;
+        dropped += count - kept;
+        idle += kept > slots ? slots : 0;
+    }
+
+    void Add( const BoundedPassStats& pass )
+    {
+        overflows += pass.overflows;
+        truncated += pass.truncated;
+        dropped += pass.dropped;
+        idle += pass.idle;
+    }
+};
+
+// Called after a DENSITY pass over the first N particles
+static void endBoundedNeighbors( const bool bounded, const unsigned int N, const BoundedPassStats& pass )
+{
+    if( bounded )
+    {
+        neighborData_ = boundedPool_.Data();
+        neighborStats.passes++;
+        neighborStats.overflows += pass.overflows;
+        neighborStats.truncated += pass.truncated;
+        neighborStats.dropped += pass.dropped;
+        neighborStats.overflowPeak = glm::max( neighborStats.overflowPeak, boundedPool_.OverflowUsed() );
+        neighborStats.idlePeak = glm::max( neighborStats.idlePeak, pass.idle );
+
+        // (the lists of the first pass that sized the slots are not needed any more)
+        neighborPool.Release();
+        return;
+    }
+
+    neighborData_ = neighborPool.Data();
+    if( !boundedNeighbors )
+    {
+        boundedPool_.Release();
+    }
+    if( boundedNeighbors && !neighborStats.slots && N )
+    {
+        // Smallest count that covers neighborSlotsPercentile of the particles
+        std::vector<unsigned int> histogram;
+        for( unsigned int i = 0; i < N; ++i )
+        {
+            const size_t n = particles.neighbor_count( i );
+            if( n >= histogram.size() )
+            {
+                histogram.resize( n + 1, 0 );
+            }
+            histogram[n]++;
+        }
+        const double covered = (double)N * glm::clamp( neighborSlotsPercentile, 0.0f, 1.0f );
+        unsigned int slots = 0;
+        for( double sum = histogram[0]; sum < covered && slots + 1 < histogram.size(); sum += histogram[++slots] );
+        neighborStats.slots = glm::max( slots, 1u );
+    }
+}
+
+size_t neighborStorageBytes()
+{
+    return ( boundedPool_.Capacity() + neighborPool.Capacity() ) * sizeof( Neighbor );
+}
+
+// --------------------------------------------------------------------
+// Contiguous copies of the neighbors of one particle for the SIMD kernels.
+// There is one buffer per thread, grown by its own thread and never shrunk.
+struct GatherBuffer
+{
+    unsigned int* id;
+    float* x;
+    float* y;
+    float* q;
+    float* q2;
+    float* dx;
+    float* dy;
+    float* press;
+    float* press_near;
+    unsigned int capacity;
+
+    void Grow( const unsigned int n )
+    {
+        capacity = glm::max( n, glm::max( capacity * 2, 64u ) );
+        id = (unsigned int*)realloc( id, capacity * sizeof( unsigned int ) );
+        x = (float*)realloc( x, capacity * sizeof( float ) );
+        y = (float*)realloc( y, capacity * sizeof( float ) );
+        q = (float*)realloc( q, capacity * sizeof( float ) );
+        q2 = (float*)realloc( q2, capacity * sizeof( float ) );
+        dx = (float*)realloc( dx, capacity * sizeof( float ) );
+        dy = (float*)realloc( dy, capacity * sizeof( float ) );
+        press = (float*)realloc( press, capacity * sizeof( float ) );
+        press_near = (float*)realloc( press_near, capacity * sizeof( float ) );
+    }
+
+    void Release()
+    {
+        free( id ); free( x ); free( y ); free( q ); free( q2 ); free( dx ); free( dy ); free( press ); free( press_near );
+    }
+};
+
+static GatherBuffer* gatherBuffers_ = 0;
+static unsigned int gatherBufferCount_ = 0;
+
+// Makes sure there is a buffer for every thread, call outside parallel regions
+static void reserveGatherBuffers( const unsigned int threads )
+{
+    if( threads <= gatherBufferCount_ )
+    {
+        return;
+    }
+    gatherBuffers_ = (GatherBuffer*)realloc( gatherBuffers_, threads * sizeof( GatherBuffer ) );
+    memset( gatherBuffers_ + gatherBufferCount_, 0, ( threads - gatherBufferCount_ ) * sizeof( GatherBuffer ) );
+    gatherBufferCount_ = threads;
+}
+
+static void releaseGatherBuffers()
+{
+    for( unsigned int t = 0; t < gatherBufferCount_; ++t )
+    {
+        gatherBuffers_[t].Release();
+    }
+    free( gatherBuffers_ );
+    gatherBuffers_ = 0;
+    gatherBufferCount_ = 0;
+}
+
+// --------------------------------------------------------------------
+// Hands out tiles of consecutive particles to the threads of a parallel region.
+// The storage is kept in Z-order (see REORDER), so a tile is a compact group of cells.
+// Tiles are sorted by the neighbor count of their particles in the last step
+// and dealt to one queue per thread, the most expensive first, each to the queue
+// with the least work so far. A thread that runs out of tiles steals from the
+// other queues, which evens out what the estimate got wrong and threads that
+// start late. The workers are the OpenMP threads, which the runtime keeps alive
+// between parallel regions.
+// Without dynamic scheduling every thread gets one static chunk, like schedule(static).
+class TileScheduler
+{
+    // One cache line per queue, since its head is shared with thieves
+    struct Queue
+    {
+        std::atomic<unsigned int> head; // next position in mOrder
+        unsigned int end;               // one past the last position in mOrder
+        char pad[64 - sizeof( std::atomic<unsigned int> ) - sizeof( unsigned int )];
+    };
+
+    unsigned int mCount;       // number of particles
+    unsigned int mTileSize;
+    unsigned int mTiles;
+    unsigned int mWorkers;
+    bool mDynamic;
+
+    float* mCost;              // estimated cost of each tile
+    unsigned int* mOrder;      // tile indices grouped by queue, most expensive first
+    unsigned int* mOwner;      // queue of each tile
+    Queue* mQueues;
+    unsigned int mTileCapacity;
+    unsigned int mWorkerCapacity;
+
+    SchedulerStats mStats;
+    high_resolution_clock::time_point mStart;
+
+public:
+    TileScheduler()
+        : mCount( 0 ), mTileSize( 1 ), mTiles( 0 ), mWorkers( 0 ), mDynamic( true )
+        , mCost( 0 ), mOrder( 0 ), mOwner( 0 ), mQueues( 0 )
+        , mTileCapacity( 0 ), mWorkerCapacity( 0 )
+    {
+        mStats.wallUs = 0;
+    }
+
+    ~TileScheduler()
+    {
+        Release();
+    }
+
+    void Release()
+    {
+        free( mCost );
+        free( mOrder );
+        free( mOwner );
+        delete[] mQueues;
+        mCost = 0;
+        mOrder = mOwner = 0;
+        mQueues = 0;
+        mTileCapacity = mWorkerCapacity = 0;
+        mCount = mTiles = mWorkers = 0;
+    }
+
+    const SchedulerStats& Stats() const { return mStats; }
+
+    // Work units of Run() since the last Begin(): the tiles, or one static chunk per thread
+    unsigned int Units() const { return mDynamic ? mTiles : mWorkers; }
+
+    // First particle of unit u, UnitBegin( Units() ) is the particle count
+    unsigned int UnitBegin( const unsigned int u ) const
+    {
+        return mDynamic ? glm::min( u * mTileSize, mCount ) : (unsigned int)( (unsigned long long)mCount * u / mWorkers );
+    }
+
+    // Unit of the call f( begin, end ) of Run() on thread t
+    unsigned int UnitOf( const unsigned int t, const int begin ) const
+    {
+        return mDynamic ? (unsigned int)begin / mTileSize : t;
+    }
+
+    void ResetStats()
+    {
+        mStats.wallUs = 0;
+        mStats.busyUs.assign( mStats.busyUs.size(), 0.0 );
+        mStats.tiles.assign( mStats.tiles.size(), 0 );
+        mStats.steals.assign( mStats.steals.size(), 0 );
+    }
+
+    // Called before every scheduled parallel region over N particles.
+    // Retiles with equal costs if N or the number of threads changed.
+    void Begin( const unsigned int N, const bool dynamic )
+    {
+        const unsigned int workers = (unsigned int)omp_get_max_threads();
+        mDynamic = dynamic;
+        if( N != mCount || workers != mWorkers )
+        {
+            Resize( N, workers );
+            for( unsigned int tile = 0; tile < mTiles; ++tile )
+            {
+                mCost[tile] = 1;
+            }
+            Deal();
+        }
+        for( unsigned int w = 0; w < mWorkers; ++w )
+        {
+            mQueues[w].head.store( w ? mQueues[w - 1].end : 0, std::memory_order_relaxed );
+        }
+        mStart = high_resolution_clock::now();
+    }
+
+    void End()
+    {
+        mStats.wallUs += duration<double, std::micro>( high_resolution_clock::now() - mStart ).count();
+    }
+
+    // Called by every thread t of the region, calls f( begin, end ) for each of its tiles
+    template< typename F >
+    void Run( const unsigned int t, F f )
+    {
+        const high_resolution_clock::time_point start = high_resolution_clock::now();
+        unsigned int tiles = 0;
+        unsigned int steals = 0;
+        if( !mDynamic )
+        {
+            const unsigned int T = (unsigned int)omp_get_num_threads();
+            f( (int)( (unsigned long long)mCount * t / T ), (int)( (unsigned long long)mCount * ( t + 1 ) / T ) );
+            tiles = 1;
+        }
+        else
+        {
+            // Own queue first, then the others
+            for( unsigned int q = 0; q < mWorkers; ++q )
+            {
+                Queue& queue = mQueues[( t + q ) % mWorkers];
+                unsigned int pos;
+                while( queue.head.load( std::memory_order_relaxed ) < queue.end
+                    && ( pos = queue.head.fetch_add( 1 ) ) < queue.end )
+                {
+                    const unsigned int tile = mOrder[pos];
+                    f( (int)( tile * mTileSize ), (int)glm::min( ( tile + 1 ) * mTileSize, mCount ) );
+                    tiles++;
+                    steals += ( q != 0 );
+                }
+            }
+        }
+        if( t < mWorkers )
+        {
+            mStats.busyUs[t] += duration<double, std::micro>( high_resolution_clock::now() - start ).count();
+            mStats.tiles[t] += tiles;
+            mStats.steals[t] += steals;
+        }
+    }
+
+    // Estimates the cost of every tile from the neighbor counts of its particles
+    // and deals the tiles to the queues again
+    void Plan( Particles& particles )
+    {
+        if( ownedCount() != mCount || !mDynamic )
+        {
+            return;
+        }
+#pragma omp parallel for
+        for( int tile = 0; tile < (int)mTiles; ++tile )
+        {
+            const unsigned int end = glm::min( ( tile + 1 ) * mTileSize, mCount );
+            size_t cost = 0;
+            for( unsigned int i = tile * mTileSize; i < end; ++i )
+            {
+                // (every particle also costs something without neighbors)
+                cost += particles.neighbor_count( i ) + 4;
+            }
+            mCost[tile] = (float)cost;
+        }
+        Deal();
+    }
+
+private:
+    void Resize( const unsigned int N, const unsigned int workers )
+    {
+        // Enough tiles per thread for stealing to even out, but not too small
+        mTileSize = glm::clamp( N / ( workers * 8 ), 32u, 1024u );
+        mCount = N;
+        mTiles = ( N + mTileSize - 1 ) / mTileSize;
+        mWorkers = workers;
+        if( mTiles > mTileCapacity )
+        {
+            mTileCapacity = mTiles;
+            mCost = (float*)realloc( mCost, mTileCapacity * sizeof( float ) );
+            mOrder = (unsigned int*)realloc( mOrder, mTileCapacity * sizeof( unsigned int ) );
+            mOwner = (unsigned int*)realloc( mOwner, mTileCapacity * sizeof( unsigned int ) );
+        }
+        if( mWorkers > mWorkerCapacity )
+        {
+            mWorkerCapacity = mWorkers;
+            delete[] mQueues;
+            mQueues = new Queue[mWorkerCapacity];
+        }
+        if( mStats.busyUs.size() < mWorkers )
+        {
+            mStats.busyUs.resize( mWorkers, 0.0 );
+            mStats.tiles.resize( mWorkers, 0 );
+            mStats.steals.resize( mWorkers, 0 );
+        }
+    }
+
+    // Longest processing time first: the most expensive tile goes
+    // to the queue with the smallest total cost so far
+    void Deal()
+    {
+        for( unsigned int tile = 0; tile < mTiles; ++tile )
+        {
+            mOrder[tile] = tile;
+        }
+        const float* cost = mCost;
+        std::sort( mOrder, mOrder + mTiles, [cost]( const unsigned int a, const unsigned int b )
+        {
+            return cost[a] > cost[b] || ( cost[a] == cost[b] && a < b );
+        } );
+
+        std::vector<float> load( mWorkers, 0.0f );
+        std::vector<unsigned int> count( mWorkers, 0 );
+        for( unsigned int k = 0; k < mTiles; ++k )
+        {
+            const unsigned int w = (unsigned int)( std::min_element( load.begin(), load.end() ) - load.begin() );
+            load[w] += mCost[mOrder[k]];
+            count[w]++;
+            mOwner[mOrder[k]] = w;
+        }
+
+        // Group the sorted tiles by queue, keeping the order within each queue
+        unsigned int run = 0;
+        for( unsigned int w = 0; w < mWorkers; ++w )
+        {
+            const unsigned int n = count[w];
+            count[w] = run;
+            run += n;
+            mQueues[w].end = run;
+        }
+        std::vector<unsigned int> sorted( mOrder, mOrder + mTiles );
+        for( unsigned int k = 0; k < mTiles; ++k )
+        {
+            mOrder[count[mOwner[sorted[k]]]++] = sorted[k];
+        }
+    }
+};
+
+TileScheduler tileScheduler;
+
+const SchedulerStats& schedulerStats()
+{
+    return tileScheduler.Stats();
+}
+
+// Neighbor records each unit of a pass wants, from the counts of the last pass
+static std::vector<size_t> neighborWanted_;
+
+#if CURRENT_PAIR_EVALUATION == PAIR_EVALUATION_FULL
+// Lays out neighborPool for a pass over the units of tileScheduler
+static void planNeighborUnits()
+{
+    const unsigned int units = tileScheduler.Units();
+    neighborWanted_.resize( units );
+#pragma omp parallel for
+    for( int u = 0; u < (int)units; ++u )
+    {
+        size_t wanted = 0;
+        for( unsigned int i = tileScheduler.UnitBegin( u ); i < tileScheduler.UnitBegin( u + 1 ); ++i )
+        {
+            wanted += particles.neighbor_count( i );
+        }
+        neighborWanted_[u] = wanted;
+    }
+    neighborPool.Plan( units, neighborWanted_.data() );
+}
+#endif
+
+// --------------------------------------------------------------------
+#define MATERIAL_DEFAULT_ROW { spacing / 1000.0f, spacing / 1000.0f * 10, 3, 3, 4 }
+alignas( 64 ) Material materials[MATERIAL_TABLE_SIZE] = {
+    MATERIAL_DEFAULT_ROW,                                   // MATERIAL_DEFAULT
+    { spacing / 1000.0f, spacing / 1000.0f * 10, 10, 3, 4 },  // MATERIAL_SNOW //TODO still to bouncy...
+    { spacing / 100.0f, spacing / 100.0f * 1, 3, 3, 4 },      // MATERIAL_SLIME
+    MATERIAL_DEFAULT_ROW, MATERIAL_DEFAULT_ROW, MATERIAL_DEFAULT_ROW, MATERIAL_DEFAULT_ROW, MATERIAL_DEFAULT_ROW,
+};
+#undef MATERIAL_DEFAULT_ROW
+
+void setMaterial( const unsigned int first, const unsigned int count, const int material )
+{
+    for( unsigned int id = first; id < first + count && id < particles.N; ++id )
+    {
+        particles.material( particles.storage_index[id] ) = (unsigned char)material;
+    }
+}
+
+/*
+Radius of support r determines the region of neighbors to be considered for smoothing.
+Smoothing kernel W maps radii r_ij to weights q, so that forces are stronger when particles are nearer.
+The kernel uses r to let q drop to zero after a finite support.
+This helps to restrict computation to few neighbors, but note that a fixed number cannot be given.
+*/
+
+// The kernels, from the linear 1 - ( r_ij / r ) of the tutorial on, are in kernels.h
+
+
+// --------------------------------------------------------------------
+void allocate( const unsigned int N )
+{
+    particles.allocate(N);
+    ghostCount = 0;
+    stepCount_ = 0;
+    timeStep_ = lastTimeStep_ = 1;
+    time_ = 0;
+    velocityState_ = false;
+    dfsphPressures_ = false;
+    indexStale_ = true;
+    indexStats = SpatialIndexStats();
+    verletStats = VerletStats();
+    neighborStats = NeighborStats();
+    tileScheduler.ResetStats();
+
+#pragma omp parallel for
+    for( int i = 0; i < (int)N; ++i )
+    {
+        particles.id(i) = i;
+        particles.material(i) = MATERIAL_DEFAULT;
+        particles.neighbor_offset(i) = 0;
+        particles.neighbor_count(i) = 0;
+    }
+}
+
+// --------------------------------------------------------------------
+void init( const unsigned int N )
+{
+    allocate(N);
+
+    unsigned int i = 0;
+
+    // Initialize particles
+    // We will make a block of particles with a total width of 1/4 of the screen.
+    // In 3D every row is repeated along z over the same width.
+    float w = SIM_W / 4;
+    for( float y = bottom + w; true; y += r * 0.5f )
+    {
+        if (i >= N)
+        {
+            break;
+        }
+#if SPH_DIMENSION == 3
+        for( float z = -w; z <= w; z += r * 0.5f )
+#endif
+        for(float x = -w; x <= w; x += r * 0.5f )
+        {
+            if( i >= N )
+            {
+                break;
+            }
+
+#if SPH_DIMENSION == 3
+            const vecD pos(x, y, z);
+            const float jx = rand01(), jy = rand01();
+            const vecD jitter(jx, jy, rand01());
+#else
+            const vecD pos(x, y);
+            const vecD jitter(rand01(), rand01());
+#endif
+            particles.set_pos(i, pos);
+            particles.a(i) = 0.f;
+
+            particles.set_pos_old(i, pos + 0.001f * jitter);
+            particles.set_vel(i, vecD(0));
+            particles.set_force(i, vecD(0));
+            particles.stable_id[i] = i;
+            particles.storage_index[i] = i;
+
+            i++;
+        }
+    }
+}
+
+void shutdown() {
+    neighborPool.Release();
+    boundedPool_.Release();
+    neighborData_ = 0;
+    releaseGatherBuffers();
+    tileScheduler.Release();
+    particles.release();
+    ghostCount = 0;
+    if( reorderCapacity_ )
+    {
+        reorderScratch_.release();
+        free( reorderKeys_ );
+        free( reorderNewIndex_ );
+        reorderKeys_ = 0;
+        reorderNewIndex_ = 0;
+        reorderCapacity_ = 0;
+    }
+}
+
+vecD attractor(999);
+bool attracting = false;
+
+// --------------------------------------------------------------------
+template< typename T >
+class SpatialIndex
+{
+    const float mInvCellSize;
+
+    // 3x3 neighborhood for 2D, 3x3x3 for 3D
+#if SPH_DIMENSION == 3
+    const glm::ivec3 mOffsets[27] = {
+        { -1, -1, -1 },{ 0, -1, -1 },{ 1, -1, -1 },
+        { -1,  0, -1 },{ 0,  0, -1 },{ 1,  0, -1 },
+        { -1,  1, -1 },{ 0,  1, -1 },{ 1,  1, -1 },
+        { -1, -1,  0 },{ 0, -1,  0 },{ 1, -1,  0 },
+        { -1,  0,  0 },{ 0,  0,  0 },{ 1,  0,  0 },
+        { -1,  1,  0 },{ 0,  1,  0 },{ 1,  1,  0 },
+        { -1, -1,  1 },{ 0, -1,  1 },{ 1, -1,  1 },
+        { -1,  0,  1 },{ 0,  0,  1 },{ 1,  0,  1 },
+        { -1,  1,  1 },{ 0,  1,  1 },{ 1,  1,  1 } };
+#else
+    const glm::ivec3 mOffsets[9] = {
+        { -1, -1, 0 },{ 0, -1, 0 },{ 1, -1, 0 },
+        { -1,  0, 0 },{ 0,  0, 0 },{ 1,  0, 0 },
+        { -1,  1, 0 },{ 0,  1, 0 },{ 1,  1, 0 } };
+#endif
+
+public:
+    typedef std::vector< T* > NeighborList;
+
+    SpatialIndex
+        (
+        const unsigned int numBuckets,  // number of hash buckets
+        const float cellSize           // grid cell size
+        )
+        : mHashMap( numBuckets )
+        , mInvCellSize( 1.0f / cellSize )
+    {}
+
+    void Insert( const glm::vec3& pos, T* thing )
+    {
+        mHashMap[ Discretize( pos, mInvCellSize ) ].push_back( thing );
+    }
+
+    void Insert( const glm::ivec3& cell, T* thing )
+    {
+        mHashMap[ cell ].push_back( thing );
+    }
+
+    // Moves thing from one cell list to another.
+    // The order within the old cell list is not kept.
+    void Move( const glm::ivec3& from, const glm::ivec3& to, T* thing )
+    {
+        NeighborList& list = mHashMap[ from ];
+        for( size_t i = 0; i < list.size(); ++i )
+        {
+            if( list[i] == thing )
+            {
+                list[i] = list.back();
+                list.pop_back();
+                break;
+            }
+        }
+        mHashMap[ to ].push_back( thing );
+    }
+
+    glm::ivec3 Cell( const glm::vec3& pos ) const
+    {
+        return Discretize( pos, mInvCellSize );
+    }
+
+    void Neighbors( const glm::vec3& pos, NeighborList& ret ) const
+    {
+        const glm::ivec3 ipos = Discretize( pos, mInvCellSize );
+        for( const auto& offset : mOffsets )
+        {
+            typename HashMap::const_iterator it = mHashMap.find( offset + ipos );
+            if( it != mHashMap.end() )
+            {
+                ret.insert( ret.end(), it->second.begin(), it->second.end() );
+            }
+        }
+    }
+
+    void Clear()
+    {
+        mHashMap.clear();
+    }
+
+private:
+    // "Optimized Spatial Hashing for Collision Detection of Deformable Objects"
+    // Teschner, Heidelberger, et al.
+    // returns a hash between 0 and 2^32-1
+    struct TeschnerHash : std::unary_function< glm::ivec3, std::size_t >
+    {
+        std::size_t operator()( glm::ivec3 const& pos ) const
+        {
+            const unsigned int p1 = 73856093;
+            const unsigned int p2 = 19349663;
+            const unsigned int p3 = 83492791;
+            return size_t( ( pos.x * p1 ) ^ ( pos.y * p2 ) ^ ( pos.z * p3 ) );
+        };
+    };
+
+    // returns the indexes of the cell pos is in, assuming a cellSize grid
+    // invCellSize is the inverse of the desired cell size
+    static inline glm::ivec3 Discretize( const glm::vec3& pos, const float invCellSize )
+    {
+        return glm::ivec3( glm::floor( pos * invCellSize ) );
+    }
+
+    // Map grid positions to dynamic list of local objects using custom hash function
+    typedef std::unordered_map< glm::ivec3, NeighborList, TeschnerHash > HashMap;
+    HashMap mHashMap;
+};
+
+// The hash table works on 3D cells, 2D positions lie in the z = 0 plane
+static inline glm::vec3 toVec3( const vecD& pos )
+{
+#if SPH_DIMENSION == 3
+    return pos;
+#else
+    return glm::vec3( pos, 0.0f );
+#endif
+}
+
+// Hash table that can compute 1D index from 2D or 3D positions
+// Template arg is the hashed object type, here particle id
+// First ctor arg is hash table size
+// Second ctor arg is grid cell size which determines the considered neighborhood
+SpatialIndex<unsigned int> indexsp( 4093, r );
+
+// --------------------------------------------------------------------
+// Uniform grid over the bounding box of all particles,
+// built by a parallel counting sort as described in
+// "Efficient Neighbor Search for Particle-based Fluids"
+// Ihmsen, Akinci, et al.
+// Instead of one heap-allocated list per cell, the particle ids are
+// sorted by cell into one flat array and each cell stores the range
+// [cellStart, cellEnd) into that array.
+// Memory only grows, so there is no allocation in steady state.
+class UniformGrid
+{
+    float mInvCellSize;
+
+    ivecD mOrigin; // smallest cell coordinate in the grid
+    ivecD mDims;   // number of cells along each axis
+    bool mClamped; // the box was cut, particles outside are in the border cells
+
+    unsigned int* mCellStart; // first sorted index of each cell
+    unsigned int* mCellEnd;   // one past the last sorted index of each cell
+    unsigned int* mSorted;    // particle ids sorted by cell
+    unsigned int* mCellOf;    // cell of each particle, by particle id
+    unsigned int* mSlotOf;    // sorted index of each particle, by particle id
+    unsigned int* mNextCell;  // cell after the move, by particle id (Update only)
+    unsigned int* mOffsets;   // per-thread histogram / scatter cursors
+    unsigned int* mChunkSums; // per-thread totals for the prefix sum
+
+    unsigned int mCount;      // number of particles in the grid
+    unsigned int mCellCapacity;
+    unsigned int mParticleCapacity;
+    unsigned int mThreadCapacity;
+
+public:
+    // Contiguous run of particle ids in the sorted array
+    struct Range
+    {
+        const unsigned int* begin;
+        const unsigned int* end;
+    };
+
+    // Most ranges Neighbors and HalfNeighbors write
+    static const unsigned int NeighborRanges = SPH_DIMENSION == 3 ? 9 : 3;
+    static const unsigned int HalfNeighborRanges = SPH_DIMENSION == 3 ? 5 : 2;
+
+    UniformGrid
+        (
+        const float cellSize           // grid cell size
+        )
+        : mInvCellSize( 1.0f / cellSize )
+        , mOrigin( 0 )
+        , mDims( 0 )
+        , mClamped( false )
+        , mCellStart( 0 ), mCellEnd( 0 ), mSorted( 0 ), mCellOf( 0 ), mSlotOf( 0 ), mNextCell( 0 ), mOffsets( 0 ), mChunkSums( 0 )
+        , mCount( 0 ), mCellCapacity( 0 ), mParticleCapacity( 0 ), mThreadCapacity( 0 )
+    {}
+
+    // Takes effect with the next Build, which also has to come before the next Update
+    void SetCellSize( const float cellSize )
+    {
+        mInvCellSize = 1.0f / cellSize;
+        mCount = 0;
+    }
+
+    ~UniformGrid()
+    {
+        free( mCellStart );
+        free( mCellEnd );
+        free( mSorted );
+        free( mCellOf );
+        free( mSlotOf );
+        free( mNextCell );
+        free( mOffsets );
+        free( mChunkSums );
+    }
+
+    void Build( const Particles& particles )
+    {
+        const unsigned int N = particles.N;
+
+        // 1. Bounding box in cell coordinates
+        // (per-thread min/max since OpenMP 2.0 has no min/max reduction)
+        ivecD lo( INT_MAX );
+        ivecD hi( INT_MIN );
+#pragma omp parallel
+        {
+            PROFILE_THREAD( PHASE_SPATIAL_INDEX );
+            ivecD tlo( INT_MAX );
+            ivecD thi( INT_MIN );
+#pragma omp for nowait
+            for( int i = 0; i < (int)N; ++i )
+            {
+                const ivecD c = Discretize( particles.pos( i ), mInvCellSize );
+                tlo = glm::min( tlo, c );
+                thi = glm::max( thi, c );
+            }
+#pragma omp critical
+            {
+                lo = glm::min( lo, tlo );
+                hi = glm::max( hi, thi );
+            }
+        }
+        if( N == 0 )
+        {
+            lo = hi = ivecD( 0 );
+        }
+
+        // One escaped particle would stretch the box over its whole flight, a NaN over the
+        // whole range of Discretize. Beyond maxCells the box is cut to the walls of the world
+        // and as much height above the floor as fits, the particles outside go to the border
+        // cells. Clamping keeps cells of neighbors adjacent, so no pair is lost, the border
+        // cells only hold more candidates.
+        const double maxCells = glm::max( 4.0 * N, 65536.0 );
+        mClamped = CellCount( lo, hi ) > maxCells;
+        if( mClamped )
+        {
+#if SPH_DIMENSION == 3
+            const ivecD wallLo = Discretize( vecD( -SIM_W, bottom, -SIM_W ), mInvCellSize ) - 1;
+            const ivecD wallHi = Discretize( vecD( SIM_W, bottom, SIM_W ), mInvCellSize ) + 1;
+#else
+            const ivecD wallLo = Discretize( vecD( -SIM_W, bottom ), mInvCellSize ) - 1;
+            const ivecD wallHi = Discretize( vecD( SIM_W, bottom ), mInvCellSize ) + 1;
+#endif
+            double across = 1;
+            for( int d = 0; d < SPH_DIMENSION; ++d )
+            {
+                lo[d] = glm::clamp( lo[d], wallLo[d], wallHi[d] );
+                if( d != 1 )
+                {
+                    hi[d] = glm::clamp( hi[d], lo[d], wallHi[d] );
+                    across *= hi[d] - lo[d] + 1;
+                }
+            }
+            hi.y = (int)glm::min( (double)hi.y, lo.y + glm::max( maxCells / across, 1.0 ) - 1 );
+            hi.y = glm::max( hi.y, lo.y );
+            indexStats.clamped++;
+        }
+        mOrigin = lo;
+        mDims = hi - lo + 1;
+        mCount = N;
+
+        const unsigned int cellCount = (unsigned int)CellCount( lo, hi );
+        const unsigned int maxThreads = (unsigned int)omp_get_max_threads();
+        Reserve( cellCount, N, maxThreads );
+
+#pragma omp parallel
+        {
+            PROFILE_THREAD( PHASE_SPATIAL_INDEX );
+            const unsigned int t = (unsigned int)omp_get_thread_num();
+            const unsigned int T = (unsigned int)omp_get_num_threads();
+
+            // Static chunks, so that the scatter below keeps particles
+            // of a cell in ascending id order (deterministic results)
+            const unsigned int pBeg = (unsigned int)( (unsigned long long)N * t / T );
+            const unsigned int pEnd = (unsigned int)( (unsigned long long)N * ( t + 1 ) / T );
+            const unsigned int cBeg = (unsigned int)( (unsigned long long)cellCount * t / T );
+            const unsigned int cEnd = (unsigned int)( (unsigned long long)cellCount * ( t + 1 ) / T );
+
+            // 2. Histogram of cell keys, one row per thread
+            unsigned int* hist = mOffsets + (size_t)t * cellCount;
+            memset( hist, 0, cellCount * sizeof( unsigned int ) );
+            for( unsigned int i = pBeg; i < pEnd; ++i )
+            {
+                const unsigned int key = Key( CellOf( particles.pos( i ) ) );
+                mCellOf[i] = key;
+                hist[key]++;
+            }
+#pragma omp barrier
+
+            // 3. Exclusive prefix sum over (cell, thread)
+            // Each thread sums a chunk of cells, then the chunk totals are scanned
+            unsigned int sum = 0;
+            for( unsigned int c = cBeg; c < cEnd; ++c )
+                for( unsigned int s = 0; s < T; ++s )
+                    sum += mOffsets[(size_t)s * cellCount + c];
+            mChunkSums[t] = sum;
+#pragma omp barrier
+#pragma omp single
+            {
+                unsigned int run = 0;
+                for( unsigned int s = 0; s < T; ++s )
+                {
+                    const unsigned int n = mChunkSums[s];
+                    mChunkSums[s] = run;
+                    run += n;
+                }
+            }
+            unsigned int run = mChunkSums[t];
+            for( unsigned int c = cBeg; c < cEnd; ++c )
+            {
+                mCellStart[c] = run;
+                for( unsigned int s = 0; s < T; ++s )
+                {
+                    unsigned int& o = mOffsets[(size_t)s * cellCount + c];
+                    const unsigned int n = o;
+                    o = run;
+                    run += n;
+                }
+                mCellEnd[c] = run;
+            }
+#pragma omp barrier
+
+            // 4. Scatter particle ids to their sorted slots
+            for( unsigned int i = pBeg; i < pEnd; ++i )
+            {
+                const unsigned int slot = hist[mCellOf[i]]++;
+                mSorted[slot] = i;
+                mSlotOf[i] = slot;
+            }
+        }
+    }
+
+    // Moves only the particles whose cell changed since the last Build or Update
+    // and returns true, or rebuilds and returns false if a particle left the grid (unless it was cut),
+    // the particle count changed or more than maxMovers particles changed cells.
+    // Particle ids must still refer to the same particles as in the last call.
+    bool Update( const Particles& particles, const unsigned int maxMovers, unsigned int* movers )
+    {
+        const unsigned int N = particles.N;
+        *movers = 0;
+        if( N != mCount )
+        {
+            Build( particles );
+            return false;
+        }
+
+        // 1. New cell of every particle
+        int moved = 0;
+        int outside = 0;
+#pragma omp parallel
+        {
+            PROFILE_THREAD( PHASE_SPATIAL_INDEX );
+#pragma omp for reduction(+:moved, outside) nowait
+            for( int i = 0; i < (int)N; ++i )
+            {
+                const ivecD c = Discretize( particles.pos( i ), mInvCellSize ) - mOrigin;
+                if( !Contains( c ) && !mClamped )
+                {
+                    outside++;
+                    continue;
+                }
+                const unsigned int key = Key( glm::clamp( c, ivecD( 0 ), mDims - 1 ) );
+                mNextCell[i] = key;
+                moved += ( key != mCellOf[i] );
+            }
+        }
+        *movers = (unsigned int)moved;
+        if( outside || (unsigned int)moved > maxMovers )
+        {
+            Build( particles );
+            return false;
+        }
+
+        // 2. Move them, few enough to do sequentially
+        for( unsigned int i = 0; i < N && moved; ++i )
+        {
+            if( mNextCell[i] != mCellOf[i] )
+            {
+                Move( i, mCellOf[i], mNextCell[i] );
+                mCellOf[i] = mNextCell[i];
+                moved--;
+            }
+        }
+        return true;
+    }
+
+    // Writes up to NeighborRanges ranges (one per row of the 3x3 or 3x3x3 neighborhood)
+    // and returns their count. Cells in a row are adjacent in the sorted array,
+    // so each row is a single contiguous range.
+    unsigned int Neighbors( const vecD& pos, Range* ret ) const
+    {
+        const ivecD c = CellOf( pos );
+        const int x0 = glm::max( c.x - 1, 0 );
+        const int x1 = glm::min( c.x + 1, mDims.x - 1 );
+        if( x0 > x1 )
+        {
+            return 0;
+        }
+        unsigned int count = 0;
+#if SPH_DIMENSION == 3
+        for( int z = glm::max( c.z - 1, 0 ); z <= glm::min( c.z + 1, mDims.z - 1 ); ++z )
+#endif
+        for( int y = glm::max( c.y - 1, 0 ); y <= glm::min( c.y + 1, mDims.y - 1 ); ++y )
+        {
+#if SPH_DIMENSION == 3
+            const unsigned int row = (unsigned int)( ( z * mDims.y + y ) * mDims.x );
+#else
+            const unsigned int row = (unsigned int)( y * mDims.x );
+#endif
+            const unsigned int b = mCellStart[row + x0];
+            const unsigned int e = mCellEnd[row + x1];
+            if( b != e )
+            {
+                ret[count].begin = mSorted + b;
+                ret[count].end = mSorted + e;
+                count++;
+            }
+        }
+        return count;
+    }
+
+    void Neighbors( const vecD& pos, std::vector< unsigned int >& ret ) const
+    {
+        Range ranges[NeighborRanges];
+        const unsigned int count = Neighbors( pos, ranges );
+        for( unsigned int k = 0; k < count; ++k )
+        {
+            ret.insert( ret.end(), ranges[k].begin, ranges[k].end );
+        }
+    }
+
+    // Particle ids in cell c
+    Range Cell( const unsigned int c ) const
+    {
+        Range ret;
+        ret.begin = mSorted + mCellStart[c];
+        ret.end = mSorted + mCellEnd[c];
+        return ret;
+    }
+
+    // Half of the 3x3 neighborhood of the particle at sorted position slot in cell c,
+    // so that every unordered pair of particles is visited exactly once:
+    // the rest of its own cell, the right cell and the three cells of the row above.
+    // In 3D also the 3x3 cells of the layer behind.
+    // Writes up to HalfNeighborRanges ranges and returns their count.
+    unsigned int HalfNeighbors( const unsigned int c, const unsigned int* slot, Range* ret ) const
+    {
+        const int x = (int)( c % (unsigned int)mDims.x );
+#if SPH_DIMENSION == 3
+        const int y = (int)( c / (unsigned int)mDims.x % (unsigned int)mDims.y );
+#else
+        const int y = (int)( c / (unsigned int)mDims.x );
+#endif
+        const int x0 = glm::max( x - 1, 0 );
+        const int x1 = glm::min( x + 1, mDims.x - 1 );
+        unsigned int count = 0;
+
+        const unsigned int e = mCellEnd[c + ( x1 - x )];
+        if( mSorted + e != slot + 1 )
+        {
+            ret[count].begin = slot + 1;
+            ret[count].end = mSorted + e;
+            count++;
+        }
+        const unsigned int rowStart = c - x;
+        if( y + 1 < mDims.y )
+        {
+            count += Row( rowStart + mDims.x, x0, x1, ret + count );
+        }
+#if SPH_DIMENSION == 3
+        const int z = (int)( c / (unsigned int)( mDims.x * mDims.y ) );
+        if( z + 1 < mDims.z )
+        {
+            const unsigned int behind = rowStart + mDims.x * mDims.y;
+            for( int dy = glm::max( y - 1, 0 ) - y; dy <= glm::min( y + 1, mDims.y - 1 ) - y; ++dy )
+            {
+                count += Row( (unsigned int)( (int)behind + dy * mDims.x ), x0, x1, ret + count );
+            }
+        }
+#endif
+        return count;
+    }
+
+    // The half neighborhood of a cell reaches one cell left and right
+    // and one row up, so cells of the same color in a 3x2 pattern never
+    // touch the same particles and can be processed in parallel.
+    // In 3D it reaches one row down and up and one layer back, a 3x3x2 pattern.
+#if SPH_DIMENSION == 3
+    static const unsigned int Colors = 18;
+#else
+    static const unsigned int Colors = 6;
+#endif
+
+    unsigned int CellCount() const
+    {
+        return (unsigned int)CellCount( ivecD( 0 ), mDims - 1 );
+    }
+
+    unsigned int ColorCellCount( const unsigned int color ) const
+    {
+#if SPH_DIMENSION == 3
+        const int cx = (int)( color % 3 );
+        const int cy = (int)( color / 3 % 3 );
+        const int cz = (int)( color / 9 );
+        const int nx = glm::max( ( mDims.x - cx + 2 ) / 3, 0 );
+        const int ny = glm::max( ( mDims.y - cy + 2 ) / 3, 0 );
+        const int nz = glm::max( ( mDims.z - cz + 1 ) / 2, 0 );
+        return (unsigned int)( nx * ny * nz );
+#else
+        const int cx = (int)( color % 3 );
+        const int cy = (int)( color / 3 );
+        const int nx = glm::max( ( mDims.x - cx + 2 ) / 3, 0 );
+        const int ny = glm::max( ( mDims.y - cy + 1 ) / 2, 0 );
+        return (unsigned int)( nx * ny );
+#endif
+    }
+
+    // Linear index of the k-th cell of a color
+    unsigned int ColoredCell( const unsigned int color, const unsigned int k ) const
+    {
+#if SPH_DIMENSION == 3
+        const unsigned int cx = color % 3;
+        const unsigned int cy = color / 3 % 3;
+        const unsigned int cz = color / 9;
+        const unsigned int nx = ( (unsigned int)mDims.x - cx + 2 ) / 3;
+        const unsigned int ny = ( (unsigned int)mDims.y - cy + 2 ) / 3;
+        const unsigned int x = cx + 3 * ( k % nx );
+        const unsigned int y = cy + 3 * ( k / nx % ny );
+        const unsigned int z = cz + 2 * ( k / nx / ny );
+        return ( z * (unsigned int)mDims.y + y ) * (unsigned int)mDims.x + x;
+#else
+        const unsigned int cx = color % 3;
+        const unsigned int cy = color / 3;
+        const unsigned int nx = ( (unsigned int)mDims.x - cx + 2 ) / 3;
+        const unsigned int x = cx + 3 * ( k % nx );
+        const unsigned int y = cy + 2 * ( k / nx );
+        return y * (unsigned int)mDims.x + x;
+#endif
+    }
+
+private:
+    // Linear index of cell c, x varies fastest, then y, then z
+    inline unsigned int Key( const ivecD& c ) const
+    {
+#if SPH_DIMENSION == 3
+        return (unsigned int)( ( c.z * mDims.y + c.y ) * mDims.x + c.x );
+#else
+        return (unsigned int)( c.y * mDims.x + c.x );
+#endif
+    }
+
+    inline bool Contains( const ivecD& c ) const
+    {
+        for( int d = 0; d < SPH_DIMENSION; ++d )
+        {
+            if( c[d] < 0 || c[d] >= mDims[d] )
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Appends cells [x0, x1] of the row starting at cell rowStart if they are not empty
+    inline unsigned int Row( const unsigned int rowStart, const int x0, const int x1, Range* ret ) const
+    {
+        const unsigned int b = mCellStart[rowStart + x0];
+        const unsigned int e = mCellEnd[rowStart + x1];
+        if( b == e )
+        {
+            return 0;
+        }
+        ret->begin = mSorted + b;
+        ret->end = mSorted + e;
+        return 1;
+    }
+
+    // Cell coordinates are kept within +-CellLimit, so that box extents fit into an int
+    static inline ivecD Discretize( const vecD& pos, const float invCellSize )
+    {
+        const float CellLimit = (float)( 1 << 28 );
+        const vecD c = glm::floor( pos * invCellSize );
+        ivecD ret;
+        for( int d = 0; d < SPH_DIMENSION; ++d )
+        {
+            // (NaN goes to the lower end)
+            ret[d] = c[d] > -CellLimit ? (int)glm::min( c[d], CellLimit ) : -(int)CellLimit;
+        }
+        return ret;
+    }
+
+    // Cell of a position relative to the grid, positions outside go to the border cells
+    inline ivecD CellOf( const vecD& pos ) const
+    {
+        return glm::clamp( Discretize( pos, mInvCellSize ) - mOrigin, ivecD( 0 ), mDims - 1 );
+    }
+
+    static inline double CellCount( const ivecD& lo, const ivecD& hi )
+    {
+        double count = 1;
+        for( int d = 0; d < SPH_DIMENSION; ++d )
+        {
+            count *= (double)hi[d] - lo[d] + 1;
+        }
+        return count;
+    }
+
+    inline void Swap( const unsigned int a, const unsigned int b )
+    {
+        std::swap( mSorted[a], mSorted[b] );
+        mSlotOf[mSorted[a]] = a;
+        mSlotOf[mSorted[b]] = b;
+    }
+
+    // Moves particle i from cell "from" to cell "to" in the sorted array.
+    // The particle is passed along the cells in between by swapping it with
+    // their first or last element and shifting the cell boundary by one,
+    // so the cost only depends on the distance of the cells, not on N.
+    // Neighboring cells in a row are 1 apart, in a column mDims.x apart
+    // (and in 3D mDims.x * mDims.y apart along z).
+    void Move( const unsigned int i, const unsigned int from, const unsigned int to )
+    {
+        unsigned int slot = mSlotOf[i];
+        if( from < to )
+        {
+            for( unsigned int c = from; c < to; ++c )
+            {
+                const unsigned int last = mCellEnd[c] - 1;
+                Swap( slot, last );
+                slot = last;
+                mCellEnd[c]--;
+                mCellStart[c + 1]--;
+            }
+        }
+        else
+        {
+            for( unsigned int c = from; c > to; --c )
+            {
+                const unsigned int first = mCellStart[c];
+                Swap( slot, first );
+                slot = first;
+                mCellStart[c]++;
+                mCellEnd[c - 1]++;
+            }
+        }
+    }
+
+    void Reserve( const unsigned int cells, const unsigned int particles, const unsigned int threads )
+    {
+        if( cells > mCellCapacity || threads > mThreadCapacity )
+        {
+            mCellCapacity = glm::max( cells, mCellCapacity );
+            mThreadCapacity = glm::max( threads, mThreadCapacity );
+            mCellStart = (unsigned int*)realloc( mCellStart, mCellCapacity * sizeof( unsigned int ) );
+            mCellEnd = (unsigned int*)realloc( mCellEnd, mCellCapacity * sizeof( unsigned int ) );
+            mOffsets = (unsigned int*)realloc( mOffsets, (size_t)mCellCapacity * mThreadCapacity * sizeof( unsigned int ) );
+            mChunkSums = (unsigned int*)realloc( mChunkSums, mThreadCapacity * sizeof( unsigned int ) );
+        }
+        if( particles > mParticleCapacity )
+        {
+            mParticleCapacity = particles;
+            mSorted = (unsigned int*)realloc( mSorted, mParticleCapacity * sizeof( unsigned int ) );
+            mCellOf = (unsigned int*)realloc( mCellOf, mParticleCapacity * sizeof( unsigned int ) );
+            mSlotOf = (unsigned int*)realloc( mSlotOf, mParticleCapacity * sizeof( unsigned int ) );
+            mNextCell = (unsigned int*)realloc( mNextCell, mParticleCapacity * sizeof( unsigned int ) );
+        }
+    }
+};
+
+// Counting-sort grid with the same cell size as the hash table above
+// (r + verletSkin while Verlet lists are used)
+UniformGrid indexgrid( r );
+
+// --------------------------------------------------------------------
+// Verlet neighbor lists:
+// the candidates within radius r + skin of every particle are gathered from the grid
+// and reused for several steps. As long as no particle moved more than skin / 2
+// since they were gathered, no pair can have come closer than r without being
+// a candidate, so each step only filters the candidates by their actual distance.
+class VerletList
+{
+    NeighborPool<unsigned int> mPool;
+    size_t* mOffset;          // first candidate of each particle in the pool
+    unsigned int* mCount;     // number of candidates of each particle
+    vecD* mBuildPos;     // position of each particle when the list was built
+    unsigned int mCapacity;
+    std::vector<size_t> mWanted; // candidates of each static chunk in the last Build
+
+public:
+    VerletList()
+        : mOffset( 0 ), mCount( 0 ), mBuildPos( 0 ), mCapacity( 0 )
+    {}
+
+    ~VerletList()
+    {
+        Release();
+    }
+
+    void Release()
+    {
+        mPool.Release();
+        free( mOffset );
+        free( mCount );
+        free( mBuildPos );
+        mOffset = 0;
+        mCount = 0;
+        mBuildPos = 0;
+        mCapacity = 0;
+        mWanted.clear();
+    }
+
+    // Largest distance a particle moved since the last Build
+    float MaxDisplacement( const Particles& particles ) const
+    {
+        // (per-thread max since OpenMP 2.0 has no max reduction)
+        float maxDist2 = 0;
+#pragma omp parallel
+        {
+            PROFILE_THREAD( PHASE_SPATIAL_INDEX );
+            float tmax = 0;
+#pragma omp for nowait
+            for( int i = 0; i < (int)particles.N; ++i )
+            {
+                const vecD d = particles.pos( i ) - mBuildPos[i];
+                tmax = glm::max( tmax, glm::dot( d, d ) );
+            }
+#pragma omp critical
+            maxDist2 = glm::max( maxDist2, tmax );
+        }
+        return sqrt( maxDist2 );
+    }
+
+    // Gathers the candidates within radius from a grid
+    // that was just built with a cell size of at least radius
+    void Build( const Particles& particles, const UniformGrid& grid, const float radius )
+    {
+        const unsigned int N = particles.N;
+        if( N > mCapacity )
+        {
+            mCapacity = N;
+            mOffset = (size_t*)realloc( mOffset, mCapacity * sizeof( size_t ) );
+            mCount = (unsigned int*)realloc( mCount, mCapacity * sizeof( unsigned int ) );
+            mBuildPos = (vecD*)realloc( mBuildPos, mCapacity * sizeof( vecD ) );
+        }
+        const float radius2 = radius * radius;
+
+        // One segment per static chunk, sized from the count of the chunk in the last
+        // build (or in the failed attempt)
+        const unsigned int threads = (unsigned int)omp_get_max_threads();
+        if( mWanted.size() != threads )
+        {
+            size_t total = 0;
+            for( size_t t = 0; t < mWanted.size(); ++t )
+            {
+                total += mWanted[t];
+            }
+            mWanted.assign( threads, total / threads );
+        }
+        do
+        {
+            mPool.Plan( threads, mWanted.data() );
+#pragma omp parallel
+            {
+                PROFILE_THREAD( PHASE_SPATIAL_INDEX );
+                const unsigned int t = (unsigned int)omp_get_thread_num();
+                const unsigned int T = (unsigned int)omp_get_num_threads();
+
+                unsigned int* const pool = mPool.Data();
+                size_t segmentEnd = mPool.SegmentEnd( t );
+                size_t cursor = mPool.SegmentBegin( t );
+                size_t total = 0;
+
+                const int beg = (int)( (unsigned long long)N * t / T );
+                const int end = (int)( (unsigned long long)N * ( t + 1 ) / T );
+                for( int i = beg; i < end; ++i )
+                {
+                    const vecD pos_i = particles.pos( i );
+                    size_t listBegin = cursor;
+                    mBuildPos[i] = pos_i;
+                    unsigned int count = 0;
+
+                    UniformGrid::Range ranges[UniformGrid::NeighborRanges];
+                    const unsigned int rangeCount = grid.Neighbors( pos_i, ranges );
+                    for( unsigned int k = 0; k < rangeCount; ++k )
+                    {
+                        for( const unsigned int* j = ranges[k].begin; j != ranges[k].end; ++j )
+                        {
+                            const vecD rij = particles.pos( *j ) - pos_i;
+                            if( *j != (unsigned int)i && glm::dot( rij, rij ) < radius2 )
+                            {
+                                if( cursor == segmentEnd )
+                                {
+                                    mPool.Extend( listBegin, cursor, segmentEnd );
+                                }
+                                if( cursor < segmentEnd )
+                                {
+                                    pool[cursor] = *j;
+                                }
+                                cursor++;
+                                count++;
+                            }
+                        }
+                    }
+                    mOffset[i] = listBegin;
+                    mCount[i] = count;
+                    total += count;
+                }
+
+                mPool.Commit( cursor, segmentEnd );
+                mWanted[t] = total;
+            }
+        }
+        while( mPool.Fit() );
+    }
+
+    const unsigned int* Candidates( const unsigned int i ) const { return mPool.Data() + mOffset[i]; }
+    unsigned int CandidateCount( const unsigned int i ) const { return mCount[i]; }
+};
+
+VerletList verletList;
+
+// --------------------------------------------------------------------
+// Interleaves the lower 16 bits of x and y into a Z-order (Morton) code,
+// x in the even bits, y in the odd bits
+inline unsigned int morton2D( unsigned int x, unsigned int y )
+{
+    x &= 0x0000FFFF;
+    x = ( x | ( x << 8 ) ) & 0x00FF00FF;
+    x = ( x | ( x << 4 ) ) & 0x0F0F0F0F;
+    x = ( x | ( x << 2 ) ) & 0x33333333;
+    x = ( x | ( x << 1 ) ) & 0x55555555;
+    y &= 0x0000FFFF;
+    y = ( y | ( y << 8 ) ) & 0x00FF00FF;
+    y = ( y | ( y << 4 ) ) & 0x0F0F0F0F;
+    y = ( y | ( y << 2 ) ) & 0x33333333;
+    y = ( y | ( y << 1 ) ) & 0x55555555;
+    return x | ( y << 1 );
+}
+
+// 3D version for cell coordinates below 2^( bits[d] + shift ) along axis d:
+// interleaves bits[d] bits of every axis above the lowest shift bits, lowest bit first.
+// Axes that run out of bits drop out, so a tall column of particles
+// does not waste code bits on its few cells along x and z.
+inline unsigned int mortonBits( const ivecD& c, const unsigned int* bits, const unsigned int shift )
+{
+    unsigned int code = 0;
+    unsigned int out = 0;
+    for( unsigned int b = 0; b < 32; ++b )
+    {
+        for( int d = 0; d < SPH_DIMENSION; ++d )
+        {
+            if( b < bits[d] )
+            {
+                code |= ( ( (unsigned int)c[d] >> ( b + shift ) ) & 1u ) << out++;
+            }
+        }
+    }
+    return code;
+}
+
+// Sorts particle storage by the Morton code of each particle's grid cell,
+// so that particles which are close in space are also close in memory.
+// Particle ids and all Neighbor::id are remapped to the new storage indices,
+// Particles::stable_id and Particles::storage_index keep track of the permutation.
+// Ghosts stay behind the owned particles in their slots.
+void reorderParticles()
+{
+    const unsigned int N = particles.N;
+    const unsigned int owned = ownedCount();
+    if( reorderCapacity_ != N )
+    {
+        if( reorderCapacity_ )
+        {
+            reorderScratch_.release();
+        }
+        reorderCapacity_ = N;
+        reorderKeys_ = (unsigned long long*)realloc( reorderKeys_, N * sizeof( unsigned long long ) );
+        reorderNewIndex_ = (unsigned int*)realloc( reorderNewIndex_, N * sizeof( unsigned int ) );
+        reorderScratch_.allocate( N );
+    }
+
+    // Cells are counted from the lower left corner of the bounding box,
+    // so that all coordinates are non-negative
+    ivecD lo( INT_MAX );
+#if SPH_DIMENSION == 3
+    ivecD hi( INT_MIN );
+#endif
+#pragma omp parallel
+    {
+        ivecD tlo( INT_MAX );
+#if SPH_DIMENSION == 3
+        ivecD thi( INT_MIN );
+#endif
+#pragma omp for nowait
+        for( int i = 0; i < (int)owned; ++i )
+        {
+            const ivecD c( glm::floor( particles.pos( i ) * ( 1.0f / r ) ) );
+            tlo = glm::min( tlo, c );
+#if SPH_DIMENSION == 3
+            thi = glm::max( thi, c );
+#endif
+        }
+#pragma omp critical
+        {
+            lo = glm::min( lo, tlo );
+#if SPH_DIMENSION == 3
+            hi = glm::max( hi, thi );
+#endif
+        }
+    }
+
+#if SPH_DIMENSION == 3
+    // Bits per axis for the extent of the particles, at most 32 in total.
+    // Larger extents are coarsened to blocks of 2^shift cells per axis.
+    unsigned int bits[SPH_DIMENSION];
+    unsigned int shift = 0;
+    for( ;; )
+    {
+        unsigned int total = 0;
+        for( int d = 0; d < SPH_DIMENSION; ++d )
+        {
+            const unsigned int extent = (unsigned int)( hi[d] - lo[d] ) >> shift;
+            for( bits[d] = 0; bits[d] < 32 && ( extent >> bits[d] ); ++bits[d] );
+            total += bits[d];
+        }
+        if( total <= 32 || owned == 0 )
+        {
+            break;
+        }
+        shift++;
+    }
+#endif
+
+    // Sort keys hold the Morton code in the upper and the old index in the lower half,
+    // which makes the order unique and keeps particles of a cell in their previous order
+#pragma omp parallel for
+    for( int i = 0; i < (int)owned; ++i )
+    {
+        const ivecD c = ivecD( glm::floor( particles.pos( i ) * ( 1.0f / r ) ) ) - lo;
+#if SPH_DIMENSION == 3
+        const unsigned long long code = mortonBits( c, bits, shift );
+#else
+        const unsigned long long code = morton2D( (unsigned int)c.x, (unsigned int)c.y );
+#endif
+        reorderKeys_[i] = ( code << 32 ) | (unsigned int)i;
+    }
+    std::sort( reorderKeys_, reorderKeys_ + owned );
+
+    // Gather into the scratch storage and remember where each particle went
+#pragma omp parallel for
+    for( int n = 0; n < (int)N; ++n )
+    {
+        const unsigned int old = n < (int)owned ? (unsigned int)( reorderKeys_[n] & 0xFFFFFFFF ) : (unsigned int)n;
+        reorderNewIndex_[old] = n;
+        reorderScratch_.copy( n, particles, old );
+    }
+    std::swap( particles, reorderScratch_ );
+    // (storage_index is indexed by stable id, not by slot, so it stays)
+    std::swap( particles.storage_index, reorderScratch_.storage_index );
+    indexStale_ = true;
+
+    // Fix up all indices that refer to storage positions
+#pragma omp parallel for
+    for( int n = 0; n < (int)N; ++n )
+    {
+        Neighbor* neighbors = neighborsOf( n );
+        for( size_t j = 0; j < particles.neighbor_count( n ); j++ )
+        {
+            neighbors[j].id = reorderNewIndex_[neighbors[j].id];
+        }
+        if( n < (int)owned )
+        {
+            particles.storage_index[particles.stable_id[n]] = n;
+        }
+    }
+}
+
+// --------------------------------------------------------------------
+// Uses whichever spatial index is active
+void queryNeighborIds( const vecD& pos, std::vector<unsigned int>& ret )
+{
+#if CURRENT_SPATIAL_INDEX == SPATIAL_INDEX_GRID
+    indexgrid.Neighbors( pos, ret );
+#else
+    std::vector<unsigned int*> neighIds;
+    indexsp.Neighbors( toVec3( pos ), neighIds );
+    for( const auto id : neighIds ) ret.push_back( *id );
+#endif
+}
+
+// --------------------------------------------------------------------
+// UPDATE
+// This modified verlet integrator advances by dt base steps and calculates the velocity
+// For later use in the simulation. pos - pos_old spans the last step, which may have had another size.
+// With adaptive time stepping pos_old holds the velocity instead (see convertVelocityState())
+// and the pass also finds the largest velocity and force for the next dt.
+static void update( const float dt )
+{
+    PROFILE_PHASE( PHASE_UPDATE );
+
+    const float dt2 = dt * dt;
+    const float velScale = 1.0f / lastTimeStep_;
+    float maxVel2 = 0;
+    float maxForce2 = 0;
+
+    tileScheduler.Begin( ownedCount(), tileScheduling );
+#pragma omp parallel
+    {
+        PROFILE_THREAD( PHASE_UPDATE );
+        float tmaxVel2 = 0;
+        float tmaxForce2 = 0;
+        tileScheduler.Run( (unsigned int)omp_get_thread_num(), [&]( const int begin, const int end )
+        {
+            for( int i = begin; i < end; ++i )
+            {
+                const vecD f = particles.force( i );
+                vecD pos;
+                vecD vel;
+
+                if( velocityState_ )
+                {
+                    // Kick and drift with the velocity of the last step,
+                    // which stays exact when dt * vel is below the float resolution of pos
+                    vel = particles.pos_old( i ) + f * dt;
+                    tmaxVel2 = glm::max( tmaxVel2, glm::dot( vel, vel ) );
+                    tmaxForce2 = glm::max( tmaxForce2, glm::dot( f, f ) );
+                    particles.set_pos_old( i, vel );
+                    pos = particles.pos( i ) + vel * dt;
+                }
+                else
+                {
+                    // Apply the currently accumulated forces
+                    pos = particles.pos( i ) + f * dt2;
+
+                    // Calculate the velocity for later.
+                    vel = ( pos - particles.pos_old( i ) ) * velScale;
+
+                    // If the velocity is really high, we're going to cheat and cap it.
+                    // This will not damp all motion. It's not physically-based at all. Just
+                    // a little bit of a hack.
+                    const float max_vel = 2.0f;
+                    const float vel_mag = glm::dot( vel, vel );
+                    // If the velocity is greater than the max velocity, then cut it in half.
+                    if( vel_mag > max_vel * max_vel )
+                    {
+                        vel *= .5f;
+                    }
+
+                    // Normal verlet stuff
+                    particles.set_pos_old( i, pos );
+                    pos += vel * dt;
+                }
+
+                // Restart the forces with gravity only. We'll add the rest later.
+                vecD force( 0.0f );
+                force.y = -::G;
+
+                // If the Particle is outside the bounds of the world, then
+                // Make a little spring force to push it back in.
+                if( pos.x < -SIM_W ) force.x -= ( pos.x - -SIM_W ) / 8;
+                if( pos.x >  SIM_W ) force.x -= ( pos.x - SIM_W ) / 8;
+                if( pos.y < bottom ) force.y -= ( pos.y - bottom ) / 8;
+                //if( pos.y > SIM_W * 2 ) force.y -= ( pos.y - SIM_W * 2 ) / 8;
+#if SPH_DIMENSION == 3
+                if( pos.z < -SIM_W ) force.z -= ( pos.z - -SIM_W ) / 8;
+                if( pos.z >  SIM_W ) force.z -= ( pos.z - SIM_W ) / 8;
+#endif
+
+                // Handle the mouse attractor.
+                // It's a simple spring based attraction to where the mouse is.
+                const float attr_dist2 = glm::dot( pos - attractor, pos - attractor );
+                const float attr_l = SIM_W / 4;
+                if( attracting )
+                {
+                    if( attr_dist2 < attr_l * attr_l )
+                    {
+                        force -= ( pos - attractor ) / 256.0f;
+                    }
+                }
+
+                particles.set_pos( i, pos );
+                particles.set_vel( i, vel );
+                particles.set_force( i, force );
+
+                // Reset the nessecary items.
+                // (neighbor_count stays, DENSITY sizes the neighbor pool by the last counts)
+                particles.rho( i ) = 0;
+                particles.rho_near( i ) = 0;
+            }
+        } );
+#pragma omp critical
+        {
+            maxVel2 = glm::max( maxVel2, tmaxVel2 );
+            maxForce2 = glm::max( maxForce2, tmaxForce2 );
+        }
+    }
+    tileScheduler.End();
+
+    lastTimeStep_ = dt;
+    time_ += dt;
+    if( adaptiveTimeStep )
+    {
+        // CFL condition: no particle moves more than cflNumber * r per step,
+        // neither by its velocity nor by its acceleration
+        float next = glm::min( maxTimeStep, timeStep_ * maxTimeStepGrowth );
+        if( maxVel2 > 0 )
+        {
+            next = glm::min( next, cflNumber * r / std::sqrt( maxVel2 ) );
+        }
+        if( maxForce2 > 0 )
+        {
+            next = glm::min( next, cflNumber * std::sqrt( r / std::sqrt( maxForce2 ) ) );
+        }
+        timeStep_ = glm::max( next, minTimeStep );
+    }
+}
+
+// --------------------------------------------------------------------
+// SPATIAL INDEX
+static void buildSpatialIndex()
+{
+    PROFILE_PHASE( PHASE_SPATIAL_INDEX );
+
+#if CURRENT_SPATIAL_INDEX == SPATIAL_INDEX_GRID && CURRENT_PAIR_EVALUATION == PAIR_EVALUATION_FULL
+    // Verlet lists: the grid and the candidate lists are only rebuilt
+    // once a particle could have come close to a particle that is not a candidate
+    verletActive_ = verletSkin > 0;
+    const float cellSize = verletActive_ ? r + verletSkin : r;
+    if( cellSize != gridCellSize_ )
+    {
+        indexgrid.SetCellSize( cellSize );
+        gridCellSize_ = cellSize;
+        indexStale_ = true;
+    }
+    if( verletActive_ )
+    {
+        const high_resolution_clock::time_point checkStart = high_resolution_clock::now();
+        const bool rebuildLists = indexStale_ || verletList.MaxDisplacement( particles ) > verletSkin * 0.5f;
+        const high_resolution_clock::time_point buildStart = high_resolution_clock::now();
+        verletStats.checkUs += duration<double, std::micro>( buildStart - checkStart ).count();
+        if( !rebuildLists )
+        {
+            verletStats.reuses++;
+            return;
+        }
+
+        indexStale_ = false;
+        indexgrid.Build( particles );
+        indexStats.rebuilds++;
+        verletList.Build( particles, indexgrid, cellSize );
+        verletStats.builds++;
+        verletStats.buildUs += duration<double, std::micro>( high_resolution_clock::now() - buildStart ).count();
+        return;
+    }
+#endif
+
+    // With the velocity cap of UPDATE only few particles change cells per step,
+    // so the index is kept from the last step and only those are moved
+    const unsigned int maxMovers = (unsigned int)( incrementalIndexLimit * particles.N );
+    const bool rebuild = !incrementalIndex || indexStale_;
+    indexStale_ = false;
+
+#if CURRENT_SPATIAL_INDEX == SPATIAL_INDEX_GRID
+    if( rebuild )
+    {
+        // Rebuild the grid from scratch with all threads,
+        // reusing the memory of the previous step
+        indexgrid.Build( particles );
+        indexStats.rebuilds++;
+        return;
+    }
+    unsigned int movers = 0;
+    if( indexgrid.Update( particles, maxMovers, &movers ) )
+    {
+        indexStats.updates++;
+        indexStats.moved += movers;
+    }
+    else
+    {
+        indexStats.rebuilds++;
+    }
+#else
+    static std::vector<glm::ivec3> cells;
+    static std::vector<glm::ivec3> nextCells;
+    nextCells.resize( particles.N );
+    unsigned int movers = 0;
+    for( unsigned int i = 0; i < particles.N; ++i )
+    {
+        nextCells[i] = indexsp.Cell( toVec3( particles.pos( i ) ) );
+        movers += !rebuild && nextCells[i] != cells[i];
+    }
+
+    if( !rebuild && movers <= maxMovers )
+    {
+        indexStats.updates++;
+        indexStats.moved += movers;
+        for( unsigned int i = 0; i < particles.N && movers; ++i )
+        {
+            if( nextCells[i] != cells[i] )
+            {
+                indexsp.Move( cells[i], nextCells[i], &particles.id( i ) );
+                movers--;
+            }
+        }
+        cells.swap( nextCells );
+        return;
+    }
+
+    // Throw away all previous neighbor information
+    indexsp.Clear();
+
+    // Sequential iteration since the hash map is not thread-safe
+    for (unsigned int i = 0; i < particles.N; ++i)
+    {
+        // Insert includes 
+        // 1. discretization (3x div by grid step),
+        // 2. hash function evaluation (ivec3 to int) and 
+        // 3. list realloc
+        indexsp.Insert( nextCells[i], &particles.id( i ) );
+    }
+    cells.swap( nextCells );
+    indexStats.rebuilds++;
+#endif
+}
+
+// --------------------------------------------------------------------
+// Calls f( id ) for every particle in the search neighborhood of particle i,
+// which may include i itself
+template< typename F >
+static inline void forEachCandidate( const unsigned int i, const vecD& pos_i, F f )
+{
+#if CURRENT_SPATIAL_INDEX == SPATIAL_INDEX_GRID
+    if( verletActive_ )
+    {
+        // Only the candidates of the Verlet list
+        const unsigned int* candidates = verletList.Candidates( i );
+        const unsigned int candidateCount = verletList.CandidateCount( i );
+        for( unsigned int j = 0; j < candidateCount; ++j )
+        {
+            f( candidates[j] );
+        }
+    }
+    else
+    {
+        // Walk the contiguous id ranges of the 3x3 (3x3x3) neighborhood in place
+        UniformGrid::Range ranges[UniformGrid::NeighborRanges];
+        const unsigned int rangeCount = indexgrid.Neighbors( pos_i, ranges );
+        for( unsigned int k = 0; k < rangeCount; ++k )
+        {
+            for( const unsigned int* j = ranges[k].begin; j != ranges[k].end; ++j )
+            {
+                f( *j );
+            }
+        }
+    }
+#else
+    (void)i;
+    std::vector<unsigned int*> neighIds;
+    neighIds.reserve( 64 );
+    indexsp.Neighbors( toVec3( pos_i ), neighIds );
+    for( int j = 0; j < (int)neighIds.size(); ++j )
+    {
+        f( *neighIds[j] );
+    }
+#endif
+}
+
+// --------------------------------------------------------------------
+// DENSITY
+// Calculate the density by basically making a weighted sum
+// of the distances of neighboring particles within the radius of support (r)
+template< class Kernel >
+static void computeDensity()
+{
+    PROFILE_PHASE( PHASE_DENSITY );
+
+    // Support of the kernel, pairs beyond it are no neighbors
+    const float h = Kernel::Support * r;
+    const float hsq = h * h;
+
+    // Kernel terms of the pair of pos_i and particle j as the loops below compute them,
+    // to take back those of the pairs a bounded list dropped. Dropped pairs exert no
+    // force, so they must not add to the density either.
+    auto pairTerms = [&]( const vecD& pos_i, const unsigned int j ) -> KernelTerms
+    {
+        const vecD rij = particles.pos( j ) - pos_i;
+        const float rij_len2 = glm::dot( rij, rij );
+        const float rij_len = sqrt( rij_len2 );
+        return tabulatedKernel ? KernelTable<Kernel>::Instance.Lookup( rij_len / h ) : Kernel::Terms( rij_len / h );
+    };
+
+#if CURRENT_PAIR_EVALUATION == PAIR_EVALUATION_FULL
+    // Every tile (or static chunk) appends to its own segment of the neighbor pool.
+    // The segments are sized from the counts of the last pass, longer lists move to
+    // the spare area of the pool. If that runs out too, the pass is planned again from
+    // its own counts and repeated, which only happens during warm-up and when
+    // neighborhoods get much denser.
+    // Bounded storage never repeats the pass.
+    const bool bounded = beginBoundedNeighbors( ownedCount() );
+    BoundedPassStats boundedPass = {};
+    reserveGatherBuffers( (unsigned int)omp_get_max_threads() );
+    const bool simd = std::is_same<Kernel, LinearKernel>::value && simdISA() != SIMD_SCALAR;
+    for( ;; )
+    {
+        tileScheduler.Begin( ownedCount(), tileScheduling );
+        if( !bounded )
+        {
+            planNeighborUnits();
+        }
+#pragma omp parallel
+        {
+            PROFILE_THREAD( PHASE_DENSITY );
+            const unsigned int t = (unsigned int)omp_get_thread_num();
+
+            Neighbor* const pool = neighborPool.Data();
+            size_t segmentEnd = 0;
+            size_t cursor = 0;
+            GatherBuffer& g = gatherBuffers_[t];
+            BoundedPassStats threadPass = {};
+
+            // The segment of a unit does not depend on the thread that runs it
+            tileScheduler.Run( t, [&]( const int begin, const int end )
+            {
+                const unsigned int unit = tileScheduler.UnitOf( t, begin );
+                if( !bounded )
+                {
+                    cursor = neighborPool.SegmentBegin( unit );
+                    segmentEnd = neighborPool.SegmentEnd( unit );
+                }
+                for( int i = begin; i < end; ++i )
+                {
+                    const vecD pos_i = particles.pos( i );
+                    size_t listBegin = cursor;
+                    size_t count = 0;
+
+                    // We will sum up the 'near' and 'far' densities.
+                    float d = 0;
+                    float dn = 0;
+
+                    auto visit = [&]( const unsigned int id )
+                    {
+                        if( id == (unsigned int)i )
+                        {
+                            // do not calculate an interaction for a Particle with itself!
+                            return;
+                        }
+
+                        // The vector seperating the two particles
+                        const vecD rij = particles.pos( id ) - pos_i;
+
+                        // Along with the squared distance between
+                        const float rij_len2 = glm::dot( rij, rij );
+
+                        // If they're within the radius of support ...
+                        if( rij_len2 < hsq )
+                        {
+                            // Get the actual distance from the squared distance.
+                            float rij_len = sqrt( rij_len2 );
+
+                            // And calculated the weighted distance values
+                            const KernelTerms w = tabulatedKernel ? KernelTable<Kernel>::Instance.Lookup( rij_len / h ) : Kernel::Terms( rij_len / h );
+
+                            d += w.density;
+                            dn += w.nearDensity;
+
+                            // Set up the Neighbor list for faster access later.
+                            Neighbor n;
+                            n.id = id;
+                            n.q = w.force;
+                            n.q2 = w.nearForce;
+                            n.dir = rij_len > 0 ? rij * ( 1 / rij_len ) : vecD( 0 );
+                            if( bounded )
+                            {
+                                boundedPool_.Push( t, i, count, n );
+                            }
+                            else
+                            {
+                                if( cursor == segmentEnd )
+                                {
+                                    neighborPool.Extend( listBegin, cursor, segmentEnd );
+                                }
+                                if( cursor < segmentEnd )
+                                {
+                                    pool[cursor] = n;
+                                }
+                            }
+                            cursor++;
+                            count++;
+                        }
+                    };
+
+                    if( simd )
+                    {
+                        // Gather the candidates into contiguous arrays for the SIMD kernel
+                        unsigned int n = 0;
+                        forEachCandidate( i, pos_i, [&]( const unsigned int id )
+                        {
+                            if( id == (unsigned int)i )
+                            {
+                                return;
+                            }
+                            if( n == g.capacity )
+                            {
+                                g.Grow( n + 1 );
+                            }
+                            const vecD pos_j = particles.pos( id );
+                            g.id[n] = id;
+                            g.x[n] = pos_j.x;
+                            g.y[n] = pos_j.y;
+                            n++;
+                        } );
+                        simdDensity( pos_i.x, pos_i.y, g.x, g.y, n, r, g.q, g.dx, g.dy, &d, &dn );
+
+                        // Keep the ones inside the radius of support
+                        for( unsigned int j = 0; j < n; ++j )
+                        {
+                            if( g.q[j] < 0 )
+                            {
+                                continue;
+                            }
+                            Neighbor nb;
+                            nb.id = g.id[j];
+                            nb.q = g.q[j];
+                            nb.q2 = g.q[j] * g.q[j];
+                            // (the SIMD kernels are 2D only)
+                            nb.dir = vecD( 0 );
+                            if( g.q[j] < 1 )
+                            {
+                                nb.dir.x = g.dx[j];
+                                nb.dir.y = g.dy[j];
+                            }
+                            if( bounded )
+                            {
+                                boundedPool_.Push( t, i, count, nb );
+                            }
+                            else
+                            {
+                                if( cursor == segmentEnd )
+                                {
+                                    neighborPool.Extend( listBegin, cursor, segmentEnd );
+                                }
+                                if( cursor < segmentEnd )
+                                {
+                                    pool[cursor] = nb;
+                                }
+                            }
+                            cursor++;
+                            count++;
+                        }
+                    }
+                    else
+                    {
+                        forEachCandidate( i, pos_i, visit );
+                    }
+
+                    if( bounded )
+                    {
+                        const size_t kept = boundedPool_.Finish( t, i, count );
+                        const Neighbor* dropped = boundedPool_.Dropped( t );
+                        for( size_t j = 0; j < count - kept; ++j )
+                        {
+                            const KernelTerms w = pairTerms( pos_i, dropped[j].id );
+                            d -= w.density;
+                            dn -= w.nearDensity;
+                        }
+                        threadPass.Add( count, kept, neighborStats.slots );
+                        count = kept;
+                    }
+                    else
+                    {
+                        particles.neighbor_offset( i ) = listBegin;
+                    }
+
+                    particles.rho( i ) = d;
+                    particles.rho_near( i ) = dn;
+                    particles.neighbor_count( i ) = count;
+                }
+                if( !bounded )
+                {
+                    neighborPool.Commit( cursor, segmentEnd );
+                }
+            } );
+
+            if( bounded )
+            {
+#pragma omp critical
+                {
+                    boundedPass.Add( threadPass );
+                }
+            }
+        }
+        tileScheduler.End();
+        if( bounded || !neighborPool.Fit() )
+        {
+            break;
+        }
+        neighborStats.repeats++;
+    }
+    endBoundedNeighbors( bounded, ownedCount(), boundedPass );
+
+    // The neighbor counts are the cost estimate of the following phases
+    tileScheduler.Plan( particles );
+#else
+    // Every pair is visited once, from the particle with the lower sorted position,
+    // and its weights are added to both particles. The neighbor lists only
+    // hold this half of the pairs. Cells are processed one color at a time,
+    // so that no two threads ever write to the same particle.
+    // Every cell appends to its own segment of the neighbor pool, sized from
+    // the counts of its particles in the last pass (or in the failed attempt).
+    const bool bounded = beginBoundedNeighbors( particles.N );
+    BoundedPassStats boundedPass = {};
+    for( ;; )
+    {
+        if( !bounded )
+        {
+            const unsigned int cellCount = indexgrid.CellCount();
+            neighborWanted_.resize( cellCount );
+#pragma omp parallel for
+            for( int c = 0; c < (int)cellCount; ++c )
+            {
+                const UniformGrid::Range cell = indexgrid.Cell( c );
+                size_t wanted = 0;
+                for( const unsigned int* slot = cell.begin; slot != cell.end; ++slot )
+                {
+                    wanted += particles.neighbor_count( *slot );
+                }
+                neighborWanted_[c] = wanted;
+            }
+            neighborPool.Plan( cellCount, neighborWanted_.data() );
+        }
+#pragma omp parallel
+        {
+            PROFILE_THREAD( PHASE_DENSITY );
+            const unsigned int t = (unsigned int)omp_get_thread_num();
+
+            // Both sides of a pair accumulate, so start from zero on every attempt
+#pragma omp for
+            for( int i = 0; i < (int)particles.N; ++i )
+            {
+                particles.rho( i ) = 0;
+                particles.rho_near( i ) = 0;
+            }
+
+            Neighbor* const pool = neighborPool.Data();
+            BoundedPassStats threadPass = {};
+
+            for( unsigned int color = 0; color < UniformGrid::Colors; ++color )
+            {
+                const int cells = (int)indexgrid.ColorCellCount( color );
+#pragma omp for schedule(dynamic, 4)
+                for( int cellIdx = 0; cellIdx < cells; ++cellIdx )
+                {
+                    const unsigned int c = indexgrid.ColoredCell( color, cellIdx );
+                    const UniformGrid::Range cell = indexgrid.Cell( c );
+                    size_t cursor = bounded ? 0 : neighborPool.SegmentBegin( c );
+                    size_t segmentEnd = bounded ? 0 : neighborPool.SegmentEnd( c );
+                    for( const unsigned int* slot = cell.begin; slot != cell.end; ++slot )
+                    {
+                        const unsigned int i = *slot;
+                        const vecD pos_i = particles.pos( i );
+                        size_t listBegin = cursor;
+                        size_t count = 0;
+
+                        float d = 0;
+                        float dn = 0;
+
+                        UniformGrid::Range ranges[UniformGrid::HalfNeighborRanges];
+                        const unsigned int rangeCount = indexgrid.HalfNeighbors( c, slot, ranges );
+                        for( unsigned int n = 0; n < rangeCount; ++n )
+                        {
+                            for( const unsigned int* j = ranges[n].begin; j != ranges[n].end; ++j )
+                            {
+                                const vecD rij = particles.pos( *j ) - pos_i;
+                                const float rij_len2 = glm::dot( rij, rij );
+                                if( rij_len2 < hsq )
+                                {
+                                    const float rij_len = sqrt( rij_len2 );
+                                    const KernelTerms w = tabulatedKernel ? KernelTable<Kernel>::Instance.Lookup( rij_len / h ) : Kernel::Terms( rij_len / h );
+
+                                    d += w.density;
+                                    dn += w.nearDensity;
+                                    particles.rho( *j ) += w.density;
+                                    particles.rho_near( *j ) += w.nearDensity;
+
+                                    Neighbor nb;
+                                    nb.id = *j;
+                                    nb.q = w.force;
+                                    nb.q2 = w.nearForce;
+                                    nb.dir = rij_len > 0 ? rij * ( 1 / rij_len ) : vecD( 0 );
+                                    if( bounded )
+                                    {
+                                        boundedPool_.Push( t, i, count, nb );
+                                    }
+                                    else
+                                    {
+                                        if( cursor == segmentEnd )
+                                        {
+                                            neighborPool.Extend( listBegin, cursor, segmentEnd );
+                                        }
+                                        if( cursor < segmentEnd )
+                                        {
+                                            pool[cursor] = nb;
+                                        }
+                                    }
+                                    cursor++;
+                                    count++;
+                                }
+                            }
+                        }
+
+                        if( bounded )
+                        {
+                            // (both sides of a dropped pair added its weights)
+                            const size_t kept = boundedPool_.Finish( t, i, count );
+                            const Neighbor* dropped = boundedPool_.Dropped( t );
+                            for( size_t j = 0; j < count - kept; ++j )
+                            {
+                                const KernelTerms w = pairTerms( pos_i, dropped[j].id );
+                                d -= w.density;
+                                dn -= w.nearDensity;
+                                particles.rho( dropped[j].id ) -= w.density;
+                                particles.rho_near( dropped[j].id ) -= w.nearDensity;
+                            }
+                            threadPass.Add( count, kept, neighborStats.slots );
+                            count = kept;
+                        }
+                        else
+                        {
+                            particles.neighbor_offset( i ) = listBegin;
+                        }
+
+                        particles.rho( i ) += d;
+                        particles.rho_near( i ) += dn;
+                        particles.neighbor_count( i ) = count;
+                    }
+                    if( !bounded )
+                    {
+                        neighborPool.Commit( cursor, segmentEnd );
+                    }
+                }
+            }
+
+            if( bounded )
+            {
+#pragma omp critical
+                {
+                    boundedPass.Add( threadPass );
+                }
+            }
+        }
+        if( bounded || !neighborPool.Fit() )
+        {
+            break;
+        }
+        neighborStats.repeats++;
+    }
+    endBoundedNeighbors( bounded, particles.N, boundedPass );
+#endif
+}
+
+// --------------------------------------------------------------------
+// PRESSURE
+// Make the simple pressure calculation from the equation of state.
+// Compressibility issues come into play here.
+// Approaches:
+// Divergence-free SPH: compute k based on individual neighborhoods
+// PBF: position based constraint equation
+// IISPH: implicit ISPH
+// WCSPH: weakly compressible
+// ISPH: icompressibile by doing "pressure projection"
+static void computePressure()
+{
+    PROFILE_PHASE( PHASE_PRESSURE );
+
+    tileScheduler.Begin( ownedCount(), tileScheduling );
+#pragma omp parallel
+    {
+        PROFILE_THREAD( PHASE_PRESSURE );
+        tileScheduler.Run( (unsigned int)omp_get_thread_num(), [&]( const int begin, const int end )
+        {
+            for( int i = begin; i < end; ++i )
+            {
+                const Material& m = materials[particles.material( i )];
+                particles.press( i ) = m.k * ( particles.rho( i ) - m.rest_density );
+                particles.press_near( i ) = m.k_near * particles.rho_near( i );
+
+    #if CURRENT_PAIR_EVALUATION == PAIR_EVALUATION_SYMMETRIC
+                // The symmetric viscosity pass does not visit particles one by one,
+                // so the debug color is set here, see VISCOSITY
+                const vecD vel_i = particles.vel( i );
+                particles.set_color( i,
+                    0.3f + (20 * fabs(vel_i.x) ),
+                    0.3f + (20 * fabs(vel_i.y) ),
+                    0.3f + (0.1f * particles.rho( i ) ) );
+    #endif
+            }
+        } );
+    }
+    tileScheduler.End();
+
+    // PRESSURE FORCE reads the pressures of the ghosts among the neighbors
+#pragma omp parallel for
+    for( int i = (int)ownedCount(); i < (int)particles.N; ++i )
+    {
+        const Material& m = materials[particles.material( i )];
+        particles.press( i ) = m.k * ( particles.rho( i ) - m.rest_density );
+        particles.press_near( i ) = m.k_near * particles.rho_near( i );
+    }
+}
+
+// --------------------------------------------------------------------
+// PRESSURE FORCE
+// We will force particles in or out from their neighbors
+// based on their difference from the rest density.
+static void applyPressureForce()
+{
+    PROFILE_PHASE( PHASE_PRESSURE_FORCE );
+
+#if CURRENT_PAIR_EVALUATION == PAIR_EVALUATION_FULL
+    reserveGatherBuffers( (unsigned int)omp_get_max_threads() );
+    const bool simd = simdISA() != SIMD_SCALAR;
+    tileScheduler.Begin( ownedCount(), tileScheduling );
+#pragma omp parallel
+    {
+        PROFILE_THREAD( PHASE_PRESSURE_FORCE );
+        GatherBuffer& g = gatherBuffers_[omp_get_thread_num()];
+        tileScheduler.Run( (unsigned int)omp_get_thread_num(), [&]( const int begin, const int end )
+        {
+            for( int i = begin; i < end; ++i )
+            {
+                const float press_i = particles.press( i );
+                const float press_near_i = particles.press_near( i );
+                const Neighbor* neighbors = neighborsOf( i );
+
+                if( simd )
+                {
+                    // Gather the neighbors into contiguous arrays for the SIMD kernel
+                    const unsigned int n = (unsigned int)particles.neighbor_count( i );
+                    if( n > g.capacity )
+                    {
+                        g.Grow( n );
+                    }
+                    for( unsigned int j = 0; j < n; ++j )
+                    {
+                        const Neighbor& n_j = neighbors[j];
+                        g.dx[j] = n_j.dir.x;
+                        g.dy[j] = n_j.dir.y;
+                        g.q[j] = n_j.q;
+                        g.q2[j] = n_j.q2;
+                        g.press[j] = particles.press( n_j.id );
+                        g.press_near[j] = particles.press_near( n_j.id );
+                    }
+                    vecD dX( 0 );
+                    simdPressureForce( press_i, press_near_i, g.dx, g.dy, g.q, g.q2, g.press, g.press_near, n, &dX.x, &dX.y );
+                    particles.set_force( i, particles.force( i ) - dX );
+                    continue;
+                }
+
+                // For each of the neighbors
+                vecD dX( 0 );
+                for( size_t j = 0; j < particles.neighbor_count( i ); j++ )
+                {
+                    const Neighbor& n_j = neighbors[j];
+
+                    // calculate the force from the pressures calculated above
+                    const float dm
+                        = n_j.q * ( press_i + particles.press( n_j.id ) )
+                        + n_j.q2 * ( press_near_i + particles.press_near( n_j.id ) );
+
+                    // Along the direction from Particle i to Particle j
+                    const vecD D = n_j.dir * dm;
+                    dX += D;
+                }
+
+                particles.set_force( i, particles.force( i ) - dX );
+            }
+        } );
+    }
+    tileScheduler.End();
+#else
+    // Each pair pushes both particles apart by the same amount
+#pragma omp parallel
+    {
+        PROFILE_THREAD( PHASE_PRESSURE_FORCE );
+        for( unsigned int color = 0; color < UniformGrid::Colors; ++color )
+        {
+            const int cells = (int)indexgrid.ColorCellCount( color );
+#pragma omp for schedule(dynamic, 4)
+            for( int cellIdx = 0; cellIdx < cells; ++cellIdx )
+            {
+                const UniformGrid::Range cell = indexgrid.Cell( indexgrid.ColoredCell( color, cellIdx ) );
+                for( const unsigned int* slot = cell.begin; slot != cell.end; ++slot )
+                {
+                    const unsigned int i = *slot;
+                    const float press_i = particles.press( i );
+                    const float press_near_i = particles.press_near( i );
+                    const Neighbor* neighbors = neighborsOf( i );
+
+                    vecD dX( 0 );
+                    for( size_t j = 0; j < particles.neighbor_count( i ); j++ )
+                    {
+                        const Neighbor& n_j = neighbors[j];
+                        const float dm
+                            = n_j.q * ( press_i + particles.press( n_j.id ) )
+                            + n_j.q2 * ( press_near_i + particles.press_near( n_j.id ) );
+                        const vecD D = n_j.dir * dm;
+                        dX += D;
+                        particles.set_force( n_j.id, particles.force( n_j.id ) + D );
+                    }
+
+                    particles.set_force( i, particles.force( i ) - dX );
+                }
+            }
+        }
+    }
+#endif
+}
+
+// --------------------------------------------------------------------
+// VISCOSITY
+// This simulation actually may look okay if you don't compute
+// the viscosity section. The effects of numerical damping and
+// surface tension will give a smooth appearance on their own.
+// Try it.
+static void applyViscosity()
+{
+    PROFILE_PHASE( PHASE_VISCOSITY );
+
+#if CURRENT_PAIR_EVALUATION == PAIR_EVALUATION_FULL
+    tileScheduler.Begin( ownedCount(), tileScheduling );
+#pragma omp parallel
+    {
+        PROFILE_THREAD( PHASE_VISCOSITY );
+        tileScheduler.Run( (unsigned int)omp_get_thread_num(), [&]( const int begin, const int end )
+        {
+            for( int i = begin; i < end; ++i )
+            {
+                vecD vel_i = particles.vel( i );
+                const Neighbor* neighbors = neighborsOf( i );
+
+                // We'll let the color be determined by
+                // ... x-velocity for the red component
+                // ... y-velocity for the green-component
+                // ... pressure for the blue component
+                particles.set_color( i,
+                    0.3f + (20 * fabs(vel_i.x) ),
+                    0.3f + (20 * fabs(vel_i.y) ),
+                    0.3f + (0.1f * particles.rho( i ) ) );
+
+                // For each of that particles neighbors
+                for (size_t j = 0; j < particles.neighbor_count( i ); j++)
+                {
+                    const Neighbor& n_j = neighbors[j];
+                    const vecD& rijn = n_j.dir;
+
+                    // Get the projection of the velocities onto the vector between them.
+                    const float u = glm::dot( vel_i - particles.vel( n_j.id ), rijn );
+                    if( u > 0 )
+                    {
+                        // Calculate the viscosity impulse between the two particles
+                        // based on the quadratic function of projected length.
+                        const Material& m_j = materials[particles.material( n_j.id )];
+                        const vecD I
+                            = n_j.q
+                            * ( m_j.sigma * u + m_j.beta * u * u )
+                            * rijn;
+
+                        // Apply the impulses on the current particle
+                        vel_i -= I * 0.5f;
+                    }
+                }
+
+                particles.set_vel( i, vel_i );
+            }
+        } );
+    }
+    tileScheduler.End();
+#else
+    // Both impulses of a pair are applied at once,
+    // each one weighted by the coefficients of the other particle
+#pragma omp parallel
+    {
+        PROFILE_THREAD( PHASE_VISCOSITY );
+        for( unsigned int color = 0; color < UniformGrid::Colors; ++color )
+        {
+            const int cells = (int)indexgrid.ColorCellCount( color );
+#pragma omp for schedule(dynamic, 4)
+            for( int cellIdx = 0; cellIdx < cells; ++cellIdx )
+            {
+                const UniformGrid::Range cell = indexgrid.Cell( indexgrid.ColoredCell( color, cellIdx ) );
+                for( const unsigned int* slot = cell.begin; slot != cell.end; ++slot )
+                {
+                    const unsigned int i = *slot;
+                    const Material& m_i = materials[particles.material( i )];
+                    vecD vel_i = particles.vel( i );
+                    const Neighbor* neighbors = neighborsOf( i );
+
+                    for( size_t j = 0; j < particles.neighbor_count( i ); j++ )
+                    {
+                        const Neighbor& n_j = neighbors[j];
+                        const vecD& rijn = n_j.dir;
+                        const vecD vel_j = particles.vel( n_j.id );
+                        const float u = glm::dot( vel_i - vel_j, rijn );
+                        if( u > 0 )
+                        {
+                            const Material& m_j = materials[particles.material( n_j.id )];
+                            const vecD Ii = n_j.q * ( m_j.sigma * u + m_j.beta * u * u ) * rijn;
+                            const vecD Ij = n_j.q * ( m_i.sigma * u + m_i.beta * u * u ) * rijn;
+                            vel_i -= Ii * 0.5f;
+                            particles.set_vel( n_j.id, vel_j + Ij * 0.5f );
+                        }
+                    }
+
+                    particles.set_vel( i, vel_i );
+                }
+            }
+        }
+    }
+#endif
+}
+
+#if CURRENT_PAIR_EVALUATION == PAIR_EVALUATION_FULL
+// --------------------------------------------------------------------
+// PRESSURE, PRESSURE FORCE and VISCOSITY in one sweep
+// The pressures of the neighbors are computed on the fly from their densities,
+// so there is no barrier between the equation of state and the forces,
+// and every neighbor list is read once for both forces instead of twice.
+// Since the storage is kept in Z-order (see REORDER), the contiguous chunk of
+// every thread is a compact tile of cells, whose neighbors mostly stay in cache.
+// PRESSURE FORCE only writes forces and VISCOSITY only reads positions and velocities,
+// so the result is the same as running the three passes one after another.
+static void applyForcesFused()
+{
+    PROFILE_PHASE( PHASE_FUSED_FORCES );
+
+    tileScheduler.Begin( ownedCount(), tileScheduling );
+#pragma omp parallel
+    {
+        PROFILE_THREAD( PHASE_FUSED_FORCES );
+        tileScheduler.Run( (unsigned int)omp_get_thread_num(), [&]( const int begin, const int end )
+        {
+            for( int i = begin; i < end; ++i )
+            {
+                vecD vel_i = particles.vel( i );
+                const Neighbor* neighbors = neighborsOf( i );
+
+                // PRESSURE
+                const Material& m_i = materials[particles.material( i )];
+                const float press_i = m_i.k * ( particles.rho( i ) - m_i.rest_density );
+                const float press_near_i = m_i.k_near * particles.rho_near( i );
+                particles.press( i ) = press_i;
+                particles.press_near( i ) = press_near_i;
+
+                particles.set_color( i,
+                    0.3f + (20 * fabs(vel_i.x) ),
+                    0.3f + (20 * fabs(vel_i.y) ),
+                    0.3f + (0.1f * particles.rho( i ) ) );
+
+                vecD dX( 0 );
+                for( size_t j = 0; j < particles.neighbor_count( i ); j++ )
+                {
+                    const Neighbor& n_j = neighbors[j];
+                    const vecD& rijn = n_j.dir;
+
+                    // PRESSURE FORCE
+                    const Material& m_j = materials[particles.material( n_j.id )];
+                    const float press_j = m_j.k * ( particles.rho( n_j.id ) - m_j.rest_density );
+                    const float press_near_j = m_j.k_near * particles.rho_near( n_j.id );
+                    const float dm
+                        = n_j.q * ( press_i + press_j )
+                        + n_j.q2 * ( press_near_i + press_near_j );
+                    dX += rijn * dm;
+
+                    // VISCOSITY
+                    const float u = glm::dot( vel_i - particles.vel( n_j.id ), rijn );
+                    if( u > 0 )
+                    {
+                        const vecD I
+                            = n_j.q
+                            * ( m_j.sigma * u + m_j.beta * u * u )
+                            * rijn;
+                        vel_i -= I * 0.5f;
+                    }
+                }
+
+                particles.set_force( i, particles.force( i ) - dX );
+                particles.set_vel( i, vel_i );
+            }
+        } );
+    }
+    tileScheduler.End();
+}
+#endif
+
+#if CURRENT_PAIR_EVALUATION == PAIR_EVALUATION_FULL
+// --------------------------------------------------------------------
+// CONSTRAINTS
+// Position Based Fluids, Macklin and Mueller 2013.
+// Instead of turning the density of DENSITY into forces for the next step,
+// the positions predicted by UPDATE are moved until the particles are back at
+// the rest density. Every iteration takes one Jacobi step on all density constraints
+//   C_i = rho_i / rest_density_i - 1
+// with the rest density of the material of i, over the neighbor lists of DENSITY, only the distances and directions are recomputed from
+// the moved positions. Constraints only push apart (C_i >= 0), so the free surface does not clump.
+// The densities use the kernel of DENSITY, W = q^2 with q = 1 - |rij| / r for the linear one, so
+//   grad_i W_ij = 2 q / r * rij / |rij|
+// and the force weight of kernels.h in place of q for the others.
+// The first iteration takes the density of DENSITY and q and the direction from the neighbor records.
+// pos_old holds the velocities (see convertVelocityState()), every correction
+// is added to them divided by dt, which makes them the velocities of the corrected step.
+
+// Lambda of every owned particle into press(), from the neighbor weights of DENSITY
+// in the first iteration, while the positions are still the ones DENSITY saw.
+// Returns the sum of the constraints C_i.
+template< class Kernel >
+static float pbfLambda( const bool moved )
+{
+    const float h = Kernel::Support * r;
+    const float hsq = h * h;
+    float error = 0;
+    tileScheduler.Begin( ownedCount(), tileScheduling );
+#pragma omp parallel
+    {
+        PROFILE_THREAD( PHASE_CONSTRAINTS );
+        float localError = 0;
+        tileScheduler.Run( (unsigned int)omp_get_thread_num(), [&]( const int begin, const int end )
+        {
+            for( int i = begin; i < end; ++i )
+            {
+                const vecD pos_i = particles.pos( i );
+                const Neighbor* neighbors = neighborsOf( i );
+
+                // Density and the gradients of C_i by particle i and by each neighbor
+                float rho = moved ? 0 : particles.rho( i );
+                vecD grad_i( 0 );
+                float grad2 = 0;
+                for( size_t j = 0; j < particles.neighbor_count( i ); j++ )
+                {
+                    const Neighbor& n_j = neighbors[j];
+                    float q = n_j.q;
+                    vecD dir = n_j.dir;
+                    if( moved )
+                    {
+                        const vecD rij = particles.pos( n_j.id ) - pos_i;
+                        const float rij_len2 = glm::dot( rij, rij );
+                        if( rij_len2 >= hsq || rij_len2 == 0 )
+                        {
+                            continue;
+                        }
+                        const float l = sqrt( rij_len2 );
+                        const KernelTerms w = Kernel::Terms( l / h );
+                        rho += w.density;
+                        q = w.force;
+                        dir = rij * ( 1 / l );
+                    }
+                    const vecD grad = dir * ( 2 * q / r );
+                    grad_i += grad;
+                    grad2 += glm::dot( grad, grad );
+                }
+
+                const float rest_i = materials[particles.material( i )].rest_density;
+                const float C = glm::max( rho / rest_i - 1, 0.0f );
+                particles.press( i ) = -C / ( ( glm::dot( grad_i, grad_i ) + grad2 ) * ( 1.0f / ( rest_i * rest_i ) ) + pbfRelaxation );
+                localError += C;
+            }
+        } );
+#pragma omp critical
+        error += localError;
+    }
+    tileScheduler.End();
+    return error;
+}
+
+// Position correction of every owned particle from the lambdas, into vel()
+template< class Kernel >
+static void pbfCorrection()
+{
+    const float h = Kernel::Support * r;
+    const float hsq = h * h;
+    tileScheduler.Begin( ownedCount(), tileScheduling );
+#pragma omp parallel
+    {
+        PROFILE_THREAD( PHASE_CONSTRAINTS );
+        tileScheduler.Run( (unsigned int)omp_get_thread_num(), [&]( const int begin, const int end )
+        {
+            for( int i = begin; i < end; ++i )
+            {
+                const vecD pos_i = particles.pos( i );
+                const float lambda_i = particles.press( i );
+                const float invRest = 1.0f / materials[particles.material( i )].rest_density;
+                const Neighbor* neighbors = neighborsOf( i );
+
+                vecD dX( 0 );
+                for( size_t j = 0; j < particles.neighbor_count( i ); j++ )
+                {
+                    const Neighbor& n_j = neighbors[j];
+                    const vecD rij = particles.pos( n_j.id ) - pos_i;
+                    const float rij_len2 = glm::dot( rij, rij );
+                    if( rij_len2 >= hsq || rij_len2 == 0 )
+                    {
+                        continue;
+                    }
+                    const float l = sqrt( rij_len2 );
+                    const float q = Kernel::Terms( l / h ).force;
+                    dX += rij * ( ( lambda_i + particles.press( n_j.id ) ) * 2 * q / ( r * l ) );
+                }
+                particles.set_vel( i, dX * invRest );
+            }
+        } );
+    }
+    tileScheduler.End();
+}
+
+// XSPH viscosity of SOLVER_PBF and SOLVER_DFSPH,
+// blends the velocities in pos_old and sets the debug color
+template< class Kernel >
+static void applyXSPH()
+{
+    PROFILE_PHASE( PHASE_VISCOSITY );
+
+    const float h = Kernel::Support * r;
+    const float hsq = h * h;
+
+    tileScheduler.Begin( ownedCount(), tileScheduling );
+#pragma omp parallel
+    {
+        PROFILE_THREAD( PHASE_VISCOSITY );
+        tileScheduler.Run( (unsigned int)omp_get_thread_num(), [&]( const int begin, const int end )
+        {
+            for( int i = begin; i < end; ++i )
+            {
+                const vecD pos_i = particles.pos( i );
+                const vecD vel_i = particles.pos_old( i );
+                const Neighbor* neighbors = neighborsOf( i );
+
+                vecD dv( 0 );
+                for( size_t j = 0; j < particles.neighbor_count( i ); j++ )
+                {
+                    const Neighbor& n_j = neighbors[j];
+                    const vecD rij = particles.pos( n_j.id ) - pos_i;
+                    const float rij_len2 = glm::dot( rij, rij );
+                    if( rij_len2 < hsq )
+                    {
+                        dv += ( particles.pos_old( n_j.id ) - vel_i ) * Kernel::Terms( sqrt( rij_len2 ) / h ).density;
+                    }
+                }
+
+                const vecD vel = vel_i + dv * xsphViscosity;
+                particles.set_vel( i, vel );
+                particles.set_color( i,
+                    0.3f + (20 * fabs(vel.x) ),
+                    0.3f + (20 * fabs(vel.y) ),
+                    0.3f + (0.1f * particles.rho( i ) ) );
+            }
+        } );
+    }
+    tileScheduler.End();
+
+#pragma omp parallel for
+    for( int i = 0; i < (int)ownedCount(); ++i )
+    {
+        particles.set_pos_old( i, particles.vel( i ) );
+    }
+}
+
+#endif
+
+// --------------------------------------------------------------------
+// The passes that evaluate the kernel from the positions,
+// instantiated for every kernel of kernels.h
+struct KernelPasses
+{
+    const char* name;
+    void (*density)();
+    float (*pbfLambda)( const bool moved );
+    void (*pbfCorrection)();
+    void (*xsph)();
+};
+
+#if CURRENT_PAIR_EVALUATION == PAIR_EVALUATION_FULL
+#define KERNEL_PASSES( name, Kernel ) { name, computeDensity<Kernel>, pbfLambda<Kernel>, pbfCorrection<Kernel>, applyXSPH<Kernel> }
+#else
+#define KERNEL_PASSES( name, Kernel ) { name, computeDensity<Kernel>, 0, 0, 0 }
+#endif
+
+static const KernelPasses kernelPasses_[KERNEL_COUNT] = {
+    KERNEL_PASSES( "linear", LinearKernel ),
+    KERNEL_PASSES( "poly6", Poly6Kernel ),
+    KERNEL_PASSES( "spiky", SpikyKernel ),
+    KERNEL_PASSES( "cubic-spline", CubicSplineKernel ),
+    KERNEL_PASSES( "wendland-c2", WendlandC2Kernel ),
+};
+
+#undef KERNEL_PASSES
+
+bool setKernel( const int kernel )
+{
+    if( kernel < 0 || kernel >= KERNEL_COUNT )
+    {
+        return false;
+    }
+    kernel_ = kernel;
+    return true;
+}
+
+int kernel()
+{
+    return kernel_;
+}
+
+const char* kernelName( const int kernel )
+{
+    return kernel >= 0 && kernel < KERNEL_COUNT ? kernelPasses_[kernel].name : "?";
+}
+
+#if CURRENT_PAIR_EVALUATION == PAIR_EVALUATION_FULL
+// Projects a position into the walls of the world, which are constraints like the densities
+static inline vecD pbfCollide( vecD pos )
+{
+    pos.x = glm::clamp( pos.x, -SIM_W, SIM_W );
+    pos.y = glm::max( pos.y, bottom );
+#if SPH_DIMENSION == 3
+    pos.z = glm::clamp( pos.z, -SIM_W, SIM_W );
+#endif
+    return pos;
+}
+
+static void solvePBF( const float dt )
+{
+    const KernelPasses& passes = kernelPasses_[kernel_];
+    SolverProfile profile = SolverProfile();
+    {
+        PROFILE_PHASE( PHASE_CONSTRAINTS );
+        const float invDt = 1.0f / dt;
+        for( unsigned int it = 0; it < pbfIterations; ++it )
+        {
+            profile.densityError = passes.pbfLambda( it > 0 ) / glm::max( (float)ownedCount(), 1.0f );
+            profile.iterations++;
+            passes.pbfCorrection();
+#pragma omp parallel for
+            for( int i = 0; i < (int)ownedCount(); ++i )
+            {
+                const vecD pos = particles.pos( i );
+                const vecD dX = pbfCollide( pos + particles.vel( i ) ) - pos;
+                particles.set_pos( i, pos + dX );
+                particles.set_pos_old( i, particles.pos_old( i ) + dX * invDt );
+            }
+        }
+    }
+    passes.xsph();
+    PROFILE_SOLVER( profile );
+}
+
+// --------------------------------------------------------------------
+// DIVERGENCE and PRESSURE of SOLVER_DFSPH
+// Divergence-free SPH, Bender and Koschier 2015.
+// Two solvers correct the velocities in pos_old (see convertVelocityState()) with
+// pressures found by Jacobi iterations over the neighbor lists of DENSITY:
+// DIVERGENCE removes the rate of compression of the velocities UPDATE moved the particles
+// with, PRESSURE removes the compression these velocities, plus the forces the next UPDATE
+// adds, would cause over the next step. Positions do not change in between, so every
+// iteration reuses the neighbor records of DENSITY for the kernel gradients:
+//   grad_i W_ij = 2 q / r * rij / |rij|
+// Every iteration accumulates the compression e_i predicted over a step dt as p_i += e_i / dt^2
+// into press() (PRESSURE) or press_near() (DIVERGENCE), and the velocities become
+//   v_i = v_i' - dt sum_j ( k_i + k_j ) grad_i W_ij
+//   k_i = p_i a_i, a_i = 1 / ( |sum_j grad_i W_ij|^2 + sum_j |grad_i W_ij|^2 )
+// from the velocities v_i' before the solver.
+// p persists between steps. With dfsphWarmStart, particles that the velocities v' still
+// compress start from half of their last p, the others from 0, so a correction that already
+// worked is not applied twice. Keeping p instead of k scales the warm start by the factor a_i
+// of the new neighborhood, which is huge for particles with few neighbors.
+
+// Particles with fewer neighbors get no divergence pressure, as in the paper. In sparse spray
+// the Jacobi iterations overshoot and eject particles at large time steps.
+static const size_t dfsphMinNeighbors_ = SPH_DIMENSION == 3 ? 20 : 8;
+
+// (DENSITY leaves a zero direction for particles at the same position)
+static inline vecD dfsphGradient( const Neighbor& n )
+{
+    return n.dir * ( 2 * n.q / r );
+}
+
+// Factor a_i of every owned particle into rho_near(), resets p without a warm start
+static void dfsphFactors( const bool warmStart )
+{
+    tileScheduler.Begin( ownedCount(), tileScheduling );
+#pragma omp parallel
+    {
+        PROFILE_THREAD( PHASE_DIVERGENCE );
+        tileScheduler.Run( (unsigned int)omp_get_thread_num(), [&]( const int begin, const int end )
+        {
+            for( int i = begin; i < end; ++i )
+            {
+                const Neighbor* neighbors = neighborsOf( i );
+
+                vecD grad_i( 0 );
+                float grad2 = 0;
+                for( size_t j = 0; j < particles.neighbor_count( i ); j++ )
+                {
+                    const Neighbor& n_j = neighbors[j];
+                    const vecD grad = dfsphGradient( n_j );
+                    grad_i += grad;
+                    grad2 += glm::dot( grad, grad );
+                }
+
+                const float denominator = glm::dot( grad_i, grad_i ) + grad2;
+                particles.rho_near( i ) = denominator > 1e-6f ? 1.0f / denominator : 0.0f;
+                if( !warmStart )
+                {
+                    particles.press( i ) = 0;
+                    particles.press_near( i ) = 0;
+                }
+            }
+        } );
+    }
+    tileScheduler.End();
+}
+
+// Velocities of every owned particle into vel(), from the velocities before the solver
+// in pos_old (plus the forces of the next UPDATE for PRESSURE) and, if pressures is set, p
+static void dfsphVelocities( const bool divergence, const float dt, const bool pressures )
+{
+    tileScheduler.Begin( ownedCount(), tileScheduling );
+#pragma omp parallel
+    {
+        PROFILE_THREAD( divergence ? PHASE_DIVERGENCE : PHASE_PRESSURE );
+        tileScheduler.Run( (unsigned int)omp_get_thread_num(), [&]( const int begin, const int end )
+        {
+            for( int i = begin; i < end; ++i )
+            {
+                vecD vel = particles.pos_old( i );
+                if( !divergence )
+                {
+                    vel += particles.force( i ) * dt;
+                }
+                if( pressures )
+                {
+                    const float k_i = ( divergence ? particles.press_near( i ) : particles.press( i ) ) * particles.rho_near( i );
+                    const Neighbor* neighbors = neighborsOf( i );
+
+                    vecD dv( 0 );
+                    for( size_t j = 0; j < particles.neighbor_count( i ); j++ )
+                    {
+                        const Neighbor& n_j = neighbors[j];
+                        const float k_j = ( divergence ? particles.press_near( n_j.id ) : particles.press( n_j.id ) ) * particles.rho_near( n_j.id );
+                        dv += dfsphGradient( n_j ) * ( k_i + k_j );
+                    }
+                    vel -= dv * dt;
+                }
+                particles.set_vel( i, vel );
+            }
+        } );
+    }
+    tileScheduler.End();
+}
+
+// One iteration: adds the compression the velocities in vel() predict over dt to p
+// in press_near() (DIVERGENCE) or press() (PRESSURE). The warm start instead keeps
+// half of p where there is compression and clears it elsewhere.
+// Returns the summed compression relative to the rest density of each particle.
+static float dfsphPressures( const bool divergence, const float dt, const bool warmStart )
+{
+    const float invDt2 = 1.0f / ( dt * dt );
+    float error = 0;
+    tileScheduler.Begin( ownedCount(), tileScheduling );
+#pragma omp parallel
+    {
+        PROFILE_THREAD( divergence ? PHASE_DIVERGENCE : PHASE_PRESSURE );
+        float localError = 0;
+        tileScheduler.Run( (unsigned int)omp_get_thread_num(), [&]( const int begin, const int end )
+        {
+            for( int i = begin; i < end; ++i )
+            {
+                const vecD vel_i = particles.vel( i );
+                const Neighbor* neighbors = neighborsOf( i );
+
+                float change = 0;
+                for( size_t j = 0; j < particles.neighbor_count( i ); j++ )
+                {
+                    const Neighbor& n_j = neighbors[j];
+                    change += glm::dot( vel_i - particles.vel( n_j.id ), dfsphGradient( n_j ) );
+                }
+
+                // Only compression, the free surface is below rest density
+                const float rest_i = materials[particles.material( i )].rest_density;
+                float compression = glm::max( ( divergence ? 0.0f : particles.rho( i ) - rest_i ) + change * dt, 0.0f );
+                if( divergence && particles.neighbor_count( i ) < dfsphMinNeighbors_ )
+                {
+                    compression = 0;
+                }
+                float& p = divergence ? particles.press_near( i ) : particles.press( i );
+                if( warmStart )
+                {
+                    p = compression > 0 ? p * 0.5f : 0.0f;
+                }
+                else
+                {
+                    p += compression * invDt2;
+                }
+                localError += compression / rest_i;
+            }
+        } );
+#pragma omp critical
+        error += localError;
+    }
+    tileScheduler.End();
+    return error;
+}
+
+// Iterates until the mean compression is at most tolerance, leaves the velocities in vel().
+// Returns the number of iterations and their last mean compression relative to the rest densities.
+static unsigned int dfsphSolve( const bool divergence, const float dt, const bool warmStart, const float tolerance, float& error )
+{
+    if( warmStart )
+    {
+        dfsphVelocities( divergence, dt, false );
+        dfsphPressures( divergence, dt, true );
+    }
+    dfsphVelocities( divergence, dt, warmStart );
+
+    const float scale = 1.0f / glm::max( (float)ownedCount(), 1.0f );
+    unsigned int iterations = 0;
+    while( iterations < dfsphMaxIterations )
+    {
+        error = dfsphPressures( divergence, dt, false ) * scale;
+        iterations++;
+        dfsphVelocities( divergence, dt, true );
+        if( error <= tolerance )
+        {
+            break;
+        }
+    }
+    return iterations;
+}
+
+static void solveDFSPH( const float dt )
+{
+    SolverProfile profile = SolverProfile();
+    const bool warmStart = dfsphWarmStart && dfsphPressures_;
+    {
+        PROFILE_PHASE( PHASE_DIVERGENCE );
+        dfsphFactors( warmStart );
+        profile.divergenceIterations = dfsphSolve( true, dt, warmStart, dfsphDivergenceTolerance, profile.divergenceError );
+#pragma omp parallel for
+        for( int i = 0; i < (int)ownedCount(); ++i )
+        {
+            particles.set_pos_old( i, particles.vel( i ) );
+        }
+    }
+    kernelPasses_[kernel_].xsph();
+    {
+        PROFILE_PHASE( PHASE_PRESSURE );
+        // The next step, unless advance() shortens it
+        const float next = adaptiveTimeStep ? timeStep_ : fixedTimeStep;
+        profile.iterations = dfsphSolve( false, next, warmStart, dfsphDensityTolerance, profile.densityError );
+
+        // The next UPDATE adds the forces again
+#pragma omp parallel for
+        for( int i = 0; i < (int)ownedCount(); ++i )
+        {
+            particles.set_pos_old( i, particles.vel( i ) - particles.force( i ) * next );
+        }
+    }
+    dfsphPressures_ = true;
+    PROFILE_SOLVER( profile );
+}
+#endif
+
+// --------------------------------------------------------------------
+// PRESSURE, PRESSURE FORCE and VISCOSITY of SOLVER_DOUBLE_DENSITY
+static void solveDoubleDensity( const float dt )
+{
+    (void)dt;
+#if CURRENT_PAIR_EVALUATION == PAIR_EVALUATION_FULL
+    if( fusePasses && simdISA() == SIMD_SCALAR )
+    {
+        applyForcesFused();
+    }
+    else
+#endif
+    {
+        computePressure();
+        applyPressureForce();
+        applyViscosity();
+    }
+}
+
+// --------------------------------------------------------------------
+// The pressure solvers run after DENSITY and leave either forces
+// for the next UPDATE or corrected positions and velocities
+struct Solver
+{
+    const char* name;
+    bool velocities;                    // needs velocities in pos_old, see convertVelocityState()
+    void (*solve)( const float dt );
+};
+
+static const Solver solvers_[SOLVER_COUNT] = {
+    { "double-density", false, solveDoubleDensity },
+#if CURRENT_PAIR_EVALUATION == PAIR_EVALUATION_FULL
+    { "pbf", true, solvePBF },
+    { "dfsph", true, solveDFSPH },
+#else
+    { "pbf", true, 0 },
+    { "dfsph", true, 0 },
+#endif
+};
+
+bool setSolver( const int solver )
+{
+    if( solver < 0 || solver >= SOLVER_COUNT || !solvers_[solver].solve )
+    {
+        return false;
+    }
+    if( solver != solver_ )
+    {
+        dfsphPressures_ = false;
+    }
+    solver_ = solver;
+    return true;
+}
+
+int solver()
+{
+    return solver_;
+}
+
+const char* solverName( const int solver )
+{
+    return solver >= 0 && solver < SOLVER_COUNT ? solvers_[solver].name : "?";
+}
+
+// --------------------------------------------------------------------
+// Switches pos_old of the owned particles between old positions and velocities
+static void convertVelocityState()
+{
+    const float dt = lastTimeStep_;
+    const bool velocities = !velocityState_;
+#pragma omp parallel for
+    for( int i = 0; i < (int)ownedCount(); ++i )
+    {
+        const vecD pos = particles.pos( i );
+        particles.set_pos_old( i, velocities ? ( pos - particles.pos_old( i ) ) / dt : pos - particles.pos_old( i ) * dt );
+    }
+    velocityState_ = velocities;
+}
+
+// --------------------------------------------------------------------
+void step()
+{
+	high_resolution_clock::time_point start = high_resolution_clock::now();
+    PROFILE_STEP( stepCount_ );
+
+    // REORDER
+    // Keep neighbors close in memory as the fluid mixes
+    if( reorderInterval && stepCount_ % reorderInterval == 0 )
+    {
+        PROFILE_PHASE( PHASE_REORDER );
+        reorderParticles();
+    }
+    stepCount_++;
+
+    const Solver& solver = solvers_[solver_];
+    if( velocityState_ != ( adaptiveTimeStep || solver.velocities ) )
+    {
+        convertVelocityState();
+    }
+    const float dt = glm::min( adaptiveTimeStep ? timeStep_ : fixedTimeStep, timeStepLimit_ );
+    update( dt );
+    if( afterUpdateHook )
+    {
+        afterUpdateHook();
+    }
+    buildSpatialIndex();
+    kernelPasses_[kernel_].density();
+    if( afterDensityHook )
+    {
+        afterDensityHook();
+    }
+    solver.solve( dt );
+
+	stepTime_ = high_resolution_clock::now() - start;
+}
+
+// --------------------------------------------------------------------
+unsigned int advance( const float time )
+{
+    unsigned int steps = 0;
+    double remaining = time;
+    while( remaining > 1e-6 * time )
+    {
+        // (the controller keeps its proposal, a shortened step does not slow down the next ones)
+        timeStepLimit_ = (float)remaining;
+        step();
+        remaining -= lastTimeStep_;
+        steps++;
+    }
+    timeStepLimit_ = FLT_MAX;
+    return steps;
+}
+
+// --------------------------------------------------------------------
+TimeStepState timeStepState()
+{
+    TimeStepState state;
+    state.lastStep = lastTimeStep_;
+    state.nextStep = timeStep_;
+    state.time = time_;
+    state.velocities = velocityState_;
+    return state;
+}
+
+void setTimeStepState( const TimeStepState& state )
+{
+    lastTimeStep_ = state.lastStep;
+    timeStep_ = state.nextStep;
+    time_ = state.time;
+    velocityState_ = state.velocities;
+}
+
+// --------------------------------------------------------------------
+void particlesChanged()
+{
+    indexStale_ = true;
+}
+
+// --------------------------------------------------------------------
+unsigned int stepCount()
+{
+    return stepCount_;
+}
+
+void setStepCount( const unsigned int steps )
+{
+    stepCount_ = steps;
+}
+
@@ -0,0 +1,331 @@
+// Real-Time Physics Tutorials
+// Brandon Pelfrey
+// SPH Fluid Simulation
+
+// Headless benchmark of the per-frame vertex upload of the demo.
+// Renders the particle positions as points into an offscreen EGL surface,
+// e.g. with Mesa llvmpipe, once with glBufferData per frame
+// and once streamed through persistently mapped memory (gl-stream.h).
+//
+// Usage: sph-stream-bench [options]
+//   --particles 10000,100000  particle counts
+//   --frames 600              measured frames per run
+//   --simulate                step the simulation every frame, otherwise the same positions are uploaded
+
+#include <sph.h>
+#include <gl-stream.h>
+
+#include <glad/glad.h>
+#include <EGL/egl.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// --------------------------------------------------------------------
+// EGL_MESA_platform_surfaceless, needs no X server or GPU device
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+typedef EGLDisplay (*GetPlatformDisplayProc)( EGLenum platform, void* nativeDisplay, const EGLint* attribs );
+
+static const int WIDTH = 512;
+static const int HEIGHT = 512;
+
+// --------------------------------------------------------------------
+static bool createContext()
+{
+    EGLDisplay display = EGL_NO_DISPLAY;
+    const char* extensions = eglQueryString( EGL_NO_DISPLAY, EGL_EXTENSIONS );
+    GetPlatformDisplayProc getPlatformDisplay = (GetPlatformDisplayProc)eglGetProcAddress( "eglGetPlatformDisplayEXT" );
+    if( extensions && strstr( extensions, "EGL_MESA_platform_surfaceless" ) && getPlatformDisplay )
+    {
+        display = getPlatformDisplay( EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, 0 );
+    }
+    if( display == EGL_NO_DISPLAY )
+    {
+        display = eglGetDisplay( EGL_DEFAULT_DISPLAY );
+    }
+    EGLint major, minor;
+    if( display == EGL_NO_DISPLAY || !eglInitialize( display, &major, &minor ) )
+    {
+        std::cerr << "No EGL display" << std::endl;
+        return false;
+    }
+
+    const EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+        EGL_NONE };
+    EGLConfig config;
+    EGLint configCount = 0;
+    if( !eglChooseConfig( display, configAttribs, &config, 1, &configCount ) || configCount == 0 )
+    {
+        std::cerr << "No EGL config with pbuffers and OpenGL" << std::endl;
+        return false;
+    }
+
+    eglBindAPI( EGL_OPENGL_API );
+    const EGLint contextAttribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE };
+    EGLContext context = eglCreateContext( display, config, EGL_NO_CONTEXT, contextAttribs );
+    const EGLint surfaceAttribs[] = { EGL_WIDTH, WIDTH, EGL_HEIGHT, HEIGHT, EGL_NONE };
+    EGLSurface surface = eglCreatePbufferSurface( display, config, surfaceAttribs );
+    if( context == EGL_NO_CONTEXT || surface == EGL_NO_SURFACE || !eglMakeCurrent( display, surface, surface, context ) )
+    {
+        std::cerr << "Could not create an OpenGL 3.3 context" << std::endl;
+        return false;
+    }
+    if( !gladLoadGLLoader( (GLADloadproc)eglGetProcAddress ) )
+    {
+        std::cerr << "Could not load OpenGL functions" << std::endl;
+        return false;
+    }
+    std::cout << "Renderer: " << glGetString( GL_RENDERER ) << ", " << glGetString( GL_VERSION ) << std::endl;
+    return true;
+}
+
+// --------------------------------------------------------------------
+static GLuint compileShader( const GLenum type, const char* src )
+{
+    const GLuint shader = glCreateShader( type );
+    glShaderSource( shader, 1, &src, 0 );
+    glCompileShader( shader );
+    return shader;
+}
+
+// --------------------------------------------------------------------
+// Points colored by the neighborhood mark, like the first view of the demo
+static GLuint createProgram()
+{
+    const GLuint vs = compileShader( GL_VERTEX_SHADER,
+        "#version 330\n"
+        "layout(location=0) in vec3 v;\n"
+        "out float a;\n"
+        "void main() { a = v.z; gl_Position = vec4(v.x / 50.0, v.y / 50.0 - 1.0, 0, 1); gl_PointSize = 4.0; }\n" );
+    const GLuint fs = compileShader( GL_FRAGMENT_SHADER,
+        "#version 330\n"
+        "in float a;\n"
+        "out vec4 color;\n"
+        "void main() { color = vec4(1, a, a, 1); }\n" );
+    const GLuint program = glCreateProgram();
+    glAttachShader( program, vs );
+    glAttachShader( program, fs );
+    glLinkProgram( program );
+    glDeleteShader( vs );
+    glDeleteShader( fs );
+    return program;
+}
+
+// --------------------------------------------------------------------
+struct UploadResult
+{
+    double uploadMean, uploadP50, uploadP99; // microseconds per frame spent handing the vertices to GL
+    double waitMean;                         // of which waiting for fences
+    double frameMean;                        // microseconds per frame including drawing
+};
+
+// --------------------------------------------------------------------
+// Nearest-rank percentile of sorted samples
+static double percentile( const std::vector<double>& sorted, const double p )
+{
+    if( sorted.empty() )
+    {
+        return 0;
+    }
+    size_t i = (size_t)( p / 100.0 * sorted.size() );
+    return sorted[std::min( i, sorted.size() - 1 )];
+}
+
+// --------------------------------------------------------------------
+static UploadResult run( const unsigned int count, const unsigned int frames, const bool simulate, const bool stream )
+{
+    srand( 1 );
+    init( count );
+    const size_t bytes = particles.N * sizeof( Particles::Position );
+
+    GLuint vao = 0;
+    glGenVertexArrays( 1, &vao );
+    glBindVertexArray( vao );
+
+    GLVertexStream vertexStream;
+    GLuint vbo = 0;
+    if( stream )
+    {
+        createGLVertexStream( bytes, &vertexStream );
+        vbo = vertexStream.vbo;
+    }
+    else
+    {
+        glGenBuffers( 1, &vbo );
+    }
+    glBindBuffer( GL_ARRAY_BUFFER, vbo );
+    if( !stream )
+    {
+        glBufferData( GL_ARRAY_BUFFER, bytes, particles.vertices(), GL_STATIC_DRAW );
+    }
+    glVertexAttribPointer( 0, 3, GL_FLOAT, GL_FALSE, sizeof( Particles::Position ), 0 );
+    glEnableVertexAttribArray( 0 );
+
+    std::vector<double> uploads;
+    uploads.reserve( frames );
+    double waitSum = 0;
+    double simulateUs = 0;
+
+    glFinish();
+    const auto beg = std::chrono::high_resolution_clock::now();
+    for( unsigned int f = 0; f < frames; ++f )
+    {
+        if( simulate )
+        {
+            const auto s = std::chrono::high_resolution_clock::now();
+            step();
+            simulateUs += std::chrono::duration<double, std::micro>( std::chrono::high_resolution_clock::now() - s ).count();
+        }
+
+        // The same calls as updateGLVertexData in gl-windows.cpp
+        const auto u = std::chrono::high_resolution_clock::now();
+        GLint first = 0;
+        if( stream )
+        {
+            memcpy( nextGLVertexStreamRegion( &vertexStream ), particles.vertices(), bytes );
+            first = (GLint)( currentGLVertexStreamOffset( &vertexStream ) / sizeof( Particles::Position ) );
+            waitSum += vertexStream.waitMs * 1000;
+        }
+        else
+        {
+            glBufferData( GL_ARRAY_BUFFER, bytes, particles.vertices(), GL_DYNAMIC_DRAW );
+        }
+        uploads.push_back( std::chrono::duration<double, std::micro>( std::chrono::high_resolution_clock::now() - u ).count() );
+
+        glClear( GL_COLOR_BUFFER_BIT );
+        glDrawArrays( GL_POINTS, first, (GLsizei)particles.N );
+        if( stream )
+        {
+            fenceGLVertexStreamRegion( &vertexStream );
+        }
+        // (a pbuffer has no back buffer to swap, flush like a swap would)
+        glFlush();
+    }
+    glFinish();
+    const auto end = std::chrono::high_resolution_clock::now();
+
+    UploadResult res;
+    double sum = 0;
+    for( const double u : uploads ) sum += u;
+    res.uploadMean = sum / frames;
+    res.waitMean = waitSum / frames;
+    res.frameMean = ( std::chrono::duration<double, std::micro>( end - beg ).count() - simulateUs ) / frames;
+    std::sort( uploads.begin(), uploads.end() );
+    res.uploadP50 = percentile( uploads, 50 );
+    res.uploadP99 = percentile( uploads, 99 );
+
+    if( stream )
+    {
+        deleteGLVertexStream( &vertexStream );
+    }
+    else
+    {
+        glDeleteBuffers( 1, &vbo );
+    }
+    glBindVertexArray( 0 );
+    glDeleteVertexArrays( 1, &vao );
+    shutdown();
+    return res;
+}
+
+// --------------------------------------------------------------------
+// Parses a comma separated list of unsigned integers
+static std::vector<unsigned int> parseList( const char* s )
+{
+    std::vector<unsigned int> ret;
+    while( *s )
+    {
+        char* end = 0;
+        const unsigned long v = strtoul( s, &end, 10 );
+        if( end == s )
+        {
+            break;
+        }
+        ret.push_back( (unsigned int)v );
+        s = ( *end == ',' ) ? end + 1 : end;
+    }
+    return ret;
+}
+
+// --------------------------------------------------------------------
+static void usage( const char* exe )
+{
+    std::cerr
+        << "Usage: " << exe << " [options]\n"
+        << "  --particles LIST   comma separated particle counts (default 10000,100000)\n"
+        << "  --frames N         measured frames per run (default 600)\n"
+        << "  --simulate         step the simulation every frame (default: upload the same positions)\n";
+}
+
+// --------------------------------------------------------------------
+int main( int argc, char** argv )
+{
+    std::vector<unsigned int> counts = { 10000, 100000 };
+    unsigned int frames = 600;
+    bool simulate = false;
+
+    for( int a = 1; a < argc; ++a )
+    {
+        const std::string arg = argv[a];
+        const bool hasValue = a + 1 < argc;
+        if( arg == "--particles" && hasValue ) counts = parseList( argv[++a] );
+        else if( arg == "--frames" && hasValue ) frames = (unsigned int)strtoul( argv[++a], 0, 10 );
+        else if( arg == "--simulate" ) simulate = true;
+        else
+        {
+            usage( argv[0] );
+            return arg == "--help" || arg == "-h" ? 0 : 1;
+        }
+    }
+    if( counts.empty() || frames == 0 )
+    {
+        usage( argv[0] );
+        return 1;
+    }
+
+    if( !createContext() )
+    {
+        return 1;
+    }
+    const bool streaming = isGLVertexStreamSupported();
+    if( !streaming )
+    {
+        std::cout << "glBufferStorage is not supported, only measuring glBufferData" << std::endl;
+    }
+
+    const GLuint program = createProgram();
+    glUseProgram( program );
+    glEnable( GL_PROGRAM_POINT_SIZE );
+    glViewport( 0, 0, WIDTH, HEIGHT );
+
+    for( const unsigned int count : counts )
+    {
+        std::cout << "--------------------------------" << std::endl;
+        std::cout << "Number of particles: " << count << " (" << count * sizeof( Particles::Position ) / 1024 << " KiB per frame)" << std::endl;
+        for( int path = 0; path < ( streaming ? 2 : 1 ); ++path )
+        {
+            const UploadResult r = run( count, frames, simulate, path == 1 );
+            std::printf( "  %-22s upload %9.2f us (p50 %9.2f, p99 %9.2f, fence wait %7.2f)   frame %9.2f us\n",
+                path ? "persistent mapped" : "glBufferData", r.uploadMean, r.uploadP50, r.uploadP99, r.waitMean, r.frameMean );
+        }
+    }
+
+    glDeleteProgram( program );
+    return 0;
+}
@@ -0,0 +1,465 @@
+// Real-Time Physics Tutorials
+// Brandon Pelfrey
+// SPH Fluid Simulation
+
+#include <trajectory.h>
+
+#include <omp.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+using namespace std::chrono;
+
+static const char TRAJECTORY_MAGIC[8] = { 'S', 'P', 'H', 'T', 'R', 'A', 'J', 0 };
+
+// Differences take at most 3 bytes of 7 bits each
+static const int64_t TRAJECTORY_DELTA_LIMIT = (int64_t)1 << 20;
+
+// --------------------------------------------------------------------
+static bool seekTo( FILE* f, const uint64_t offset )
+{
+#ifdef _WIN32
+    return _fseeki64( f, (__int64)offset, SEEK_SET ) == 0;
+#else
+    return fseeko( f, (off_t)offset, SEEK_SET ) == 0;
+#endif
+}
+
+// --------------------------------------------------------------------
+// Little-endian base 128 of the zigzag encoded difference, 1 to 3 bytes
+static inline unsigned char* putDelta( unsigned char* p, const int64_t d )
+{
+    uint64_t z = ( (uint64_t)d << 1 ) ^ (uint64_t)( d >> 63 );
+    while( z >= 0x80 )
+    {
+        *p++ = (unsigned char)( z | 0x80 );
+        z >>= 7;
+    }
+    *p++ = (unsigned char)z;
+    return p;
+}
+
+static inline const unsigned char* getDelta( const unsigned char* p, const unsigned char* end, int64_t* d )
+{
+    uint64_t z = 0;
+    for( int shift = 0; p < end && shift < 21; shift += 7 )
+    {
+        const unsigned char b = *p++;
+        z |= (uint64_t)( b & 0x7f ) << shift;
+        if( !( b & 0x80 ) )
+        {
+            *d = (int64_t)( z >> 1 ) ^ -(int64_t)( z & 1 );
+            return p;
+        }
+    }
+    return 0;
+}
+
+// --------------------------------------------------------------------
+TrajectoryWriter::TrajectoryWriter()
+    : mFile( 0 ), mN( 0 ), mOk( true ), mClosing( false ), mOffset( 0 )
+{
+    memset( &mStats, 0, sizeof( mStats ) );
+}
+
+TrajectoryWriter::~TrajectoryWriter()
+{
+    Close();
+}
+
+// --------------------------------------------------------------------
+bool TrajectoryWriter::Open( const char* path, const Options& options )
+{
+    Close();
+    mFile = fopen( path, "wb" );
+    if( !mFile )
+    {
+        return false;
+    }
+    mOptions = options;
+    mOptions.keyframeInterval = std::max( 1u, options.keyframeInterval );
+    mOptions.queueFrames = std::max( 1u, options.queueFrames );
+    mN = particles.N;
+    mOk = true;
+    mClosing = false;
+    memset( &mStats, 0, sizeof( mStats ) );
+
+    TrajectoryHeader h;
+    memset( &h, 0, sizeof( h ) );
+    memcpy( h.magic, TRAJECTORY_MAGIC, sizeof( h.magic ) );
+    h.version = TRAJECTORY_VERSION;
+    h.dimension = SPH_DIMENSION;
+    h.N = mN;
+    h.quantum = mOptions.quantum;
+    h.keyframeInterval = mOptions.keyframeInterval;
+    mOk = fwrite( &h, sizeof( h ), 1, mFile ) == 1;
+    mOffset = sizeof( h );
+    mStats.bytes = mOffset;
+
+    mFrames.resize( mOptions.queueFrames );
+    mFree.clear();
+    mQueued.clear();
+    for( unsigned int b = 0; b < mOptions.queueFrames; ++b )
+    {
+        mFrames[b].positions.resize( mN );
+        mFree.push_back( b );
+    }
+    mLast.resize( SPH_DIMENSION * (size_t)mN );
+    // (worst case: 3 bytes per coordinate, or 4 for a keyframe)
+    mPayload.resize( 4 * SPH_DIMENSION * (size_t)mN );
+    mIndex.clear();
+
+    mThread = std::thread( &TrajectoryWriter::Run, this );
+    return true;
+}
+
+// --------------------------------------------------------------------
+void TrajectoryWriter::Record()
+{
+    if( !mFile || particles.N != mN )
+    {
+        return;
+    }
+    const high_resolution_clock::time_point start = high_resolution_clock::now();
+
+    unsigned int b;
+    {
+        std::unique_lock<std::mutex> lock( mMutex );
+        mChanged.wait( lock, [this]() { return !mFree.empty(); } );
+        b = mFree.back();
+        mFree.pop_back();
+    }
+    const high_resolution_clock::time_point filling = high_resolution_clock::now();
+
+    // Storage order changes with reordering, frames are in stable id order
+    Frame& frame = mFrames[b];
+    frame.step = stepCount();
+    vecD* positions = &frame.positions[0];
+#pragma omp parallel for
+    for( int s = 0; s < (int)mN; ++s )
+    {
+        positions[s] = particles.pos( particles.storage_index[s] );
+    }
+
+    const high_resolution_clock::time_point end = high_resolution_clock::now();
+    {
+        std::lock_guard<std::mutex> lock( mMutex );
+        mQueued.push_back( b );
+        mStats.recordUs += duration<double, std::micro>( end - start ).count();
+        mStats.waitUs += duration<double, std::micro>( filling - start ).count();
+    }
+    mChanged.notify_all();
+}
+
+// --------------------------------------------------------------------
+bool TrajectoryWriter::Close()
+{
+    if( !mFile )
+    {
+        return true;
+    }
+    {
+        std::lock_guard<std::mutex> lock( mMutex );
+        mClosing = true;
+    }
+    mChanged.notify_all();
+    mThread.join();
+
+    // Seek index and footer
+    TrajectoryFooter footer;
+    memset( &footer, 0, sizeof( footer ) );
+    footer.indexOffset = mOffset;
+    footer.frameCount = (uint32_t)mIndex.size();
+    memcpy( footer.magic, TRAJECTORY_MAGIC, sizeof( footer.magic ) );
+    if( !mIndex.empty() )
+    {
+        mOk = mOk && fwrite( &mIndex[0], sizeof( TrajectoryIndexEntry ), mIndex.size(), mFile ) == mIndex.size();
+    }
+    mOk = mOk && fwrite( &footer, sizeof( footer ), 1, mFile ) == 1;
+    mOk = fclose( mFile ) == 0 && mOk;
+    mFile = 0;
+    {
+        std::lock_guard<std::mutex> lock( mMutex );
+        mStats.bytes += mIndex.size() * sizeof( TrajectoryIndexEntry ) + sizeof( footer );
+    }
+
+    mFrames.clear();
+    mLast.clear();
+    mPayload.clear();
+    return mOk;
+}
+
+// --------------------------------------------------------------------
+TrajectoryWriter::Stats TrajectoryWriter::GetStats() const
+{
+    std::lock_guard<std::mutex> lock( mMutex );
+    return mStats;
+}
+
+// --------------------------------------------------------------------
+void TrajectoryWriter::Run()
+{
+    for( ;; )
+    {
+        unsigned int b;
+        {
+            std::unique_lock<std::mutex> lock( mMutex );
+            mChanged.wait( lock, [this]() { return mClosing || !mQueued.empty(); } );
+            if( mQueued.empty() )
+            {
+                return;
+            }
+            b = mQueued.front();
+            mQueued.erase( mQueued.begin() );
+        }
+
+        Encode( mFrames[b] );
+
+        {
+            std::lock_guard<std::mutex> lock( mMutex );
+            mFree.push_back( b );
+        }
+        mChanged.notify_all();
+    }
+}
+
+// --------------------------------------------------------------------
+void TrajectoryWriter::Encode( const Frame& frame )
+{
+    const high_resolution_clock::time_point start = high_resolution_clock::now();
+    const vecD* positions = &frame.positions[0];
+    const float invQuantum = 1.0f / mOptions.quantum;
+
+    bool keyframe = mIndex.size() % mOptions.keyframeInterval == 0;
+    unsigned char* p = &mPayload[0];
+    if( !keyframe )
+    {
+        int64_t* last = &mLast[0];
+        for( unsigned int s = 0; s < mN && !keyframe; ++s )
+        {
+            for( int d = 0; d < SPH_DIMENSION; ++d, ++last )
+            {
+                const int64_t q = llroundf( positions[s][d] * invQuantum );
+                const int64_t delta = q - *last;
+                if( delta <= -TRAJECTORY_DELTA_LIMIT || delta >= TRAJECTORY_DELTA_LIMIT )
+                {
+                    keyframe = true;
+                    break;
+                }
+                p = putDelta( p, delta );
+                *last = q;
+            }
+        }
+    }
+    if( keyframe )
+    {
+        // (also after a difference was too large, the partly updated mLast is overwritten here)
+        memcpy( &mPayload[0], positions, mN * sizeof( vecD ) );
+        p = &mPayload[0] + mN * sizeof( vecD );
+        for( unsigned int s = 0; s < mN; ++s )
+        {
+            for( int d = 0; d < SPH_DIMENSION; ++d )
+            {
+                mLast[SPH_DIMENSION * s + d] = llroundf( positions[s][d] * invQuantum );
+            }
+        }
+    }
+
+    TrajectoryFrameHeader h;
+    h.step = frame.step;
+    h.keyframe = keyframe;
+    h.bytes = (uint64_t)( p - &mPayload[0] );
+    mOk = mOk && fwrite( &h, sizeof( h ), 1, mFile ) == 1
+        && ( h.bytes == 0 || fwrite( &mPayload[0], 1, (size_t)h.bytes, mFile ) == h.bytes );
+
+    TrajectoryIndexEntry e;
+    e.step = frame.step;
+    e.keyframe = keyframe;
+    e.offset = mOffset;
+    mIndex.push_back( e );
+    mOffset += sizeof( h ) + h.bytes;
+
+    std::lock_guard<std::mutex> lock( mMutex );
+    mStats.frames++;
+    mStats.keyframes += keyframe;
+    mStats.bytes += sizeof( h ) + h.bytes;
+    mStats.encodeUs += duration<double, std::micro>( high_resolution_clock::now() - start ).count();
+}
+
+// --------------------------------------------------------------------
+TrajectoryReader::TrajectoryReader()
+    : mFile( 0 ), mCurrent( 0 ), mStride( 0 )
+{
+    memset( &mHeader, 0, sizeof( mHeader ) );
+}
+
+TrajectoryReader::~TrajectoryReader()
+{
+    Close();
+}
+
+// --------------------------------------------------------------------
+bool TrajectoryReader::Open( const char* path )
+{
+    Close();
+    mFile = fopen( path, "rb" );
+    if( !mFile )
+    {
+        return false;
+    }
+
+    TrajectoryFooter footer;
+    bool ok = fread( &mHeader, sizeof( mHeader ), 1, mFile ) == 1
+        && memcmp( mHeader.magic, TRAJECTORY_MAGIC, sizeof( mHeader.magic ) ) == 0
+        && mHeader.version == TRAJECTORY_VERSION
+        && mHeader.dimension == SPH_DIMENSION
+        && fseek( mFile, -(long)sizeof( footer ), SEEK_END ) == 0
+        && fread( &footer, sizeof( footer ), 1, mFile ) == 1
+        && memcmp( footer.magic, TRAJECTORY_MAGIC, sizeof( footer.magic ) ) == 0;
+    if( ok )
+    {
+        mIndex.resize( footer.frameCount );
+        ok = seekTo( mFile, footer.indexOffset )
+            && ( mIndex.empty() || fread( &mIndex[0], sizeof( TrajectoryIndexEntry ), mIndex.size(), mFile ) == mIndex.size() )
+            && ( mIndex.empty() || mIndex[0].keyframe );
+    }
+    if( !ok )
+    {
+        Close();
+        return false;
+    }
+    mQuantized.resize( SPH_DIMENSION * (size_t)mHeader.N );
+    mPositions.resize( mHeader.N );
+    mCurrent = FrameCount();
+
+    mStride = FrameCount() > 1 && mIndex[1].step > mIndex[0].step ? mIndex[1].step - mIndex[0].step : 0;
+    for( unsigned int f = 2; f < FrameCount() && mStride; ++f )
+    {
+        if( mIndex[f].step - mIndex[f - 1].step != mStride )
+        {
+            mStride = 0;
+        }
+    }
+    return true;
+}
+
+// --------------------------------------------------------------------
+void TrajectoryReader::Close()
+{
+    if( mFile )
+    {
+        fclose( mFile );
+        mFile = 0;
+    }
+    memset( &mHeader, 0, sizeof( mHeader ) );
+    mIndex.clear();
+    mCurrent = 0;
+    mStride = 0;
+}
+
+// --------------------------------------------------------------------
+unsigned int TrajectoryReader::FrameAt( const unsigned int step ) const
+{
+    if( mStride )
+    {
+        return step <= mIndex[0].step ? 0 : std::min( ( step - mIndex[0].step ) / mStride, FrameCount() - 1 );
+    }
+
+    // Steps only grow, unless the simulation was restarted while recording
+    unsigned int lo = 0, hi = FrameCount();
+    while( hi - lo > 1 )
+    {
+        const unsigned int mid = ( lo + hi ) / 2;
+        if( mIndex[mid].step <= step ) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// --------------------------------------------------------------------
+bool TrajectoryReader::Read( const unsigned int frame, std::vector<vecD>& positions )
+{
+    if( frame >= FrameCount() )
+    {
+        return false;
+    }
+    if( frame != mCurrent )
+    {
+        // Continue from the decoded frame if it lies between the keyframe and the target.
+        // The scheduled keyframe is frame / keyframeInterval * keyframeInterval,
+        // a keyframe forced by a large difference may lie closer.
+        unsigned int key = frame;
+        while( !mIndex[key].keyframe )
+        {
+            key--;
+        }
+        const unsigned int first = mCurrent < frame && mCurrent >= key ? mCurrent + 1 : key;
+        for( unsigned int f = first; f <= frame; ++f )
+        {
+            if( !Decode( f ) )
+            {
+                mCurrent = FrameCount();
+                return false;
+            }
+        }
+    }
+    positions = mPositions;
+    return true;
+}
+
+// --------------------------------------------------------------------
+bool TrajectoryReader::Decode( const unsigned int frame )
+{
+    TrajectoryFrameHeader h;
+    if( !seekTo( mFile, mIndex[frame].offset ) || fread( &h, sizeof( h ), 1, mFile ) != 1 )
+    {
+        return false;
+    }
+    mPayload.resize( (size_t)h.bytes );
+    if( h.bytes && fread( &mPayload[0], 1, (size_t)h.bytes, mFile ) != h.bytes )
+    {
+        return false;
+    }
+
+    const unsigned int N = mHeader.N;
+    const float invQuantum = 1.0f / mHeader.quantum;
+    if( h.keyframe )
+    {
+        if( h.bytes != N * sizeof( vecD ) )
+        {
+            return false;
+        }
+        memcpy( &mPositions[0], &mPayload[0], (size_t)h.bytes );
+        for( unsigned int s = 0; s < N; ++s )
+        {
+            for( int d = 0; d < SPH_DIMENSION; ++d )
+            {
+                mQuantized[SPH_DIMENSION * s + d] = llroundf( mPositions[s][d] * invQuantum );
+            }
+        }
+    }
+    else
+    {
+        const unsigned char* p = mPayload.empty() ? 0 : &mPayload[0];
+        const unsigned char* end = p + mPayload.size();
+        int64_t* quantized = &mQuantized[0];
+        for( unsigned int s = 0; s < N; ++s )
+        {
+            for( int d = 0; d < SPH_DIMENSION; ++d, ++quantized )
+            {
+                int64_t delta;
+                if( !( p = getDelta( p, end, &delta ) ) )
+                {
+                    return false;
+                }
+                *quantized += delta;
+                mPositions[s][d] = *quantized * mHeader.quantum;
+            }
+        }
+    }
+    mCurrent = frame;
+    return true;
+}